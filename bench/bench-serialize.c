@@ -0,0 +1,191 @@
+/* Serialization throughput: pmc_send on a large metric set, against the
+ * printf based writer the client used to have (vsnprintf twice per line,
+ * every value printed with %f).
+ *
+ * The sink only counts bytes, so the numbers are serialization cost (plus
+ * the HTTP header) only.
+ *
+ * "pmc_send" updates every item before each push, so everything is
+ * rendered. "cached" only updates 1% of the gauges: the rest comes from
+ * the serialization cache. "protobuf" renders everything, in the
+ * delimited protobuf format. "gzip" is "cached", with the body gzipped:
+ * mostly the cost of the compression.
+ */
+#if !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "prometheus-client.h"
+
+#define BUCKET_COUNT 2000
+#define GAUGE_COUNT 200
+#define ITERATIONS 200
+
+static size_t sink_bytes = 0;
+
+int pmc_output_data(const void *bytes, size_t size)
+{
+    (void)bytes;
+    sink_bytes += size;
+    return 0;
+}
+
+void pmc_handle_error(enum pmc_error err)
+{
+    fprintf(stderr, "pmc error %d\n", (int)err);
+    abort();
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+struct ref_buffer {
+    char *ptr;
+    size_t usage;
+    size_t size;
+};
+
+/* the former wbuffer_printf: size with vsnprintf, then write */
+static void ref_printf(struct ref_buffer *b, const char *fmt, ...)
+{
+    va_list args_count;
+    va_list args_write;
+    int res;
+
+    va_start(args_count, fmt);
+    va_copy(args_write, args_count);
+
+    res = vsnprintf(NULL, 0, fmt, args_count) + 1;
+    if (b->usage + (size_t)res >= b->size) {
+        b->size = (b->usage + (size_t)res) * 2;
+        b->ptr = (char*)realloc(b->ptr, b->size);
+        assert(NULL != b->ptr);
+    }
+    res = vsnprintf(b->ptr + b->usage, (size_t)res, fmt, args_write);
+    b->usage += (size_t)res;
+
+    va_end(args_count);
+    va_end(args_write);
+}
+
+static void ref_serialize(struct ref_buffer *b,
+                          const float *buckets,
+                          const float *values)
+{
+    float count = 0.f;
+    float sum = 0.f;
+    size_t i;
+
+    b->usage = 0;
+    for (i = 0; i < GAUGE_COUNT; i++) {
+        ref_printf(b, "# TYPE %s_%s%zu gauge\n", "bench", "gauge_", i);
+        ref_printf(b, "%s_%s%zu %f\n", "bench", "gauge_", i,
+                   (double)values[i]);
+    }
+
+    ref_printf(b, "# TYPE %s_%s histogram\n", "bench", "latency");
+    for (i = 0; i < BUCKET_COUNT; i++) {
+        count += values[i];
+        ref_printf(b, "%s_%s_bucket{le=\"%f\"} %f\n", "bench", "latency",
+                   (double)buckets[i], (double)count);
+        sum += values[i] * buckets[i];
+    }
+    ref_printf(b, "%s_%s_bucket{le=\"+Inf\"} %f\n", "bench", "latency",
+               (double)count);
+    ref_printf(b, "%s_%s_count %f\n", "bench", "latency", (double)count);
+    ref_printf(b, "%s_%s_sum %f\n", "bench", "latency", (double)sum);
+}
+
+static void report(const char *name, size_t bytes, double seconds)
+{
+    printf("%-10s %10zu bytes/push %8.3f ms/push %10.1f MB/s\n", name,
+           bytes / ITERATIONS, seconds * 1e3 / ITERATIONS,
+           (double)bytes / seconds / 1e6);
+}
+
+int main(void)
+{
+    static float buckets[BUCKET_COUNT];
+    static float values[BUCKET_COUNT];
+    static pmc_gauge_h gauges[GAUGE_COUNT];
+    struct ref_buffer ref = { NULL, 0, 0 };
+    pmc_histogram_h latency = NULL;
+    char name[32];
+    pmc_metric_s m = NULL;
+    size_t bytes = 0;
+    double start;
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < BUCKET_COUNT; i++) {
+        buckets[i] = 0.25f * (float)(i + 1);
+        values[i] = (float)((i * 7919) % 1000);
+    }
+
+    m = pmc_initialize("bench");
+    for (i = 0; i < GAUGE_COUNT; i++) {
+        snprintf(name, sizeof(name), "gauge_%zu", i);
+        gauges[i] = pmc_create_gauge(m, name, values[i] * 0.001f);
+    }
+    latency = pmc_create_histogram(m, "latency", BUCKET_COUNT, buckets,
+                                   values);
+
+    start = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        ref_serialize(&ref, buckets, values);
+        bytes += ref.usage;
+    }
+    report("printf", bytes, now() - start);
+
+    start = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        for (j = 0; j < GAUGE_COUNT; j++) {
+            pmc_gauge_set(gauges[j], values[j] * 0.001f);
+        }
+        pmc_histogram_update(latency, BUCKET_COUNT, values);
+        pmc_send(m);
+    }
+    report("pmc_send", sink_bytes, now() - start);
+
+    sink_bytes = 0;
+    start = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        for (j = i % 100; j < GAUGE_COUNT; j += 100) {
+            pmc_gauge_add(gauges[j], 1.f);
+        }
+        pmc_send(m);
+    }
+    report("cached", sink_bytes, now() - start);
+
+    pmc_set_compression(m, 1024);
+    sink_bytes = 0;
+    start = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        pmc_send(m);
+    }
+    report("gzip", sink_bytes, now() - start);
+    pmc_set_compression(m, 0);
+
+    pmc_set_format(m, PMC_FORMAT_PROTOBUF);
+    sink_bytes = 0;
+    start = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        pmc_send(m);
+    }
+    report("protobuf", sink_bytes, now() - start);
+
+    pmc_destroy(m);
+    free(ref.ptr);
+    return 0;
+}
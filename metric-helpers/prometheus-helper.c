@@ -306,18 +306,18 @@ static void parse_meminfo(struct pmc_meminfo *out)
     fclose(f);
 }
 
-float pmc_get_vsize(void)
+double pmc_get_vsize(void)
 {
     struct pmc_stat info;
     parse_stat(&info);
-    return info.vsize;
+    return (double)info.vsize;
 }
 
-float pmc_get_anonymous_mappings_size(void)
+double pmc_get_anonymous_mappings_size(void)
 {
     struct pmc_maps maps;
     size_t i;
-    float size = 0.f;
+    double size = 0.;
 
     parse_maps(&maps);
 
@@ -326,16 +326,16 @@ float pmc_get_anonymous_mappings_size(void)
         if (maps.mappings[i].inode != 0) {
             continue;
         }
-        size += (float)maps.mappings[i].size;
+        size += (double)maps.mappings[i].size;
     }
 
     free_maps(&maps);
     return size;
 }
 
-float pmc_get_available_memory(void)
+double pmc_get_available_memory(void)
 {
     struct pmc_meminfo info;
     parse_meminfo(&info);
-    return (float)info.mem_available;
+    return (double)info.mem_available;
 }
@@ -1,5 +1,5 @@
 #pragma once
 
-float pmc_get_vsize(void);
-float pmc_get_anonymous_mappings_size(void);
-float pmc_get_available_memory(void);
+double pmc_get_vsize(void);
+double pmc_get_anonymous_mappings_size(void);
+double pmc_get_available_memory(void);
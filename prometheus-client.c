@@ -3,17 +3,40 @@
 #endif
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
-#include <stdarg.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__AVX__) || defined(__SSE2__)
+    #include <immintrin.h>
+#endif
+
+#if defined(PMC_HAVE_ZLIB)
+    #include <zlib.h>
+#endif
+
+#if defined(__linux__)
+    #include <netinet/in.h>
+    #include <sched.h>
+    #include <sys/epoll.h>
+    #include <sys/socket.h>
+#endif
+
 #include "prometheus-client.h"
 
+/* pmc_output_datav is optional: its address is NULL when no sink
+ * defines it */
+#pragma weak pmc_output_datav
+
 /* %zu became supported in MSVC starting VS2015 */
 #if (defined(_MSC_VER) && !defined(__INTEL_COMPILER)) || defined(__MINGW32__)
     #define SIZE_T_FMT "%Iu"
@@ -35,40 +58,375 @@
 /* note regarding strdup:
  * strdup is not posix. With c89, _GNU_SOURCE is needed. On MSVC,
  * it's available. on std >= c99, it's available.
- * For now, strdup is replaced with malloc + strlen
+ * Names are copied in the metric set's arena anyway, see pmc_arena_strdup.
  */
 
 typedef enum {
     PM_NONE,
     PM_GAUGE,
     PM_HISTOGRAM,
+    PM_COUNTER,
+    PM_SUMMARY,
+    PM_NATIVE_HISTOGRAM,
     PM_TYPE_COUNT
 } pmc_type_e;
 
-struct pmc_item_list {
-    struct pmc_item_list *next;
+/* LABELS:
+ * a series is a name, plus an optional set of labels. Label names and
+ * values are interned in the set's string table (see pmc_intern), so the
+ * series of a metric share their strings. Labels are sorted by name: the
+ * order they are given in does not matter. *text* is the rendered
+ * 'name="value",...', escaped, and interned too. *hash* does not depend
+ * on the order either, so lookups do not need to sort. */
+struct pmc_labels {
+    size_t count;
+    uint32_t hash;
+    const char **names;
+    const char **values;
+    const char *text;
+};
+
+/* what the index knows about a metric. The name and its hash live here so
+ * the index can compare keys without knowing the concrete item type.
+ * *labels* is NULL for a series without labels. *sibling* is the next
+ * series of the same family. */
+struct pmc_key {
+    const char *name;
+    uint32_t hash;
     pmc_type_e type;
-    char padding[4];
+    const struct pmc_labels *labels;
+    struct pmc_key *sibling;
+};
+
+/* FAMILIES:
+ * series sharing a name and a type form a family. The exposition formats
+ * want a family in one piece, under a single # HELP and # TYPE header:
+ * series are chained in their family at creation, and families are
+ * serialized in creation order. The header is rendered once, when the
+ * family is created or its help text set.
+ * Families have their own index, keyed by (type, name), without labels. */
+struct pmc_family {
+    struct pmc_key key;  /* first: the family index points here */
+    const char *help;    /* NULL when none */
+    const char *header;  /* "# HELP ...\n# TYPE ...\n" */
+    size_t header_len;
+    struct pmc_key *first;
+    struct pmc_key *last;
+    struct pmc_family *next;
+};
+
+/* SAMPLE NAMES:
+ * the text format has a single namespace: a histogram "lat" writes
+ * lat_bucket, lat_count and lat_sum, which a gauge "lat_count" would write
+ * too, and a gauge "lat" would repeat the family name. Each family claims
+ * its name and the names of its samples in the sample index, as keys of
+ * type PM_NONE. A family whose names are already claimed is rejected. */
+#define PMC_CLAIMS_MAX 4
+
+/* text of a metric as last serialized, see pmc_serialize_item */
+struct pmc_fragment {
+    char *ptr;
+    size_t len;
+    size_t size;
+};
+
+/* the text of each line of a series up to its value, rendered once at
+ * creation: line i spans [offsets[i], offsets[i + 1]) of *text*. Names,
+ * labels and bounds never change, only the values are formatted on send.
+ * See pmc_prefixes_store and pmc_put_prefix. */
+struct pmc_prefixes {
+    char *text;
+    uint32_t *offsets;
+};
+
+/* counters, histograms and summaries start with this header. The
+ * fragment is reused until an update sets *dirty*. */
+struct pmc_item_list {
+    struct pmc_key key; /* first: the index points here */
+    struct pmc_fragment fragment;
+    uint32_t dirty;
 };
 
+/* values shared with writer threads are stored as bit patterns, and only
+ * accessed with the atomic_* helpers below.
+ * A gauge handle points to the gauge's value, right in the values array of
+ * its block (see struct pmc_gauge_block). */
 struct pmc_item_gauge {
+    uint64_t value; /* double */
+};
+
+/* COUNTERS:
+ * a counter has one cell per CPU. Threads add to the cell of the CPU they
+ * run on (see pmc_counter_row), so increments from different CPUs never
+ * share a cache line, and the serializer sums the cells. Cells are still
+ * updated atomically: a thread can be moved to another CPU right after
+ * looking its CPU up.
+ * Cells are allocated by blocks of PMC_COUNTER_BLOCK counters, grouped by
+ * CPU: the row of a CPU holds a cell of each counter of the block, is
+ * cache line aligned, and is only written from that CPU. A counter is the
+ * column *cells*, PMC_COUNTER_BLOCK cells apart.
+ * Increments touch nothing else: instead of a dirty flag, the sum is
+ * compared with *rendered*, the value of the cached fragment. */
+#define PMC_COUNTER_BLOCK 64 /* a row is 8 cache lines */
+
+struct pmc_counter_block {
+    uint64_t *cells; /* cpu_count rows of PMC_COUNTER_BLOCK doubles */
+    size_t count;
+};
+
+struct pmc_item_counter {
     struct pmc_item_list list;
-    char *name;
-    float value;
-    char padding[4];
+    uint64_t *cells;  /* doubles */
+    size_t cpu_count;
+    uint64_t rendered; /* double */
+};
+
+/* sharded histograms: each thread observes into its own row of counts,
+ * so writers never share a cache line. Rows hold *size* + 1 counts (the
+ * last one is +Inf), then the sum of their observations (a double, see
+ * PMC_ROW_SUM), and are *shard_stride* counts apart, a multiple of a
+ * cache line. Rows are merged only when the histogram is serialized.
+ * For regular histograms, shard_count is 0 and shards is NULL. */
+struct pmc_window;
+
+/* BUCKET LAYOUTS:
+ * bounds following a linear, log-linear (HDR) or exponential law are
+ * recognized at creation, whoever computed them. The bucket of a value is
+ * then guessed arithmetically, as (x(value) - origin) * scale, where x is
+ * the value itself, its bit pattern, or a fast log2 (see pmc_layout_x).
+ * Log-linear bounds split each power of 2 in equal parts: their bit
+ * patterns are equally spaced. The guess is kept within a bucket of every
+ * bound (see pmc_layout_detect): a compare or two settle it, whatever the
+ * number of buckets. Other bounds are searched. */
+enum pmc_layout_kind {
+    PMC_LAYOUT_NONE,
+    PMC_LAYOUT_LINEAR,
+    PMC_LAYOUT_LOG_LINEAR,
+    PMC_LAYOUT_EXPONENTIAL
+};
+
+struct pmc_layout {
+    enum pmc_layout_kind kind;
+    double origin; /* x(buckets[0]) */
+    double scale;
 };
 
 struct pmc_item_histogram {
     struct pmc_item_list list;
-    char *name;
     size_t size;
-    float *buckets;
-    float *values;
+    double *buckets; /* see PMC_BOUND_LANES */
+    struct pmc_layout layout;
+    struct pmc_prefixes prefixes; /* see pmc_histogram_prefixes */
+    uint64_t *counts;
+    uint64_t overflow; /* observations above the last bound */
+    double sum; /* of the observations not in a row */
+    size_t shard_count;
+    size_t shard_stride;
+    uint64_t *shards;
+    struct pmc_window *window; /* NULL unless windowed */
+};
+
+/* WINDOWS:
+ * a windowed histogram only reports the observations of the last
+ * *slot_count* slots of *slot_ns* nanoseconds, the current one included.
+ * Time comes from the monotonic clock. Observations go into a ring of rows
+ * (same layout as shards), one per slot: a row counts the slot stored in
+ * *slots*. The first observation of a new slot clears the row it lands in,
+ * which belonged to a slot already out of the window: rotating is
+ * O(buckets), and nothing is allocated after creation. The serializer only
+ * adds the rows of the slots still in the window, so rows nobody observed
+ * into expire as well. */
+#define PMC_WINDOW_SLOTS_MAX 64
+
+struct pmc_window {
+    uint64_t slot_ns;
+    size_t slot_count;
+    size_t stride;
+    uint64_t *slots;
+    uint64_t *rows;
+};
+
+/* SUMMARIES:
+ * quantiles are estimated with the CKMS targeted quantiles sketch
+ * (Cormode, Korn, Muthukrishnan, Srivastava), as in the Go client.
+ * Observations are appended to *buffer*. When it is full, it is sorted and
+ * merged into the sample list, which is then compressed. A sample stands
+ * for *width* observations, and its rank is known up to *delta*. For each
+ * target quantile, the rank error stays within *error* times the number
+ * of observations, with O(1/error * log(error * n)) samples.
+ * Samples live on the heap, allocated on the first merge; the rest is in
+ * the arena. *lock* protects everything but the list header: observations
+ * come from any thread, while pmc_send queries the sketch.
+ * Windowed summaries keep *sketch_count* sketches, all fed with every
+ * observation, as the Go client does. At each slot boundary, the oldest is
+ * reset: quantiles come from the oldest remaining one, which covers
+ * between sketch_count - 1 and sketch_count slots. _count and _sum are
+ * never reset. */
+#define PMC_SUMMARY_BUFFER 500
+
+struct pmc_sample {
+    double value;
+    uint64_t width;
+    uint64_t delta;
+};
+
+struct pmc_sketch {
+    struct pmc_sample *samples;
+    struct pmc_sample *scratch; /* merge output, swapped with samples */
+    size_t sample_count;
+    size_t capacity;
+    uint64_t merged; /* observations in the samples */
+};
+
+struct pmc_item_summary {
+    struct pmc_item_list list;
+    pthread_mutex_t lock;
+    size_t size;
+    const double *quantiles;
+    double *estimates; /* filled when serialized */
+    double error;
+    uint64_t count;
+    double sum;
+    struct pmc_sketch *sketches;
+    size_t sketch_count;
+    size_t head;      /* the oldest sketch */
+    uint64_t slot_ns; /* 0 unless windowed */
+    uint64_t slot;    /* slot of the last rotation */
+    size_t buffered;
+    double *buffer; /* PMC_SUMMARY_BUFFER values */
+    struct pmc_prefixes prefixes; /* see pmc_summary_prefixes */
+    struct pmc_item_summary *next_summary; /* see pmc_destroy */
+};
+
+/* NATIVE HISTOGRAMS:
+ * exponential buckets, as Prometheus native histograms. With schema s,
+ * bucket i holds the values in (2^((i - 1) / 2^s), 2^(i / 2^s)]. Negative
+ * values go in the negative bucket of their absolute value, and values
+ * within PMC_NATIVE_ZERO_THRESHOLD of 0 in the zero bucket. There is no
+ * layout to give: only the populated buckets exist, in a hash table per
+ * sign, keyed by bucket index. The index comes from the bits of the
+ * value, see pmc_native_key.
+ * Past *max_buckets* populated buckets, the schema is decreased: buckets
+ * are merged pairwise, as in the Go client.
+ * Tables live on the heap; *lock* protects everything but the list
+ * header. */
+#define PMC_NATIVE_SCHEMA_MIN (-4)
+#define PMC_NATIVE_SCHEMA_MAX 8
+#define PMC_NATIVE_ZERO_THRESHOLD 2.938735877055719e-39 /* 2^-128 */
+#define PMC_NATIVE_LOOKUP_BITS 10
+#define PMC_NATIVE_GAP_MAX 2 /* empty buckets sent rather than a new span */
+
+struct pmc_native_bucket {
+    int32_t key;
+    uint64_t count; /* 0: free slot */
+};
+
+struct pmc_native_buckets {
+    struct pmc_native_bucket *slots;
+    size_t capacity; /* a power of 2, 0 before the first bucket */
+    size_t count;
+};
+
+struct pmc_item_native {
+    struct pmc_item_list list;
+    pthread_mutex_t lock;
+    int schema;
+    size_t max_buckets; /* 0: no limit */
+    uint64_t count;
+    double sum;
+    uint64_t zero_count;
+    struct pmc_native_buckets positive;
+    struct pmc_native_buckets negative;
+    double *bounds;   /* schemas > 0: bucket edges within an octave */
+    uint16_t *lookup; /* first edge for the top bits of the mantissa */
+    struct pmc_native_bucket *sorted; /* see pmc_native_query */
+    size_t sorted_capacity;
+    struct pmc_item_native *next_native; /* see pmc_destroy */
+};
+
+/* GAUGES:
+ * gauges are stored by blocks, as parallel arrays, so that serialization
+ * and bulk updates stream through memory:
+ *  - values: written by the updates, read by the serializer. Cache line
+ *    aligned, and nothing else in those lines.
+ *  - rendered: the value each cached fragment was rendered with. A gauge
+ *    is rendered again only when its value changed: updates are a single
+ *    store, with no dirty flag to maintain.
+ *  - fragments, keys: serialization and lookups only.
+ * Blocks are never resized: handles stay valid. */
+struct pmc_gauge_key {
+    struct pmc_key key; /* first: the index points here */
+    struct pmc_item_gauge *value;
+    struct pmc_gauge_block *block;
+};
+
+struct pmc_gauge_block {
+    struct pmc_item_gauge *values;
+    uint64_t *rendered;
+    struct pmc_fragment *fragments;
+    struct pmc_gauge_key *keys;
+    size_t count;
+    size_t capacity;
+};
+
+/* open-addressing (linear probing) hash table, keyed by (type, name,
+ * labels). Items are never removed from a metric set, so there is no
+ * tombstone. capacity is always 0 or a power of two. */
+struct pmc_index {
+    struct pmc_key **slots;
+    size_t capacity;
+    size_t count;
+};
+
+/* the string table: same scheme, keyed by the string. The strings live
+ * in the arena. */
+struct pmc_strings {
+    const char **slots;
+    size_t capacity;
+    size_t count;
+};
+
+/* ARENA:
+ * everything a metric set owns (the set itself, names, items, bounds,
+ * counts, cached fragments) is bump-allocated from its arena, and released
+ * all at once by pmc_destroy. The first region can be user memory; once it
+ * is full, blocks are malloc'ed, each one twice as large as the previous
+ * (up to PMC_ARENA_BLOCK_MAX, or the request size). */
+struct pmc_arena_block {
+    struct pmc_arena_block *next;
+};
+
+struct pmc_arena {
+    struct pmc_arena_block *blocks; /* malloc'ed blocks, newest first */
+    char *ptr;                      /* free space of the current region */
+    char *end;
+    size_t block_size;              /* size of the next block */
 };
 
 struct pmc_metric {
+    struct pmc_arena arena;
     char *jobname;
-    struct pmc_item_list *head;
+    struct pmc_gauge_block *last_gauges;
+    struct pmc_counter_block *last_counters;
+    size_t cpu_count; /* 0 until the first counter */
+    struct pmc_family *families; /* oldest first */
+    struct pmc_family *last_family;
+    struct pmc_index index;
+    struct pmc_index family_index;
+    struct pmc_index sample_index; /* see SAMPLE NAMES */
+    struct pmc_strings strings;
+    /* the only items with heap memory, walked by pmc_destroy */
+    struct pmc_item_summary *summaries;
+    struct pmc_item_native *natives;
+    enum pmc_format format;
+    /* serialization buffer, kept across pmc_send calls. Created on the
+     * first send. */
+    struct wbuffer *buffer;
+    /* bodies of gzip_threshold bytes or more are gzipped in gzip_buffer.
+     * 0 disables it. Both are created on the first compression. */
+    size_t gzip_threshold;
+    struct pmc_deflate *deflate;
+    struct wbuffer *gzip_buffer;
 };
 
 
@@ -93,6 +451,205 @@ static int pmc_disabled = 0;
 #define CHECK_KILLSWITCH(...) \
     if (0 != pmc_disabled) return __VA_ARGS__
 
+/* ATOMICS:
+ * this file is c89, so <stdatomic.h> is not an option. The __atomic
+ * builtins (GCC >= 4.7, clang) implement the same C11 memory model.
+ * Values are only published, never used to synchronize other data, so
+ * relaxed ordering is enough: a reader always sees a whole value, never a
+ * torn one.
+ * floating point values are stored as their bit pattern. Additions are a
+ * CAS loop on that pattern.
+ */
+#define ATOMIC_LOAD(Ptr) __atomic_load_n((Ptr), __ATOMIC_RELAXED)
+#define ATOMIC_STORE(Ptr, Value) \
+    __atomic_store_n((Ptr), (Value), __ATOMIC_RELAXED)
+#define ATOMIC_CAS(Ptr, Expected, Desired)                           \
+    __atomic_compare_exchange_n((Ptr), (Expected), (Desired), 1,     \
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+
+static uint32_t float_to_bits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static uint64_t double_to_bits(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static double bits_to_double(uint64_t bits)
+{
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static double atomic_load_double(uint64_t *ptr)
+{
+    return bits_to_double(ATOMIC_LOAD(ptr));
+}
+
+static void atomic_add_double(uint64_t *ptr, double delta)
+{
+    uint64_t expected = ATOMIC_LOAD(ptr);
+
+    /* on failure, *expected* is refreshed with the current value */
+    while (!ATOMIC_CAS(ptr, &expected,
+                       double_to_bits(bits_to_double(expected) + delta))) {
+    }
+}
+
+/* called by every update, after the new value is stored. The release
+ * pairs with the exchange in pmc_serialize_item: a serializer that sees
+ * the flag also sees the value. */
+static void pmc_mark_dirty(struct pmc_item_list *item)
+{
+    __atomic_store_n(&item->dirty, 1, __ATOMIC_RELEASE);
+}
+
+#define PMC_CACHE_LINE 64
+
+/* histogram bounds are stored as doubles, aligned and padded with +Inf to
+ * a multiple of PMC_BOUND_LANES, so the vector search never needs a tail
+ * loop. Up to PMC_SIMD_SEARCH_MAX bounds, counting bounds with vector
+ * compares beats a binary search. */
+#define PMC_BOUND_LANES 4
+#define PMC_SIMD_SEARCH_MAX 32
+#define PMC_ROUND_UP(Value, Multiple) \
+    (((Value) + (Multiple) - 1) / (Multiple) * (Multiple))
+
+/* posix_memalign wrapper. Memory is zeroed, released with free().
+ * RETURN VALUE:
+ *  NULL  -> allocation failed
+ *  other -> *size* bytes aligned on *alignment*
+ */
+static void* pmc_aligned_alloc(size_t alignment, size_t size)
+{
+    void *ptr = NULL;
+
+    if (0 != posix_memalign(&ptr, alignment, size)) {
+        return NULL;
+    }
+
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+#define PMC_ARENA_ALIGN 16
+#define PMC_ARENA_BLOCK_MIN 4096
+#define PMC_ARENA_BLOCK_MAX (1024 * 1024)
+
+static void pmc_arena_init(struct pmc_arena *arena, void *memory, size_t size)
+{
+    arena->blocks = NULL;
+    arena->ptr = (char*)memory;
+    arena->end = NULL == memory ? NULL : (char*)memory + size;
+    arena->block_size = PMC_ARENA_BLOCK_MIN;
+}
+
+/* RETURN VALUE:
+ *  NULL  -> allocation failed
+ *  other -> *size* bytes aligned on *alignment* (a power of 2). The memory
+ *           is NOT zeroed.
+ */
+static void* pmc_arena_alloc(struct pmc_arena *arena,
+                             size_t size,
+                             size_t alignment)
+{
+    struct pmc_arena_block *block = NULL;
+    uintptr_t ptr = ((uintptr_t)arena->ptr + alignment - 1)
+                    & ~(uintptr_t)(alignment - 1);
+    size_t needed;
+
+    if (NULL == arena->ptr || ptr + size > (uintptr_t)arena->end) {
+        /* worst case: the block data starts just after an aligned one */
+        needed = sizeof(*block) + alignment + size;
+        while (arena->block_size < needed
+               && arena->block_size < PMC_ARENA_BLOCK_MAX) {
+            arena->block_size *= 2;
+        }
+        if (arena->block_size > needed) {
+            needed = arena->block_size;
+        }
+
+        block = (struct pmc_arena_block*)malloc(needed);
+        if (NULL == block) {
+            return NULL;
+        }
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->ptr = (char*)(block + 1);
+        arena->end = (char*)block + needed;
+        if (arena->block_size < PMC_ARENA_BLOCK_MAX) {
+            arena->block_size *= 2;
+        }
+
+        ptr = ((uintptr_t)arena->ptr + alignment - 1)
+              & ~(uintptr_t)(alignment - 1);
+    }
+
+    arena->ptr = (char*)(ptr + size);
+    return (void*)ptr;
+}
+
+static void* pmc_arena_zalloc(struct pmc_arena *arena,
+                              size_t size,
+                              size_t alignment)
+{
+    void *ptr = pmc_arena_alloc(arena, size, alignment);
+
+    if (NULL != ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+static char* pmc_arena_strdup(struct pmc_arena *arena, const char *str)
+{
+    const size_t len = strlen(str) + 1;
+    char *out = (char*)pmc_arena_alloc(arena, len, 1);
+
+    if (NULL != out) {
+        memcpy(out, str, len);
+    }
+    return out;
+}
+
+/* free every block. The arena may live in one of them: it is not touched
+ * after the first free. */
+static void pmc_arena_release(struct pmc_arena *arena)
+{
+    struct pmc_arena_block *block = arena->blocks;
+    struct pmc_arena_block *next = NULL;
+
+    while (NULL != block) {
+        next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+/* THREAD SLOTS:
+ * each thread gets a small integer the first time it touches a sharded
+ * metric. Slots are never recycled: a thread slot modulo the shard count
+ * gives the shard. With more threads than shards, some threads share a
+ * row, which is still correct since rows are updated atomically. */
+static __thread size_t pmc_thread_slot = 0; /* 0: not registered yet */
+static size_t pmc_thread_slot_count = 0;
+
+static size_t pmc_get_thread_slot(void)
+{
+    if (0 == pmc_thread_slot) {
+        pmc_thread_slot = __atomic_add_fetch(&pmc_thread_slot_count, 1,
+                                             __ATOMIC_RELAXED);
+    }
+    return pmc_thread_slot - 1;
+}
+
 static size_t align_page(size_t size)
 {
     return (size + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
@@ -158,61 +715,6 @@ static int wbuffer_expand(wbuffer_t buffer, size_t min_expansion)
     return 0;
 }
 
-/*
- * Analog to fprintf, but with a wbuffer. Except I do NOT accept NULL as *fmt*
- * FIXME: check __va_copy/va_copy availability on other systems.
- *
- * PARAMETERS:
- *   buffer: a previously created wbuffer_t
- *   fmt: a non NULL, 0 terminated string. Forwarded to vsnprintf, so
- *        same rules applies.
- *   ...: variadic arguments forwarded to printf like function.
- *
- * RETURN VALUE:
- *   res > 0 -> same return value as vsnprintf.
- *   res < 0 -> en error occured, either in vsnprintf or while expanding wbuf.
- */
-static int wbuffer_printf(wbuffer_t buffer, const char *fmt, ...)
-{
-    va_list args_count;
-    va_list args_write;
-    int res = 0;
-
-    assert(NULL != buffer);
-    assert(NULL != fmt);
-
-    va_start(args_count, fmt);
-    __va_copy(args_write, args_count);
-
-    do {
-        /* null byte IS counted here. We always write the null byte */
-        res = vsnprintf(NULL, 0, fmt, args_count) + 1;
-        if (res < 0) {
-            break;
-        }
-
-        if (buffer->usage + (size_t)res >= buffer->size) {
-            if (0 != wbuffer_expand(buffer, buffer->usage + (size_t)res)) {
-                res = -1;
-                break;
-            }
-        }
-
-        res = vsnprintf(buffer->ptr + buffer->usage, res, fmt, args_write);
-        if (res < 0) {
-            break;
-        }
-
-        /* null byte NOT counted here. We write it, but overwrite it in
-         * subsequent writes. */
-        buffer->usage += (size_t)res;
-    } while (0);
-
-    va_end(args_count);
-    va_end(args_write);
-    return res;
-}
-
 /* write *size* bytes from *data* to the wbuffer. This function does NOT
  * append any 0 byte at the end.
  *
@@ -241,6 +743,18 @@ static int wbuffer_write(wbuffer_t buffer, const void *data, size_t size)
     return 0;
 }
 
+/* Drop the content of the wbuffer, but keep its storage for the next
+ * writes.
+ *
+ * PARAMETERS:
+ *   buffer: a previously created wbuffer_t
+ */
+static void wbuffer_reset(wbuffer_t buffer)
+{
+    assert(NULL != buffer);
+    buffer->usage = 0;
+}
+
 /* Get the current usage of the wbuffer. This returns the size of the
  * valid data stored, not the whole buffer size.
  *
@@ -293,275 +807,5396 @@ static int wbuffer_destroy(wbuffer_t buffer)
     return 0;
 }
 
-void pmc_disable(void)
-{
-    pmc_disabled = 1;
-}
+/* NUMBER FORMATTING:
+ * the serializers below write numbers straight into the wbuffer, instead
+ * of going through vsnprintf (twice per line with wbuffer_printf).
+ * - integers (and integral doubles below 2^53) use a two-digit table.
+ * - other values use Grisu2 (Florian Loitsch, "Printing Floating-Point
+ *   Numbers Quickly and Accurately with Integers", 2010), which always
+ *   prints a string parsing back to the same value, and is the shortest
+ *   such string in >99% of cases. Floats are printed with the shortest
+ *   string for their own precision: 0.1f prints "0.1", not the digits of
+ *   the double 0.100000001490116.
+ * Notation is decimal up to 21 digits, scientific outside. NaN and
+ * infinities are written as the exposition format expects.
+ */
 
-pmc_metric_s pmc_initialize(const char *jobname)
-{
-    pmc_metric_s out = NULL;
-    size_t len;
+/* longest string written by the number formatters (sign, 17 digits, dot,
+ * exponent), rounded up */
+#define PMC_NUMBER_MAX 32
 
-    CHECK_KILLSWITCH(NULL);
+static const char pmc_digits_lut[200] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
 
-    out = ZERO_ALLOC(struct pmc_metric, 1);
-    RET_ON_FALSE(NULL != out, PMC_ERROR_ALLOCATION, NULL);
+static const uint64_t pmc_pow10[20] = {
+    UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000),
+    UINT64_C(10000), UINT64_C(100000), UINT64_C(1000000),
+    UINT64_C(10000000), UINT64_C(100000000), UINT64_C(1000000000),
+    UINT64_C(10000000000), UINT64_C(100000000000),
+    UINT64_C(1000000000000), UINT64_C(10000000000000),
+    UINT64_C(100000000000000), UINT64_C(1000000000000000),
+    UINT64_C(10000000000000000), UINT64_C(100000000000000000),
+    UINT64_C(1000000000000000000), UINT64_C(10000000000000000000)
+};
 
-    len = strlen(jobname) + 1;
-    out->jobname = ALLOC(char, len);
-    if (NULL == out) {
-        free(out);
-        pmc_handle_error(PMC_ERROR_ALLOCATION);
-        return NULL;
-    }
+/* normalized 10^k, k = -348 + 8 * i, for i in [0, 87[ */
+static const uint64_t pmc_cached_powers_f[87] = {
+    UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76), UINT64_C(0x8b16fb203055ac76),
+    UINT64_C(0xcf42894a5dce35ea), UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+    UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f), UINT64_C(0xbe5691ef416bd60c),
+    UINT64_C(0x8dd01fad907ffc3c), UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+    UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d), UINT64_C(0x823c12795db6ce57),
+    UINT64_C(0xc21094364dfb5637), UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+    UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5), UINT64_C(0xb23867fb2a35b28e),
+    UINT64_C(0x84c8d4dfd2c63f3b), UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+    UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6), UINT64_C(0xf3e2f893dec3f126),
+    UINT64_C(0xb5b5ada8aaff80b8), UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+    UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd), UINT64_C(0xa6dfbd9fb8e5b88f),
+    UINT64_C(0xf8a95fcf88747d94), UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+    UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac), UINT64_C(0xe45c10c42a2b3b06),
+    UINT64_C(0xaa242499697392d3), UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+    UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c), UINT64_C(0x9c40000000000000),
+    UINT64_C(0xe8d4a51000000000), UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+    UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70), UINT64_C(0xd5d238a4abe98068),
+    UINT64_C(0x9f4f2726179a2245), UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+    UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a), UINT64_C(0x924d692ca61be758),
+    UINT64_C(0xda01ee641a708dea), UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+    UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2), UINT64_C(0xc83553c5c8965d3d),
+    UINT64_C(0x952ab45cfa97a0b3), UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+    UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece), UINT64_C(0x88fcf317f22241e2),
+    UINT64_C(0xcc20ce9bd35c78a5), UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+    UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c), UINT64_C(0xbb764c4ca7a44410),
+    UINT64_C(0x8bab8eefb6409c1a), UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+    UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429), UINT64_C(0x80444b5e7aa7cf85),
+    UINT64_C(0xbf21e44003acdd2d), UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+    UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9), UINT64_C(0xaf87023b9bf0ee6b),
+};
 
-    memcpy(out->jobname, jobname, len);
+static const int16_t pmc_cached_powers_e[87] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+/* a "do-it-yourself floating point": f * 2^e */
+struct pmc_diy_fp {
+    uint64_t f;
+    int e;
+    char padding[4];
+};
 
+static struct pmc_diy_fp pmc_diy_fp_make(uint64_t f, int e)
+{
+    struct pmc_diy_fp out;
+    out.f = f;
+    out.e = e;
     return out;
 }
 
-int pmc_add_gauge(pmc_metric_s m, const char* name, float value)
+static struct pmc_diy_fp pmc_diy_fp_normalize(struct pmc_diy_fp x)
 {
-    struct pmc_item_gauge *item = NULL;
-    char *str = NULL;
-    size_t len;
+    const int shift = __builtin_clzll(x.f);
+    return pmc_diy_fp_make(x.f << shift, x.e - shift);
+}
 
-    CHECK_KILLSWITCH(0);
+/* 64x64 -> upper 64 bits of the product, rounded */
+static struct pmc_diy_fp pmc_diy_fp_mul(struct pmc_diy_fp x,
+                                        struct pmc_diy_fp y)
+{
+    const uint64_t M32 = 0xFFFFFFFFu;
+    const uint64_t a = x.f >> 32;
+    const uint64_t b = x.f & M32;
+    const uint64_t c = y.f >> 32;
+    const uint64_t d = y.f & M32;
+    const uint64_t ac = a * c;
+    const uint64_t bc = b * c;
+    const uint64_t ad = a * d;
+    const uint64_t bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32);
 
-    len = strlen(name) + 1;
-    item = ZERO_ALLOC(struct pmc_item_gauge, 1);
-    str = ALLOC(char, len);
+    tmp += (uint64_t)1 << 31;
+    return pmc_diy_fp_make(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32),
+                           x.e + y.e + 64);
+}
 
-    if (NULL == item || NULL == str) {
-        free(item);
-        free(str);
-        pmc_handle_error(PMC_ERROR_ALLOCATION);
-        return -1;
-    }
+/* cached power c such that the product of c and a number with binary
+ * exponent *e* has an exponent in [-60, -32]. *k* is set so that
+ * c = 10^-k */
+static struct pmc_diy_fp pmc_cached_power(int e, int *k)
+{
+    const double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int)dk;
+    size_t index;
 
-    memcpy(str, name, len);
+    if (dk - ik > 0.0) {
+        ik++;
+    }
 
-    item->name = str;
-    item->value = value;
-    item->list.next = m->head;
-    item->list.type = PM_GAUGE;
-    m->head = &item->list;
-    return 0;
+    index = (size_t)((ik >> 3) + 1);
+    *k = -(-348 + (int)(index << 3));
+    return pmc_diy_fp_make(pmc_cached_powers_f[index],
+                           pmc_cached_powers_e[index]);
 }
 
-int pmc_add_histogram(pmc_metric_s m,
-                      const char *name,
-                      size_t size,
-                      const float *buckets,
-                      const float *values)
+static int pmc_count_digits32(uint32_t n)
 {
-    struct pmc_item_histogram *item = NULL;
-    char *str = NULL;
-    size_t len;
-
-    CHECK_KILLSWITCH(0);
-
-    len = strlen(name) + 1;
-    item = ZERO_ALLOC(struct pmc_item_histogram, 1);
-    str = ALLOC(char, len);
+    int count = 1;
 
-    if (NULL == item || NULL == str) {
-        free(item);
-        free(str);
-        pmc_handle_error(PMC_ERROR_ALLOCATION);
-        return -1;
+    while (n >= 10) {
+        n /= 10;
+        count++;
     }
+    return count;
+}
 
-    memcpy(str, name, len);
-
-    item->name = str;
-    item->size = size;
-    item->values = ALLOC(float, size);
-    item->buckets = ALLOC(float, size);
-
-    if (NULL == item->values || NULL == item->buckets) {
-        free(item->values);
-        free(item->buckets);
-        free(item->name);
-        free(item);
-        pmc_handle_error(PMC_ERROR_ALLOCATION);
-        return -1;
+/* move the last digit down while it gets closer to the exact value and
+ * stays in the rounding interval */
+static void pmc_grisu_round(char *digits,
+                            int len,
+                            uint64_t delta,
+                            uint64_t rest,
+                            uint64_t ten_kappa,
+                            uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa
+           && (rest + ten_kappa < wp_w
+               || wp_w - rest > rest + ten_kappa - wp_w)) {
+        digits[len - 1]--;
+        rest += ten_kappa;
     }
-
-    memcpy(item->values, values, size * sizeof(float));
-    memcpy(item->buckets, buckets, size * sizeof(float));
-
-    item->list.next = m->head;
-    item->list.type = PM_HISTOGRAM;
-    m->head = &item->list;
-    return 0;
 }
 
-int pmc_update_histogram(pmc_metric_s m,
-                         const char *name,
-                         size_t size,
-                         const float *values)
+/* generate the shortest digits of *mp* that stay within *delta* of it.
+ * RETURN VALUE: the number of digits. *k* is adjusted by the position of
+ * the last digit */
+static int pmc_digit_gen(struct pmc_diy_fp w,
+                         struct pmc_diy_fp mp,
+                         uint64_t delta,
+                         char *digits,
+                         int *k)
 {
-    struct pmc_item_list *it = NULL;
-    struct pmc_item_histogram *item = NULL;
+    const int shift = -mp.e;
+    const uint64_t one = (uint64_t)1 << shift;
+    const uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> shift);
+    uint64_t p2 = mp.f & (one - 1);
+    int kappa = pmc_count_digits32(p1);
+    int len = 0;
+    uint64_t rest;
+    uint32_t d;
 
-    CHECK_KILLSWITCH(0);
+    while (kappa > 0) {
+        d = p1 / (uint32_t)pmc_pow10[kappa - 1];
+        p1 %= (uint32_t)pmc_pow10[kappa - 1];
+        if (0 != d || 0 != len) {
+            digits[len++] = (char)('0' + d);
+        }
+        kappa--;
 
-    it = m->head;
+        rest = ((uint64_t)p1 << shift) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            pmc_grisu_round(digits, len, delta, rest,
+                            pmc_pow10[kappa] << shift, wp_w);
+            return len;
+        }
+    }
 
-    while (NULL != it) {
-        item = (struct pmc_item_histogram*)it;
-        if (it->type != PM_HISTOGRAM || 0 != strcmp(name, item->name)) {
-            it = it->next;
-            continue;
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        d = (uint32_t)(p2 >> shift);
+        if (0 != d || 0 != len) {
+            digits[len++] = (char)('0' + d);
         }
+        p2 &= one - 1;
+        kappa--;
 
-        memcpy(item->values, values, size * sizeof(float));
-        return 0;
+        if (p2 < delta) {
+            *k += kappa;
+            pmc_grisu_round(digits, len, delta, p2, one,
+                            -kappa < 20 ? wp_w * pmc_pow10[-kappa] : 0);
+            return len;
+        }
     }
-
-    pmc_handle_error(PMC_ERROR_INVALID_KEY);
-    return -1;
 }
 
-static int send_http_packet(const char *jobname, const char* body)
+/* shortest digits of the positive value f * 2^e. *hidden* is the implicit
+ * significand bit of the source format: it tells how far the neighbours of
+ * the value are.
+ * RETURN VALUE: the number of digits. value = digits * 10^*k */
+static int pmc_grisu2(uint64_t f, int e, uint64_t hidden, char *digits, int *k)
 {
-#define HOSTNAME "127.0.0.1"
-#define HTTP_FMT "POST /metrics/job/%s HTTP/1.0\r\n"                   \
-                 "Host: " HOSTNAME "\r\n"                              \
-                 "Content-type: application/x-www-form-urlencoded\r\n" \
-                 "Content-length: " SIZE_T_FMT "\r\n\r\n"
-    size_t len;
-    int res = -1;
-    wbuffer_t buffer = NULL;
+    struct pmc_diy_fp w;
+    struct pmc_diy_fp wp;
+    struct pmc_diy_fp wm;
+    struct pmc_diy_fp c;
 
-    buffer = wbuffer_create();
-    if (NULL == buffer) {
-        pmc_handle_error(PMC_ERROR_ALLOCATION);
-        return -1;
+    /* boundaries: halfway to the next and previous representable values.
+     * The previous one is closer when f is a power of two. */
+    wp = pmc_diy_fp_normalize(pmc_diy_fp_make((f << 1) + 1, e - 1));
+    if (f == hidden) {
+        wm = pmc_diy_fp_make((f << 2) - 1, e - 2);
+    } else {
+        wm = pmc_diy_fp_make((f << 1) - 1, e - 1);
     }
+    wm.f <<= wm.e - wp.e;
+    wm.e = wp.e;
 
-    do {
-        len = strlen(body);
-        if (0 > wbuffer_printf(buffer, HTTP_FMT, jobname, len)) {
-            break;
-        }
+    c = pmc_cached_power(wp.e, k);
+    w = pmc_diy_fp_mul(pmc_diy_fp_normalize(pmc_diy_fp_make(f, e)), c);
+    wp = pmc_diy_fp_mul(wp, c);
+    wm = pmc_diy_fp_mul(wm, c);
+    wm.f++;
+    wp.f--;
 
-        if (0 > wbuffer_write(buffer, body, len + 1)) {
-            break;
-        }
+    return pmc_digit_gen(w, wp, wp.f - wm.f, digits, k);
+}
 
-        len = wbuffer_get_length(buffer);
-        if (0 != pmc_output_data(wbuffer_get_ptr(buffer), len)) {
+/* lay out digits * 10^k. Returns the number of chars written in *out* */
+static size_t pmc_format_digits(char *out, const char *digits, int len, int k)
+{
+    const int kk = len + k; /* 10^(kk-1) <= value < 10^kk */
+    size_t n = 0;
+    int exponent;
+    int i;
+
+    if (0 <= k && kk <= 21) {
+        /* 1234e7 -> 12340000000 */
+        memcpy(out, digits, (size_t)len);
+        n = (size_t)len;
+        for (i = 0; i < k; i++) {
+            out[n++] = '0';
+        }
+    } else if (0 < kk && kk <= 21) {
+        /* 1234e-2 -> 12.34 */
+        memcpy(out, digits, (size_t)kk);
+        n = (size_t)kk;
+        out[n++] = '.';
+        memcpy(out + n, digits + kk, (size_t)(len - kk));
+        n += (size_t)(len - kk);
+    } else if (-6 < kk && kk <= 0) {
+        /* 1234e-6 -> 0.001234 */
+        out[n++] = '0';
+        out[n++] = '.';
+        for (i = kk; i < 0; i++) {
+            out[n++] = '0';
+        }
+        memcpy(out + n, digits, (size_t)len);
+        n += (size_t)len;
+    } else {
+        /* 1234e30 -> 1.234e33 */
+        out[n++] = digits[0];
+        if (len > 1) {
+            out[n++] = '.';
+            memcpy(out + n, digits + 1, (size_t)(len - 1));
+            n += (size_t)(len - 1);
+        }
+
+        exponent = kk - 1;
+        out[n++] = 'e';
+        if (exponent < 0) {
+            out[n++] = '-';
+            exponent = -exponent;
+        }
+        if (exponent >= 100) {
+            out[n++] = (char)('0' + exponent / 100);
+            exponent %= 100;
+            out[n++] = pmc_digits_lut[exponent * 2];
+        } else if (exponent >= 10) {
+            out[n++] = pmc_digits_lut[exponent * 2];
+        }
+        out[n++] = pmc_digits_lut[exponent * 2 + 1];
+    }
+
+    return n;
+}
+
+/* Returns the number of chars written in *out*, at most 20 */
+static size_t pmc_format_u64(char *out, uint64_t value)
+{
+    char tmp[20];
+    size_t n = 0;
+    size_t i;
+    size_t idx;
+
+    while (value >= 100) {
+        idx = (size_t)(value % 100) * 2;
+        value /= 100;
+        tmp[n++] = pmc_digits_lut[idx + 1];
+        tmp[n++] = pmc_digits_lut[idx];
+    }
+
+    if (value >= 10) {
+        idx = (size_t)value * 2;
+        tmp[n++] = pmc_digits_lut[idx + 1];
+        tmp[n++] = pmc_digits_lut[idx];
+    } else {
+        tmp[n++] = (char)('0' + value);
+    }
+
+    for (i = 0; i < n; i++) {
+        out[i] = tmp[n - 1 - i];
+    }
+    return n;
+}
+
+/* special values, and the sign. Returns 1 when *value* was fully written,
+ * 0 when the caller must still write the magnitude at out + *n* */
+static int pmc_format_special(char *out, double value, size_t *n)
+{
+    *n = 0;
+
+    if (value != value) {
+        memcpy(out, "NaN", 3);
+        *n = 3;
+        return 1;
+    }
+
+    if (value < 0.) {
+        out[(*n)++] = '-';
+    }
+
+    if (value == HUGE_VAL || value == -HUGE_VAL) {
+        if (value > 0.) {
+            out[(*n)++] = '+';
+        }
+        memcpy(out + *n, "Inf", 3);
+        *n += 3;
+        return 1;
+    }
+
+    if (value == 0.) {
+        out[0] = '0';
+        *n = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Returns the number of chars written in *out*, at most PMC_NUMBER_MAX */
+static size_t pmc_format_double(char *out, double value)
+{
+    char digits[20];
+    uint64_t bits;
+    uint64_t f;
+    size_t n;
+    int e;
+    int k;
+    int len;
+
+    if (pmc_format_special(out, value, &n)) {
+        return n;
+    }
+
+    value = fabs(value);
+    if (value < 9007199254740992.0 && value == (double)(uint64_t)value) {
+        return n + pmc_format_u64(out + n, (uint64_t)value);
+    }
+
+    bits = double_to_bits(value);
+    f = bits & ((UINT64_C(1) << 52) - 1);
+    e = (int)(bits >> 52);
+    if (0 != e) {
+        f |= UINT64_C(1) << 52;
+        e -= 1075;
+    } else {
+        e = -1074;
+    }
+
+    len = pmc_grisu2(f, e, UINT64_C(1) << 52, digits, &k);
+    return n + pmc_format_digits(out + n, digits, len, k);
+}
+
+/* same as pmc_format_double, but the shortest string for the float
+ * precision */
+static size_t pmc_format_float(char *out, float value)
+{
+    char digits[20];
+    uint32_t bits;
+    uint64_t f;
+    size_t n;
+    int e;
+    int k;
+    int len;
+
+    if (pmc_format_special(out, (double)value, &n)) {
+        return n;
+    }
+
+    value = (float)fabs((double)value);
+    if (value < 16777216.f && value == (float)(uint32_t)value) {
+        return n + pmc_format_u64(out + n, (uint64_t)value);
+    }
+
+    bits = float_to_bits(value);
+    f = bits & ((UINT32_C(1) << 23) - 1);
+    e = (int)(bits >> 23);
+    if (0 != e) {
+        f |= UINT32_C(1) << 23;
+        e -= 150;
+    } else {
+        e = -149;
+    }
+
+    len = pmc_grisu2(f, e, UINT32_C(1) << 23, digits, &k);
+    return n + pmc_format_digits(out + n, digits, len, k);
+}
+
+/* Make room for *size* more bytes, and return where they start. Callers
+ * write there, then commit what they actually used with wbuffer_commit.
+ *
+ * RETURN VALUE:
+ *  NULL  -> wbuffer expansion failed.
+ *  other -> pointer to at least *size* writable bytes.
+ */
+static char* wbuffer_reserve(wbuffer_t buffer, size_t size)
+{
+    assert(NULL != buffer);
+
+    if (buffer->usage + size >= buffer->size) {
+        if (0 != wbuffer_expand(buffer, buffer->usage + size)) {
+            return NULL;
+        }
+    }
+
+    return buffer->ptr + buffer->usage;
+}
+
+static void wbuffer_commit(wbuffer_t buffer, size_t size)
+{
+    assert(buffer->usage + size < buffer->size);
+    buffer->usage += size;
+}
+
+/* write a 0 terminated string, without the null byte.
+ * RETURN VALUE: same as wbuffer_write */
+static int wbuffer_puts(wbuffer_t buffer, const char *str)
+{
+    return wbuffer_write(buffer, str, strlen(str));
+}
+
+/* write a number. RETURN VALUE: same as wbuffer_write */
+static int wbuffer_put_double(wbuffer_t buffer, double value)
+{
+    char *ptr = wbuffer_reserve(buffer, PMC_NUMBER_MAX);
+    if (NULL == ptr) {
+        return -1;
+    }
+
+    wbuffer_commit(buffer, pmc_format_double(ptr, value));
+    return 0;
+}
+
+static int wbuffer_put_float(wbuffer_t buffer, float value)
+{
+    char *ptr = wbuffer_reserve(buffer, PMC_NUMBER_MAX);
+    if (NULL == ptr) {
+        return -1;
+    }
+
+    wbuffer_commit(buffer, pmc_format_float(ptr, value));
+    return 0;
+}
+
+#define PMC_INDEX_MIN_CAPACITY 16
+
+/* FNV-1a, continued from *hash* */
+static uint32_t pmc_hash_str(uint32_t hash, const char *str)
+{
+    while (*str != 0) {
+        hash ^= (uint32_t)(unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* one label: its name, a separator, then its value. The hash of a label
+ * set is the sum of those, so it does not depend on the label order. */
+static uint32_t pmc_hash_labels(const char * const *names,
+                                const char * const *values,
+                                size_t count)
+{
+    uint32_t hash = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        hash += pmc_hash_str(pmc_hash_str(2166136261u, names[i]) * 16777619u,
+                             values[i]);
+    }
+    return hash;
+}
+
+/* what an index lookup is for. Label arrays are the user's, in any order,
+ * or the ones of a pmc_labels. */
+struct pmc_probe {
+    pmc_type_e type;
+    uint32_t hash;
+    const char *name;
+    const char * const *names;
+    const char * const *values;
+    size_t count;
+};
+
+/* FNV-1a on the name, then the type mixed in, then the labels. Two items
+ * with the same name but different types or labels are distinct keys. */
+static void pmc_probe_init(struct pmc_probe *probe,
+                           pmc_type_e type,
+                           const char *name,
+                           const char * const *names,
+                           const char * const *values,
+                           size_t count)
+{
+    uint32_t hash = pmc_hash_str(2166136261u, name);
+
+    hash ^= (uint32_t)type;
+    hash *= 16777619u;
+    if (count > 0) {
+        hash ^= pmc_hash_labels(names, values, count);
+        hash *= 16777619u;
+    }
+
+    probe->type = type;
+    probe->hash = hash;
+    probe->name = name;
+    probe->names = names;
+    probe->values = values;
+    probe->count = count;
+}
+
+static void pmc_probe_from_key(struct pmc_probe *probe,
+                               const struct pmc_key *key)
+{
+    probe->type = key->type;
+    probe->hash = key->hash;
+    probe->name = key->name;
+    probe->names = NULL == key->labels ? NULL : key->labels->names;
+    probe->values = NULL == key->labels ? NULL : key->labels->values;
+    probe->count = NULL == key->labels ? 0 : key->labels->count;
+}
+
+/* each label of *probe* must be in *labels*. Label sets are small: a
+ * linear search per label is enough. */
+static int pmc_labels_match(const struct pmc_labels *labels,
+                            const struct pmc_probe *probe)
+{
+    size_t i;
+    size_t j;
+
+    if ((NULL == labels ? 0 : labels->count) != probe->count) {
+        return 0;
+    }
+
+    for (i = 0; i < probe->count; i++) {
+        for (j = 0; j < labels->count; j++) {
+            if (0 == strcmp(labels->names[j], probe->names[i])) {
+                break;
+            }
+        }
+        if (j == labels->count
+            || 0 != strcmp(labels->values[j], probe->values[i])) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int pmc_index_match(const struct pmc_key *item,
+                           const struct pmc_probe *probe)
+{
+    return item->hash == probe->hash && item->type == probe->type
+           && 0 == strcmp(item->name, probe->name)
+           && pmc_labels_match(item->labels, probe);
+}
+
+/* find an item by type, name and labels.
+ * RETURN VALUE:
+ *  NULL  -> no such item
+ *  other -> the item with this key
+ */
+static struct pmc_key* pmc_index_find(const struct pmc_index *index,
+                                      const struct pmc_probe *probe)
+{
+    struct pmc_key *item = NULL;
+    size_t mask;
+    size_t i;
+
+    if (0 == index->capacity) {
+        return NULL;
+    }
+
+    mask = index->capacity - 1;
+    for (i = probe->hash & mask; NULL != (item = index->slots[i]);
+         i = (i + 1) & mask) {
+        if (pmc_index_match(item, probe)) {
+            return item;
+        }
+    }
+
+    return NULL;
+}
+
+/* find the series *name* with the given labels. *count* can be 0. */
+static struct pmc_key* pmc_find(pmc_metric_s m,
+                                pmc_type_e type,
+                                const char *name,
+                                const char * const *names,
+                                const char * const *values,
+                                size_t count)
+{
+    struct pmc_probe probe;
+
+    pmc_probe_init(&probe, type, name, names, values, count);
+    return pmc_index_find(&m->index, &probe);
+}
+
+/* SHOULD NOT BE USED DIRECTLY. Places *item* in *slots* without checking
+ * the load factor. Keys are unique (see pmc_key_link): *item* goes in the
+ * first free slot. */
+static void pmc_index_place(struct pmc_key **slots,
+                            size_t capacity,
+                            struct pmc_key *item,
+                            size_t *count)
+{
+    const size_t mask = capacity - 1;
+    size_t i = item->hash & mask;
+
+    while (NULL != slots[i]) {
+        i = (i + 1) & mask;
+    }
+
+    slots[i] = item;
+    *count += 1;
+}
+
+/* insert an item in the index. item->hash MUST already be set.
+ * The table is kept at most 3/4 full.
+ *
+ * RETURN VALUE:
+ *  -1 -> allocation failed. The index is unchanged.
+ *   0 -> item inserted.
+ */
+static int pmc_index_insert(struct pmc_index *index, struct pmc_key *item)
+{
+    struct pmc_key **slots = NULL;
+    size_t capacity;
+    size_t count = 0;
+    size_t i;
+
+    if ((index->count + 1) * 4 > index->capacity * 3) {
+        capacity = index->capacity > 0 ? index->capacity * 2
+                                       : PMC_INDEX_MIN_CAPACITY;
+        slots = ZERO_ALLOC(struct pmc_key*, capacity);
+        if (NULL == slots) {
+            return -1;
+        }
+
+        for (i = 0; i < index->capacity; i++) {
+            if (NULL != index->slots[i]) {
+                pmc_index_place(slots, capacity, index->slots[i], &count);
+            }
+        }
+
+        free(index->slots);
+        index->slots = slots;
+        index->capacity = capacity;
+        index->count = count;
+    }
+
+    pmc_index_place(index->slots, index->capacity, item, &index->count);
+    return 0;
+}
+
+/* return the copy of *str* in the string table of *m*, adding it first if
+ * needed.
+ * RETURN VALUE:
+ *  NULL  -> allocation failed
+ *  other -> the interned string
+ */
+static const char* pmc_intern(pmc_metric_s m, const char *str)
+{
+    struct pmc_strings *table = &m->strings;
+    const char **slots = NULL;
+    const char *copy = NULL;
+    size_t capacity;
+    size_t mask;
+    size_t i;
+    size_t j;
+
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        capacity = table->capacity > 0 ? table->capacity * 2
+                                       : PMC_INDEX_MIN_CAPACITY;
+        slots = ZERO_ALLOC(const char*, capacity);
+        if (NULL == slots) {
+            return NULL;
+        }
+
+        mask = capacity - 1;
+        for (i = 0; i < table->capacity; i++) {
+            if (NULL == table->slots[i]) {
+                continue;
+            }
+            j = pmc_hash_str(2166136261u, table->slots[i]) & mask;
+            while (NULL != slots[j]) {
+                j = (j + 1) & mask;
+            }
+            slots[j] = table->slots[i];
+        }
+
+        free((void*)table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
+    }
+
+    mask = table->capacity - 1;
+    for (i = pmc_hash_str(2166136261u, str) & mask; NULL != table->slots[i];
+         i = (i + 1) & mask) {
+        if (0 == strcmp(table->slots[i], str)) {
+            return table->slots[i];
+        }
+    }
+
+    copy = pmc_arena_strdup(&m->arena, str);
+    if (NULL != copy) {
+        table->slots[i] = copy;
+        table->count++;
+    }
+    return copy;
+}
+
+/* escape as the text format wants: \ and newline, and " in label values
+ * (*quotes*), but not in help texts. With *out* NULL, only measure.
+ * RETURN VALUE: the escaped length */
+static size_t pmc_escape(char *out, const char *str, int quotes)
+{
+    size_t len = 0;
+
+    for (; *str != 0; str++) {
+        if ('\\' == *str || (quotes && '"' == *str) || '\n' == *str) {
+            if (NULL != out) {
+                out[len] = '\\';
+                out[len + 1] = '\n' == *str ? 'n' : *str;
+            }
+            len += 2;
+        } else {
+            if (NULL != out) {
+                out[len] = *str;
+            }
+            len++;
+        }
+    }
+
+    return len;
+}
+
+/* build the interned label set of a new series. *count* can be 0: then
+ * *out* is NULL.
+ * RETURN VALUE:
+ *  -1 -> allocation failed. What was allocated stays in the arena.
+ *   0 -> success
+ */
+static int pmc_labels_create(pmc_metric_s m,
+                             const char * const *names,
+                             const char * const *values,
+                             size_t count,
+                             const struct pmc_labels **out)
+{
+    struct pmc_labels *labels = NULL;
+    const char *tmp;
+    char *text = NULL;
+    size_t len = 0;
+    size_t i;
+    size_t j;
+
+    *out = NULL;
+    if (0 == count) {
+        return 0;
+    }
+
+    labels = (struct pmc_labels*)pmc_arena_alloc(&m->arena, sizeof(*labels),
+                                                 PMC_ARENA_ALIGN);
+    if (NULL == labels) {
+        return -1;
+    }
+    labels->names = (const char**)pmc_arena_alloc(
+        &m->arena, count * sizeof(char*), sizeof(char*));
+    labels->values = (const char**)pmc_arena_alloc(
+        &m->arena, count * sizeof(char*), sizeof(char*));
+    if (NULL == labels->names || NULL == labels->values) {
+        return -1;
+    }
+
+    /* intern, and insertion sort on the name */
+    for (i = 0; i < count; i++) {
+        labels->names[i] = pmc_intern(m, names[i]);
+        labels->values[i] = pmc_intern(m, values[i]);
+        if (NULL == labels->names[i] || NULL == labels->values[i]) {
+            return -1;
+        }
+
+        for (j = i; j > 0 && strcmp(labels->names[j - 1],
+                                    labels->names[j]) > 0; j--) {
+            tmp = labels->names[j - 1];
+            labels->names[j - 1] = labels->names[j];
+            labels->names[j] = tmp;
+            tmp = labels->values[j - 1];
+            labels->values[j - 1] = labels->values[j];
+            labels->values[j] = tmp;
+        }
+
+        len += strlen(names[i]) + pmc_escape(NULL, values[i], 1) + 4;
+    }
+
+    /* name="value",... rendered once, in a scratch copy that is interned */
+    text = ALLOC(char, len);
+    if (NULL == text) {
+        return -1;
+    }
+    len = 0;
+    for (i = 0; i < count; i++) {
+        if (i > 0) {
+            text[len++] = ',';
+        }
+        strcpy(text + len, labels->names[i]);
+        len += strlen(labels->names[i]);
+        text[len++] = '=';
+        text[len++] = '"';
+        len += pmc_escape(text + len, labels->values[i], 1);
+        text[len++] = '"';
+    }
+    text[len] = 0;
+
+    labels->text = pmc_intern(m, text);
+    free(text);
+    if (NULL == labels->text) {
+        return -1;
+    }
+
+    labels->count = count;
+    labels->hash = pmc_hash_labels(labels->names, labels->values, count);
+    *out = labels;
+    return 0;
+}
+
+static const char* pmc_type_name(pmc_type_e type)
+{
+    switch (type) {
+        case PM_GAUGE:
+            return "gauge";
+        case PM_COUNTER:
+            return "counter";
+        case PM_HISTOGRAM:        /* fallthrough */
+        case PM_NATIVE_HISTOGRAM:
+            return "histogram";
+        case PM_SUMMARY:
+            return "summary";
+        case PM_TYPE_COUNT: /* fallthrough */
+        case PM_NONE:       /* fallthrough */
+            break;
+    }
+    assert(0); /* implementation safeguard */
+    return "untyped";
+}
+
+/* the suffix of the samples of *key*: counters end in "_total", which
+ * their name may already carry */
+static const char* pmc_name_suffix(const struct pmc_key *key)
+{
+    const size_t len = strlen(key->name);
+
+    if (PM_COUNTER != key->type
+        || (len >= 6 && 0 == strcmp(key->name + len - 6, "_total"))) {
+        return "";
+    }
+    return "_total";
+}
+
+/* render the # HELP and # TYPE lines of *family* in the arena. The
+ * previous header, if any, stays there.
+ * RETURN VALUE:
+ *  -1 -> allocation failed. The family keeps its previous header.
+ *   0 -> success
+ */
+static int pmc_family_render(pmc_metric_s m, struct pmc_family *family)
+{
+    const char *type = pmc_type_name(family->key.type);
+    const char *suffix = pmc_name_suffix(&family->key);
+    const size_t name_len = strlen(m->jobname) + 1 + strlen(family->key.name)
+                            + strlen(suffix);
+    size_t len = strlen("# TYPE ") + name_len + 1 + strlen(type) + 1;
+    char *header = NULL;
+    char *ptr = NULL;
+
+    if (NULL != family->help) {
+        len += strlen("# HELP ") + name_len + 1
+               + pmc_escape(NULL, family->help, 0) + 1;
+    }
+
+    header = (char*)pmc_arena_alloc(&m->arena, len + 1, 1);
+    if (NULL == header) {
+        return -1;
+    }
+
+    ptr = header;
+    if (NULL != family->help) {
+        ptr += sprintf(ptr, "# HELP %s_%s%s ", m->jobname, family->key.name,
+                       suffix);
+        ptr += pmc_escape(ptr, family->help, 0);
+        *ptr++ = '\n';
+    }
+    ptr += sprintf(ptr, "# TYPE %s_%s%s %s\n", m->jobname, family->key.name,
+                   suffix, type);
+    assert((size_t)(ptr - header) == len);
+
+    family->header = header;
+    family->header_len = len;
+    return 0;
+}
+
+/* the suffixes of the names a family of *key* claims, the bare name
+ * first. RETURN VALUE: how many, at most PMC_CLAIMS_MAX. */
+static size_t pmc_family_suffixes(const struct pmc_key *key,
+                                  const char **suffixes)
+{
+    size_t count = 0;
+
+    suffixes[count++] = "";
+    switch (key->type) {
+        case PM_COUNTER:
+            if (0 != *pmc_name_suffix(key)) {
+                suffixes[count++] = pmc_name_suffix(key);
+            }
+            break;
+        case PM_HISTOGRAM:        /* fallthrough */
+        case PM_NATIVE_HISTOGRAM:
+            suffixes[count++] = "_bucket";
+            /* fallthrough */
+        case PM_SUMMARY:
+            suffixes[count++] = "_count";
+            suffixes[count++] = "_sum";
+            break;
+        case PM_GAUGE:      /* fallthrough */
+        case PM_TYPE_COUNT: /* fallthrough */
+        case PM_NONE:       /* fallthrough */
+            break;
+    }
+    return count;
+}
+
+/* fill *claims* with the names a family of *key* writes, in the arena.
+ * RETURN VALUE:
+ *  -1 -> allocation failed
+ *  -2 -> one of the names is claimed already
+ *  other -> the number of claims. Not in the sample index yet.
+ */
+static int pmc_family_claims(pmc_metric_s m,
+                             const struct pmc_key *key,
+                             struct pmc_key **claims)
+{
+    const char *suffixes[PMC_CLAIMS_MAX];
+    const size_t count = pmc_family_suffixes(key, suffixes);
+    const size_t len = strlen(key->name);
+    struct pmc_probe probe;
+    char *name = NULL;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        name = (char*)pmc_arena_alloc(&m->arena,
+                                      len + strlen(suffixes[i]) + 1, 1);
+        claims[i] = (struct pmc_key*)pmc_arena_zalloc(
+            &m->arena, sizeof(*claims[i]), PMC_ARENA_ALIGN);
+        if (NULL == name || NULL == claims[i]) {
+            return -1;
+        }
+        memcpy(name, key->name, len);
+        strcpy(name + len, suffixes[i]);
+
+        pmc_probe_init(&probe, PM_NONE, name, NULL, NULL, 0);
+        if (NULL != pmc_index_find(&m->sample_index, &probe)) {
+            return -2;
+        }
+        claims[i]->name = name;
+        claims[i]->hash = probe.hash;
+        claims[i]->type = PM_NONE;
+    }
+    return (int)count;
+}
+
+/* find the family of *key*, or create it. Errors are reported here.
+ * RETURN VALUE:
+ *  NULL  -> allocation failed, or the family would reuse the name of
+ *           another one, or of its samples (see SAMPLE NAMES)
+ *  other -> the family. *key* is not linked into it yet.
+ */
+static struct pmc_family* pmc_family_get(pmc_metric_s m,
+                                         const struct pmc_key *key)
+{
+    struct pmc_key *claims[PMC_CLAIMS_MAX];
+    struct pmc_family *family = NULL;
+    struct pmc_probe probe;
+    int count;
+    int i;
+
+    pmc_probe_init(&probe, key->type, key->name, NULL, NULL, 0);
+    family = (struct pmc_family*)pmc_index_find(&m->family_index, &probe);
+    if (NULL != family) {
+        return family;
+    }
+
+    count = pmc_family_claims(m, key, claims);
+    RET_ON_FALSE(-2 != count, PMC_ERROR_INVALID_KEY, NULL);
+    RET_ON_FALSE(count > 0, PMC_ERROR_ALLOCATION, NULL);
+
+    family = (struct pmc_family*)pmc_arena_zalloc(&m->arena, sizeof(*family),
+                                                  PMC_ARENA_ALIGN);
+    RET_ON_FALSE(NULL != family, PMC_ERROR_ALLOCATION, NULL);
+    family->key.name = key->name;
+    family->key.hash = probe.hash;
+    family->key.type = key->type;
+
+    RET_ON_FALSE(0 == pmc_family_render(m, family)
+                 && 0 == pmc_index_insert(&m->family_index, &family->key),
+                 PMC_ERROR_ALLOCATION, NULL);
+
+    if (NULL == m->last_family) {
+        m->families = family;
+    } else {
+        m->last_family->next = family;
+    }
+    m->last_family = family;
+
+    /* a failed insert only leaves names unclaimed */
+    for (i = 0; i < count; i++) {
+        RET_ON_FALSE(0 == pmc_index_insert(&m->sample_index, claims[i]),
+                     PMC_ERROR_ALLOCATION, NULL);
+    }
+    return family;
+}
+
+/* fill the key of a new series: interned name, labels, hash. It is not
+ * registered yet, see pmc_key_link.
+ * RETURN VALUE:
+ *  -1 -> allocation failed. What was allocated stays in the arena.
+ *   0 -> success.
+ */
+static int pmc_key_init(pmc_metric_s m,
+                        struct pmc_key *key,
+                        pmc_type_e type,
+                        const char *name,
+                        const char * const *names,
+                        const char * const *values,
+                        size_t count)
+{
+    struct pmc_probe probe;
+
+    key->name = pmc_intern(m, name);
+    if (NULL == key->name
+        || 0 != pmc_labels_create(m, names, values, count, &key->labels)) {
+        return -1;
+    }
+
+    pmc_probe_init(&probe, type, name, names, values, count);
+    key->hash = probe.hash;
+    key->type = type;
+    key->sibling = NULL;
+    return 0;
+}
+
+/* add the series of *key* to the index and to its family. The item behind
+ * *key* MUST be complete: from now on, it is serialized. Errors are
+ * reported here.
+ * RETURN VALUE:
+ *  -1 -> allocation failed, the series already exists, or the name is
+ *        taken (see pmc_family_get). The series is not added.
+ *   0 -> success.
+ */
+static int pmc_key_link(pmc_metric_s m, struct pmc_key *key)
+{
+    struct pmc_family *family = NULL;
+    struct pmc_probe probe;
+
+    /* the same series twice is an invalid body */
+    pmc_probe_from_key(&probe, key);
+    RET_ON_FALSE(NULL == pmc_index_find(&m->index, &probe),
+                 PMC_ERROR_INVALID_KEY, -1);
+
+    family = pmc_family_get(m, key);
+    if (NULL == family) {
+        return -1;
+    }
+    RET_ON_FALSE(0 == pmc_index_insert(&m->index, key),
+                 PMC_ERROR_ALLOCATION, -1);
+
+    if (NULL == family->last) {
+        family->first = key;
+    } else {
+        family->last->sibling = key;
+    }
+    family->last = key;
+    return 0;
+}
+
+/* pmc_key_init then pmc_key_link. Same RETURN VALUE as pmc_key_link:
+ * errors are reported here. */
+static int pmc_key_register(pmc_metric_s m,
+                            struct pmc_key *key,
+                            pmc_type_e type,
+                            const char *name,
+                            const char * const *names,
+                            const char * const *values,
+                            size_t count)
+{
+    RET_ON_FALSE(0 == pmc_key_init(m, key, type, name, names, values, count),
+                 PMC_ERROR_ALLOCATION, -1);
+    return pmc_key_link(m, key);
+}
+
+int pmc_set_help(pmc_metric_s m, const char *name, const char *help)
+{
+    static const pmc_type_e types[] = {
+        PM_GAUGE, PM_COUNTER, PM_HISTOGRAM, PM_SUMMARY, PM_NATIVE_HISTOGRAM
+    };
+    struct pmc_family *family = NULL;
+    struct pmc_probe probe;
+    const char *copy = NULL;
+    size_t found = 0;
+    size_t i;
+
+    CHECK_KILLSWITCH(0);
+
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        pmc_probe_init(&probe, types[i], name, NULL, NULL, 0);
+        family = (struct pmc_family*)pmc_index_find(&m->family_index, &probe);
+        if (NULL == family) {
+            continue;
+        }
+
+        copy = NULL == copy ? pmc_intern(m, help) : copy;
+        RET_ON_FALSE(NULL != copy, PMC_ERROR_ALLOCATION, -1);
+        family->help = copy;
+        RET_ON_FALSE(0 == pmc_family_render(m, family),
+                     PMC_ERROR_ALLOCATION, -1);
+        found++;
+    }
+
+    RET_ON_FALSE(found > 0, PMC_ERROR_INVALID_KEY, -1);
+    return 0;
+}
+
+void pmc_disable(void)
+{
+    pmc_disabled = 1;
+}
+
+pmc_metric_s pmc_initialize(const char *jobname)
+{
+    return pmc_initialize_with_memory(jobname, NULL, 0);
+}
+
+pmc_metric_s pmc_initialize_with_memory(const char *jobname,
+                                        void *memory,
+                                        size_t size)
+{
+    struct pmc_arena arena;
+    pmc_metric_s out = NULL;
+
+    CHECK_KILLSWITCH(NULL);
+
+    /* the set lives in its own arena */
+    pmc_arena_init(&arena, memory, size);
+    out = (pmc_metric_s)pmc_arena_zalloc(&arena, sizeof(*out),
+                                         PMC_ARENA_ALIGN);
+    if (NULL == out) {
+        pmc_arena_release(&arena);
+        pmc_handle_error(PMC_ERROR_ALLOCATION);
+        return NULL;
+    }
+    out->arena = arena;
+
+    out->jobname = pmc_arena_strdup(&out->arena, jobname);
+    if (NULL == out->jobname) {
+        pmc_arena_release(&out->arena);
+        pmc_handle_error(PMC_ERROR_ALLOCATION);
+        return NULL;
+    }
+
+    return out;
+}
+
+#define PMC_GAUGE_BLOCK 64
+
+/* find room for *count* consecutive gauges, in the last block or in a new
+ * one. The slots are not counted as used yet.
+ * RETURN VALUE:
+ *  NULL  -> allocation failed
+ *  other -> the block. Its first free slot is at block->count.
+ */
+static struct pmc_gauge_block* pmc_gauge_reserve(pmc_metric_s m, size_t count)
+{
+    struct pmc_gauge_block *block = m->last_gauges;
+    size_t capacity;
+
+    if (NULL != block && block->capacity - block->count >= count) {
+        return block;
+    }
+
+    capacity = count > PMC_GAUGE_BLOCK ? count : PMC_GAUGE_BLOCK;
+    block = (struct pmc_gauge_block*)pmc_arena_zalloc(&m->arena,
+                                                      sizeof(*block),
+                                                      PMC_ARENA_ALIGN);
+    if (NULL == block) {
+        return NULL;
+    }
+
+    /* values alone in their cache lines */
+    block->values = (struct pmc_item_gauge*)pmc_arena_alloc(
+        &m->arena,
+        PMC_ROUND_UP(capacity * sizeof(*block->values), PMC_CACHE_LINE),
+        PMC_CACHE_LINE);
+    block->rendered = (uint64_t*)pmc_arena_alloc(
+        &m->arena, capacity * sizeof(*block->rendered), PMC_ARENA_ALIGN);
+    block->fragments = (struct pmc_fragment*)pmc_arena_zalloc(
+        &m->arena, capacity * sizeof(*block->fragments), PMC_ARENA_ALIGN);
+    block->keys = (struct pmc_gauge_key*)pmc_arena_alloc(
+        &m->arena, capacity * sizeof(*block->keys), PMC_ARENA_ALIGN);
+    if (NULL == block->values || NULL == block->rendered
+        || NULL == block->fragments || NULL == block->keys) {
+        return NULL;
+    }
+    block->capacity = capacity;
+
+    m->last_gauges = block;
+    return block;
+}
+
+/* fill the next free slot of *block*. The name is copied. */
+static struct pmc_item_gauge* pmc_gauge_init(pmc_metric_s m,
+                                             struct pmc_gauge_block *block,
+                                             const char *name,
+                                             const char * const *label_keys,
+                                             const char * const *label_values,
+                                             size_t label_count,
+                                             double value)
+{
+    struct pmc_gauge_key *key = &block->keys[block->count];
+    struct pmc_item_gauge *item = &block->values[block->count];
+
+    key->value = item;
+    key->block = block;
+    item->value = double_to_bits(value);
+
+    if (0 != pmc_key_register(m, &key->key, PM_GAUGE, name, label_keys,
+                              label_values, label_count)) {
+        return NULL;
+    }
+
+    block->count++;
+    return item;
+}
+
+pmc_gauge_h pmc_create_gauge(pmc_metric_s m, const char* name, double value)
+{
+    return pmc_create_gauge_labels(m, name, NULL, NULL, 0, value);
+}
+
+pmc_gauge_h pmc_create_gauge_labels(pmc_metric_s m,
+                                    const char *name,
+                                    const char * const *label_keys,
+                                    const char * const *label_values,
+                                    size_t label_count,
+                                    double value)
+{
+    struct pmc_gauge_block *block = NULL;
+
+    CHECK_KILLSWITCH(NULL);
+
+    /* on failure, what was allocated stays in the arena until pmc_destroy */
+    block = pmc_gauge_reserve(m, 1);
+    RET_ON_FALSE(NULL != block, PMC_ERROR_ALLOCATION, NULL);
+
+    return pmc_gauge_init(m, block, name, label_keys, label_values,
+                          label_count, value);
+}
+
+pmc_gauge_h pmc_create_gauges(pmc_metric_s m,
+                              const char * const *names,
+                              size_t count,
+                              const double *values)
+{
+    struct pmc_gauge_block *block = NULL;
+    pmc_gauge_h first = NULL;
+    size_t i;
+
+    CHECK_KILLSWITCH(NULL);
+
+    assert(count > 0);
+
+    block = pmc_gauge_reserve(m, count);
+    RET_ON_FALSE(NULL != block, PMC_ERROR_ALLOCATION, NULL);
+
+    first = &block->values[block->count];
+    for (i = 0; i < count; i++) {
+        if (NULL == pmc_gauge_init(m, block, names[i], NULL, NULL, 0,
+                                   NULL == values ? 0. : values[i])) {
+            return NULL;
+        }
+    }
+
+    return first;
+}
+
+int pmc_add_gauge(pmc_metric_s m, const char* name, double value)
+{
+    CHECK_KILLSWITCH(0);
+
+    if (NULL == pmc_create_gauge(m, name, value)) {
+        return -1;
+    }
+    return 0;
+}
+
+int pmc_add_gauge_labels(pmc_metric_s m,
+                         const char *name,
+                         const char * const *label_keys,
+                         const char * const *label_values,
+                         size_t label_count,
+                         double value)
+{
+    CHECK_KILLSWITCH(0);
+
+    if (NULL == pmc_create_gauge_labels(m, name, label_keys, label_values,
+                                        label_count, value)) {
+        return -1;
+    }
+    return 0;
+}
+
+pmc_gauge_h pmc_get_gauge(pmc_metric_s m, const char *name)
+{
+    return pmc_get_gauge_labels(m, name, NULL, NULL, 0);
+}
+
+pmc_gauge_h pmc_get_gauge_labels(pmc_metric_s m,
+                                 const char *name,
+                                 const char * const *label_keys,
+                                 const char * const *label_values,
+                                 size_t label_count)
+{
+    struct pmc_key *it = NULL;
+
+    CHECK_KILLSWITCH(NULL);
+
+    it = pmc_find(m, PM_GAUGE, name, label_keys, label_values, label_count);
+    RET_ON_FALSE(NULL != it, PMC_ERROR_INVALID_KEY, NULL);
+
+    return ((struct pmc_gauge_key*)it)->value;
+}
+
+void pmc_gauge_set(pmc_gauge_h h, double value)
+{
+    CHECK_KILLSWITCH();
+
+    assert(NULL != h);
+    ATOMIC_STORE(&h->value, double_to_bits(value));
+}
+
+void pmc_gauge_add(pmc_gauge_h h, double delta)
+{
+    CHECK_KILLSWITCH();
+
+    assert(NULL != h);
+    atomic_add_double(&h->value, delta);
+}
+
+pmc_gauge_h pmc_gauge_at(pmc_gauge_h first, size_t i)
+{
+    assert(NULL != first);
+    return first + i;
+}
+
+void pmc_gauge_set_many(pmc_gauge_h first, size_t count, const double *values)
+{
+    size_t i;
+
+    CHECK_KILLSWITCH();
+
+    assert(NULL != first);
+
+    /* one store per gauge: the serializer loads them atomically */
+    for (i = 0; i < count; i++) {
+        ATOMIC_STORE(&first[i].value, double_to_bits(values[i]));
+    }
+}
+
+pmc_counter_h pmc_create_counter(pmc_metric_s m, const char* name)
+{
+    return pmc_create_counter_labels(m, name, NULL, NULL, 0);
+}
+
+/* the cells of a new counter: the next column of the last block, or of
+ * a new block.
+ * RETURN VALUE:
+ *  NULL  -> allocation failed
+ *  other -> the first cell of the column, zeroed.
+ */
+static uint64_t* pmc_counter_reserve(pmc_metric_s m)
+{
+    struct pmc_counter_block *block = m->last_counters;
+    long cpus;
+
+    if (0 == m->cpu_count) {
+        cpus = sysconf(_SC_NPROCESSORS_CONF);
+        m->cpu_count = cpus > 0 ? (size_t)cpus : 1;
+    }
+
+    if (NULL == block || PMC_COUNTER_BLOCK == block->count) {
+        block = (struct pmc_counter_block*)pmc_arena_zalloc(
+            &m->arena, sizeof(*block), PMC_ARENA_ALIGN);
+        if (NULL == block) {
+            return NULL;
+        }
+        block->cells = (uint64_t*)pmc_arena_zalloc(
+            &m->arena, m->cpu_count * PMC_COUNTER_BLOCK * sizeof(uint64_t),
+            PMC_CACHE_LINE);
+        if (NULL == block->cells) {
+            return NULL;
+        }
+        m->last_counters = block;
+    }
+
+    return block->cells + block->count++;
+}
+
+pmc_counter_h pmc_create_counter_labels(pmc_metric_s m,
+                                        const char *name,
+                                        const char * const *label_keys,
+                                        const char * const *label_values,
+                                        size_t label_count)
+{
+    struct pmc_item_counter *item = NULL;
+
+    CHECK_KILLSWITCH(NULL);
+
+    item = (struct pmc_item_counter*)pmc_arena_zalloc(&m->arena,
+                                                      sizeof(*item),
+                                                      PMC_ARENA_ALIGN);
+    RET_ON_FALSE(NULL != item, PMC_ERROR_ALLOCATION, NULL);
+
+    item->cells = pmc_counter_reserve(m);
+    RET_ON_FALSE(NULL != item->cells, PMC_ERROR_ALLOCATION, NULL);
+    item->cpu_count = m->cpu_count;
+
+    if (0 != pmc_key_register(m, &item->list.key, PM_COUNTER, name,
+                              label_keys, label_values, label_count)) {
+        return NULL;
+    }
+    return item;
+}
+
+int pmc_add_counter(pmc_metric_s m, const char* name)
+{
+    CHECK_KILLSWITCH(0);
+
+    if (NULL == pmc_create_counter(m, name)) {
+        return -1;
+    }
+    return 0;
+}
+
+pmc_counter_h pmc_get_counter(pmc_metric_s m, const char *name)
+{
+    return pmc_get_counter_labels(m, name, NULL, NULL, 0);
+}
+
+pmc_counter_h pmc_get_counter_labels(pmc_metric_s m,
+                                     const char *name,
+                                     const char * const *label_keys,
+                                     const char * const *label_values,
+                                     size_t label_count)
+{
+    struct pmc_key *it = NULL;
+
+    CHECK_KILLSWITCH(NULL);
+
+    it = pmc_find(m, PM_COUNTER, name, label_keys, label_values, label_count);
+    RET_ON_FALSE(NULL != it, PMC_ERROR_INVALID_KEY, NULL);
+
+    return (struct pmc_item_counter*)it;
+}
+
+void pmc_counter_inc(pmc_counter_h h)
+{
+    pmc_counter_add(h, 1.);
+}
+
+/* the row of the calling thread: its CPU's. Elsewhere than on Linux,
+ * threads get a row each, as with sharded histograms. */
+static size_t pmc_counter_row(size_t cpu_count)
+{
+#if defined(__linux__)
+    const int cpu = sched_getcpu();
+
+    if (cpu >= 0) {
+        return (size_t)cpu % cpu_count;
+    }
+#endif
+    return pmc_get_thread_slot() % cpu_count;
+}
+
+void pmc_counter_add(pmc_counter_h h, double delta)
+{
+    CHECK_KILLSWITCH();
+
+    assert(NULL != h);
+
+    /* counters never go down. NaN would stick. */
+    if (!(delta >= 0.)) {
+        return;
+    }
+    atomic_add_double(h->cells + pmc_counter_row(h->cpu_count)
+                                 * PMC_COUNTER_BLOCK,
+                      delta);
+}
+
+/* each cell only grows: a sum taken later is never lower */
+static double pmc_counter_value(const struct pmc_item_counter *it)
+{
+    double sum = 0.;
+    size_t i;
+
+    for (i = 0; i < it->cpu_count; i++) {
+        sum += atomic_load_double(it->cells + i * PMC_COUNTER_BLOCK);
+    }
+    return sum;
+}
+
+static int pmc_put_series(wbuffer_t buffer,
+                          const char *jobname,
+                          const struct pmc_key *key,
+                          const char *suffix);
+static int pmc_put_bucket(wbuffer_t buffer,
+                          const char *jobname,
+                          const struct pmc_key *key);
+
+/* move the line prefixes rendered in *tmp* to the arena. *offsets* (in
+ * the arena already) holds where each line starts in *tmp*, and its end.
+ * *res* is the result of the rendering: on failure, nothing is stored.
+ * *tmp* is destroyed.
+ * RETURN VALUE:
+ *  -1 -> allocation failed
+ *   0 -> success
+ */
+static int pmc_prefixes_store(pmc_metric_s m,
+                              struct pmc_prefixes *out,
+                              wbuffer_t tmp,
+                              uint32_t *offsets,
+                              int res)
+{
+    const size_t len = wbuffer_get_length(tmp);
+
+    out->offsets = offsets;
+    out->text = 0 == res ? (char*)pmc_arena_alloc(&m->arena, len, 1) : NULL;
+    if (NULL != out->text) {
+        memcpy(out->text, wbuffer_get_ptr(tmp), len);
+    }
+    wbuffer_destroy(tmp);
+
+    return NULL == out->text ? -1 : 0;
+}
+
+/* bounds never change: render the text of every line of *it* up to the
+ * value once, at creation. That is, for each bucket then +Inf:
+ * '<jobname>_<name>_bucket{<labels>,le="<bound>"} ', then
+ * '<jobname>_<name>_count{<labels>} ' and the same for _sum.
+ * RETURN VALUE:
+ *  -1 -> allocation failed
+ *   0 -> success
+ */
+static int pmc_histogram_prefixes(pmc_metric_s m,
+                                  struct pmc_item_histogram *it)
+{
+    const struct pmc_key *key = &it->list.key;
+    wbuffer_t tmp = wbuffer_create();
+    uint32_t *offsets = NULL;
+    size_t i;
+    int res = 0;
+
+    if (NULL == tmp) {
+        return -1;
+    }
+
+    offsets = (uint32_t*)pmc_arena_alloc(&m->arena,
+                                         (it->size + 4) * sizeof(uint32_t),
+                                         sizeof(uint32_t));
+    if (NULL == offsets) {
+        wbuffer_destroy(tmp);
+        return -1;
+    }
+
+    for (i = 0; i <= it->size; i++) {
+        offsets[i] = (uint32_t)wbuffer_get_length(tmp);
+        res |= pmc_put_bucket(tmp, m->jobname, key);
+        if (i < it->size) {
+            /* bounds are created from floats */
+            res |= wbuffer_put_float(tmp, (float)it->buckets[i]);
+            res |= wbuffer_puts(tmp, "\"} ");
+        } else {
+            res |= wbuffer_puts(tmp, "+Inf\"} ");
+        }
+    }
+
+    offsets[it->size + 1] = (uint32_t)wbuffer_get_length(tmp);
+    res |= pmc_put_series(tmp, m->jobname, key, "_count");
+    res |= wbuffer_write(tmp, " ", 1);
+    offsets[it->size + 2] = (uint32_t)wbuffer_get_length(tmp);
+    res |= pmc_put_series(tmp, m->jobname, key, "_sum");
+    res |= wbuffer_write(tmp, " ", 1);
+    offsets[it->size + 3] = (uint32_t)wbuffer_get_length(tmp);
+
+    return pmc_prefixes_store(m, &it->prefixes, tmp, offsets, res);
+}
+
+/* counts given as floats by the legacy API. They are rounded to the
+ * nearest integer, negative ones and NaN to 0, and clamped. */
+static void pmc_counts_from_float(uint64_t *counts,
+                                  size_t size,
+                                  const float *values)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        if (!(values[i] >= .5f)) {
+            counts[i] = 0;
+        } else if (values[i] >= 18446744073709551616.f) {
+            counts[i] = UINT64_MAX;
+        } else {
+            counts[i] = (uint64_t)((double)values[i] + .5);
+        }
+    }
+}
+
+/* log2(value) within 0.008, for value >= 0: the exponent, plus the
+ * mantissa m in [0, 1), corrected for the curvature of log2(1 + m).
+ * Increasing, as bit patterns of positive doubles are. */
+static double pmc_fast_log2(double value)
+{
+    const uint64_t bits = double_to_bits(value);
+    const double m = (double)(bits & (((uint64_t)1 << 52) - 1))
+                     * (1. / 4503599627370496.); /* 2^-52 */
+
+    return (double)((int)(bits >> 52) - 1023) + m + 0.3466 * m * (1. - m);
+}
+
+static double pmc_layout_x(enum pmc_layout_kind kind, double value)
+{
+    switch (kind) {
+        case PMC_LAYOUT_LOG_LINEAR:
+            return (double)double_to_bits(value);
+        case PMC_LAYOUT_EXPONENTIAL:
+            return pmc_fast_log2(value);
+        case PMC_LAYOUT_LINEAR: /* fallthrough */
+        case PMC_LAYOUT_NONE:   /* fallthrough */
+            break;
+    }
+    return value;
+}
+
+/* keep the layout which guesses the bounds of *h* best, if it guesses
+ * each of them within one bucket. For a value in bucket i, the guess
+ * rounded up is then i, give or take one. Log layouts need positive
+ * bounds. */
+static void pmc_layout_detect(struct pmc_item_histogram *h)
+{
+    static const enum pmc_layout_kind kinds[3] = {
+        PMC_LAYOUT_LINEAR, PMC_LAYOUT_LOG_LINEAR, PMC_LAYOUT_EXPONENTIAL
+    };
+    const double *b = h->buckets;
+    const size_t last = h->size - 1;
+    double best = 1.;
+    double error;
+    double origin;
+    double scale;
+    double guess;
+    size_t i;
+    size_t k;
+
+    h->layout.kind = PMC_LAYOUT_NONE;
+    if (h->size < 3 || !(b[last] < HUGE_VAL) || !(b[0] > -HUGE_VAL)) {
+        return;
+    }
+
+    for (k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        if (PMC_LAYOUT_LINEAR != kinds[k] && !(b[0] > 0.)) {
+            continue;
+        }
+
+        origin = pmc_layout_x(kinds[k], b[0]);
+        scale = (double)last / (pmc_layout_x(kinds[k], b[last]) - origin);
+        if (!(scale > 0. && scale < HUGE_VAL)) {
+            continue;
+        }
+
+        error = 0.;
+        for (i = 0; i < h->size && error <= best; i++) {
+            guess = (pmc_layout_x(kinds[k], b[i]) - origin) * scale;
+            guess = fabs(guess - (double)i);
+            error = guess > error ? guess : error;
+        }
+
+        if (error < best || (error == best
+                                && PMC_LAYOUT_NONE == h->layout.kind)) {
+            best = error;
+            h->layout.kind = kinds[k];
+            h->layout.origin = origin;
+            h->layout.scale = scale;
+        }
+    }
+}
+
+/* O(1), see pmc_layout_detect */
+static size_t pmc_layout_bucket(const struct pmc_item_histogram *h,
+                                double value)
+{
+    const double *b = h->buckets;
+    const size_t last = h->size - 1;
+    double guess;
+    size_t i;
+
+    if (value <= b[0]) {
+        return 0;
+    }
+    if (!(value <= b[last])) {
+        return h->size; /* NaN too */
+    }
+
+    /* rounded up: bucket i ends at bound i */
+    guess = (pmc_layout_x(h->layout.kind, value) - h->layout.origin)
+            * h->layout.scale + 1.;
+    i = guess <= 0. ? 0 : guess < (double)last ? (size_t)guess : last;
+
+    while (!(value <= b[i])) {
+        i++;
+    }
+    while (i > 0 && value <= b[i - 1]) {
+        i--;
+    }
+    return i;
+}
+
+void pmc_linear_buckets(float *buckets,
+                        size_t count,
+                        double start,
+                        double width)
+{
+    size_t i;
+
+    assert(width > 0.);
+
+    for (i = 0; i < count; i++) {
+        buckets[i] = (float)(start + (double)i * width);
+    }
+}
+
+void pmc_exponential_buckets(float *buckets,
+                             size_t count,
+                             double start,
+                             double factor)
+{
+    size_t i;
+
+    assert(start > 0. && factor > 1.);
+
+    for (i = 0; i < count; i++) {
+        buckets[i] = (float)start;
+        start *= factor;
+    }
+}
+
+size_t pmc_log_linear_buckets(float *buckets,
+                              int min_exponent,
+                              int max_exponent,
+                              unsigned int sub_bits)
+{
+    const size_t per_octave = (size_t)1 << sub_bits;
+    const size_t count = (size_t)(max_exponent - min_exponent) * per_octave
+                         + 1;
+    size_t i;
+
+    /* normal floats, exact */
+    assert(min_exponent < max_exponent);
+    assert(min_exponent >= -126 && max_exponent <= 127);
+    assert(sub_bits <= 16);
+
+    for (i = 0; NULL != buckets && i < count; i++) {
+        buckets[i] = (float)ldexp(
+            1. + (double)(i % per_octave) / (double)per_octave,
+            min_exponent + (int)(i / per_octave));
+    }
+    return count;
+}
+
+pmc_histogram_h pmc_create_histogram(pmc_metric_s m,
+                                     const char *name,
+                                     size_t size,
+                                     const float *buckets,
+                                     const float *values)
+{
+    return pmc_create_histogram_labels(m, name, NULL, NULL, 0,
+                                       size, buckets, values);
+}
+
+/* counts set in bulk carry no values: estimate the sum from the bounds,
+ * the +Inf bucket counting for nothing. Observations add to it. */
+static void pmc_histogram_estimate_sum(struct pmc_item_histogram *h)
+{
+    size_t i;
+
+    h->sum = 0.;
+    for (i = 0; i < h->size; i++) {
+        h->sum += (double)h->counts[i] * h->buckets[i];
+    }
+}
+
+pmc_histogram_h pmc_create_histogram_labels(pmc_metric_s m,
+                                            const char *name,
+                                            const char * const *label_keys,
+                                            const char * const *label_values,
+                                            size_t label_count,
+                                            size_t size,
+                                            const float *buckets,
+                                            const float *values)
+{
+    struct pmc_item_histogram *item = NULL;
+    size_t i;
+
+    CHECK_KILLSWITCH(NULL);
+
+    item = (struct pmc_item_histogram*)pmc_arena_zalloc(&m->arena,
+                                                        sizeof(*item),
+                                                        PMC_ARENA_ALIGN);
+    RET_ON_FALSE(NULL != item, PMC_ERROR_ALLOCATION, NULL);
+
+    item->list.dirty = 1;
+    item->size = size;
+    item->counts = (uint64_t*)pmc_arena_zalloc(&m->arena,
+                                               size * sizeof(uint64_t),
+                                               sizeof(uint64_t));
+    item->buckets = (double*)pmc_arena_alloc(
+        &m->arena, PMC_ROUND_UP(size, PMC_BOUND_LANES) * sizeof(double),
+        PMC_BOUND_LANES * sizeof(double));
+    RET_ON_FALSE(NULL != item->counts && NULL != item->buckets,
+                 PMC_ERROR_ALLOCATION, NULL);
+
+    if (NULL != values) {
+        pmc_counts_from_float(item->counts, size, values);
+    }
+    for (i = 0; i < PMC_ROUND_UP(size, PMC_BOUND_LANES); i++) {
+        item->buckets[i] = i < size ? (double)buckets[i] : HUGE_VAL;
+    }
+    pmc_histogram_estimate_sum(item);
+    pmc_layout_detect(item);
+
+    RET_ON_FALSE(0 == pmc_key_init(m, &item->list.key, PM_HISTOGRAM, name,
+                                   label_keys, label_values, label_count)
+                 && 0 == pmc_histogram_prefixes(m, item),
+                 PMC_ERROR_ALLOCATION, NULL);
+    if (0 != pmc_key_link(m, &item->list.key)) {
+        return NULL;
+    }
+    return item;
+}
+
+int pmc_add_histogram(pmc_metric_s m,
+                      const char *name,
+                      size_t size,
+                      const float *buckets,
+                      const float *values)
+{
+    CHECK_KILLSWITCH(0);
+
+    if (NULL == pmc_create_histogram(m, name, size, buckets, values)) {
+        return -1;
+    }
+    return 0;
+}
+
+pmc_histogram_h pmc_get_histogram(pmc_metric_s m, const char *name)
+{
+    return pmc_get_histogram_labels(m, name, NULL, NULL, 0);
+}
+
+pmc_histogram_h pmc_get_histogram_labels(pmc_metric_s m,
+                                         const char *name,
+                                         const char * const *label_keys,
+                                         const char * const *label_values,
+                                         size_t label_count)
+{
+    struct pmc_key *it = NULL;
+
+    CHECK_KILLSWITCH(NULL);
+
+    it = pmc_find(m, PM_HISTOGRAM, name, label_keys, label_values,
+                  label_count);
+    RET_ON_FALSE(NULL != it, PMC_ERROR_INVALID_KEY, NULL);
+
+    return (struct pmc_item_histogram*)it;
+}
+
+int pmc_histogram_update(pmc_histogram_h h, size_t size, const float *values)
+{
+    CHECK_KILLSWITCH(0);
+
+    assert(NULL != h);
+    assert(size <= h->size);
+
+    pmc_counts_from_float(h->counts, size, values);
+    pmc_histogram_estimate_sum(h);
+    pmc_mark_dirty(&h->list);
+    return 0;
+}
+
+int pmc_histogram_set_counts(pmc_histogram_h h,
+                             size_t size,
+                             const uint64_t *counts)
+{
+    CHECK_KILLSWITCH(0);
+
+    assert(NULL != h);
+    assert(size <= h->size);
+
+    memcpy(h->counts, counts, size * sizeof(uint64_t));
+    pmc_histogram_estimate_sum(h);
+    pmc_mark_dirty(&h->list);
+    return 0;
+}
+
+/* shard and window rows: *size* + 1 counts and the sum, rounded to whole
+ * cache lines. In counts. */
+#define PMC_ROW_SUM(Size) ((Size) + 1)
+
+static size_t pmc_row_stride(size_t size)
+{
+    const size_t per_line = PMC_CACHE_LINE / sizeof(uint64_t);
+
+    return (PMC_ROW_SUM(size) + per_line) / per_line * per_line;
+}
+
+pmc_histogram_h pmc_create_sharded_histogram(pmc_metric_s m,
+                                             const char *name,
+                                             size_t size,
+                                             const float *buckets,
+                                             size_t shard_count)
+{
+    struct pmc_item_histogram *item = NULL;
+    uint64_t *shards = NULL;
+    size_t stride;
+    long cpus;
+
+    CHECK_KILLSWITCH(NULL);
+
+    if (0 == shard_count) {
+        cpus = sysconf(_SC_NPROCESSORS_CONF);
+        shard_count = cpus > 0 ? (size_t)cpus : 1;
+    }
+
+    stride = pmc_row_stride(size);
+    shards = (uint64_t*)pmc_arena_zalloc(
+        &m->arena, stride * shard_count * sizeof(uint64_t), PMC_CACHE_LINE);
+    RET_ON_FALSE(NULL != shards, PMC_ERROR_ALLOCATION, NULL);
+
+    item = pmc_create_histogram(m, name, size, buckets, NULL);
+    if (NULL == item) {
+        return NULL;
+    }
+
+    item->shard_count = shard_count;
+    item->shard_stride = stride;
+    item->shards = shards;
+    return item;
+}
+
+static uint64_t pmc_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t pmc_window_slot_ns(unsigned int window_ms, size_t slot_count)
+{
+    const uint64_t ns = (uint64_t)window_ms * 1000000u / slot_count;
+
+    return ns > 0 ? ns : 1;
+}
+
+pmc_histogram_h pmc_create_windowed_histogram(pmc_metric_s m,
+                                              const char *name,
+                                              size_t size,
+                                              const float *buckets,
+                                              unsigned int window_ms,
+                                              size_t slot_count)
+{
+    struct pmc_item_histogram *item = NULL;
+    struct pmc_window *window = NULL;
+    size_t i;
+
+    CHECK_KILLSWITCH(NULL);
+
+    assert(window_ms > 0);
+    assert(slot_count > 0 && slot_count <= PMC_WINDOW_SLOTS_MAX);
+
+    window = (struct pmc_window*)pmc_arena_zalloc(&m->arena, sizeof(*window),
+                                                  PMC_ARENA_ALIGN);
+    RET_ON_FALSE(NULL != window, PMC_ERROR_ALLOCATION, NULL);
+
+    window->slot_ns = pmc_window_slot_ns(window_ms, slot_count);
+    window->slot_count = slot_count;
+    window->stride = pmc_row_stride(size);
+    window->slots = (uint64_t*)pmc_arena_alloc(
+        &m->arena, slot_count * sizeof(uint64_t), sizeof(uint64_t));
+    window->rows = (uint64_t*)pmc_arena_zalloc(
+        &m->arena, window->stride * slot_count * sizeof(uint64_t),
+        PMC_CACHE_LINE);
+    RET_ON_FALSE(NULL != window->slots && NULL != window->rows,
+                 PMC_ERROR_ALLOCATION, NULL);
+
+    /* a slot that is never in the window, see pmc_window_live */
+    for (i = 0; i < slot_count; i++) {
+        window->slots[i] = UINT64_MAX;
+    }
+
+    item = pmc_create_histogram(m, name, size, buckets, NULL);
+    if (NULL == item) {
+        return NULL;
+    }
+
+    item->window = window;
+    return item;
+}
+
+/* BUCKET SEARCH:
+ * buckets are sorted, so the bucket of *value* is the number of bounds
+ * *value* is NOT lower or equal to. Written that way, NaN is above every
+ * bound and lands in +Inf, like values above the last bound.
+ * None of the searches below branch on the data.
+ */
+
+/* count the bounds below *value* with vector compares, PMC_BOUND_LANES at
+ * a time. The +Inf padding is only counted for NaN, hence the clamp. */
+static size_t pmc_bucket_count(const struct pmc_item_histogram *h,
+                               double value)
+{
+    const size_t padded = PMC_ROUND_UP(h->size, PMC_BOUND_LANES);
+    size_t count = 0;
+    size_t i;
+#if defined(__AVX__)
+    const __m256d v = _mm256_set1_pd(value);
+    __m256d mask;
+
+    for (i = 0; i < padded; i += 4) {
+        mask = _mm256_cmp_pd(v, _mm256_load_pd(h->buckets + i), _CMP_NLE_UQ);
+        count += (size_t)__builtin_popcount(
+            (unsigned int)_mm256_movemask_pd(mask));
+    }
+#elif defined(__SSE2__)
+    const __m128d v = _mm_set1_pd(value);
+    __m128d mask;
+
+    for (i = 0; i < padded; i += 2) {
+        mask = _mm_cmpnle_pd(v, _mm_load_pd(h->buckets + i));
+        count += (size_t)__builtin_popcount(
+            (unsigned int)_mm_movemask_pd(mask));
+    }
+#else
+    for (i = 0; i < padded; i++) {
+        count += !(value <= h->buckets[i]);
+    }
+#endif
+
+    return count < h->size ? count : h->size;
+}
+
+/* branchless lower bound: the ternary compiles to a conditional move */
+static size_t pmc_bucket_search(const struct pmc_item_histogram *h,
+                                double value)
+{
+    const double *base = h->buckets;
+    size_t n = h->size;
+    size_t half;
+
+    while (n > 1) {
+        half = n / 2;
+        base = !(value <= base[half - 1]) ? base + half : base;
+        n -= half;
+    }
+
+    return (size_t)(base - h->buckets) + !(value <= *base);
+}
+
+/* index of the bucket *value* falls in. *size* means +Inf. */
+static size_t pmc_histogram_bucket(const struct pmc_item_histogram *h,
+                                   double value)
+{
+    if (0 == h->size) {
+        return 0;
+    }
+
+    if (PMC_LAYOUT_NONE != h->layout.kind) {
+        return pmc_layout_bucket(h, value);
+    }
+
+    if (h->size <= PMC_SIMD_SEARCH_MAX) {
+        return pmc_bucket_count(h, value);
+    }
+    return pmc_bucket_search(h, value);
+}
+
+/* row of the current slot. When the slot starts, the row still holds an
+ * expired one: clear it, then publish the slot. The release pairs with
+ * the acquire in pmc_window_live. */
+static uint64_t* pmc_window_row(const struct pmc_item_histogram *h)
+{
+    struct pmc_window *w = h->window;
+    const uint64_t slot = pmc_clock_ns() / w->slot_ns;
+    const size_t r = (size_t)(slot % w->slot_count);
+    uint64_t *row = w->rows + r * w->stride;
+    size_t i;
+
+    if (ATOMIC_LOAD(&w->slots[r]) != slot) {
+        for (i = 0; i <= PMC_ROW_SUM(h->size); i++) {
+            ATOMIC_STORE(&row[i], 0);
+        }
+        __atomic_store_n(&w->slots[r], slot, __ATOMIC_RELEASE);
+    }
+    return row;
+}
+
+/* row to observe into: the row of the calling thread for sharded
+ * histograms, of the current slot for windowed ones, NULL otherwise */
+static uint64_t* pmc_histogram_row(const struct pmc_item_histogram *h)
+{
+    if (NULL != h->window) {
+        return pmc_window_row(h);
+    }
+    if (NULL == h->shards) {
+        return NULL;
+    }
+    return h->shards + (pmc_get_thread_slot() % h->shard_count)
+                       * h->shard_stride;
+}
+
+static void pmc_histogram_increment(struct pmc_item_histogram *h,
+                                    uint64_t *row,
+                                    size_t i)
+{
+    /* sharded and windowed histograms are never cached, see
+     * pmc_serialize_item */
+    if (NULL != row) {
+        __atomic_fetch_add(&row[i], 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (i < h->size) {
+        h->counts[i]++;
+    } else {
+        h->overflow++;
+    }
+}
+
+/* add *sum*, the sum of observations counted in *row*, then publish */
+static void pmc_histogram_add_sum(struct pmc_item_histogram *h,
+                                  uint64_t *row,
+                                  double sum)
+{
+    if (NULL != row) {
+        atomic_add_double(&row[PMC_ROW_SUM(h->size)], sum);
+        return;
+    }
+
+    h->sum += sum;
+    pmc_mark_dirty(&h->list);
+}
+
+void pmc_histogram_observe(pmc_histogram_h h, double value)
+{
+    uint64_t *row = NULL;
+
+    CHECK_KILLSWITCH();
+
+    assert(NULL != h);
+
+    row = pmc_histogram_row(h);
+    pmc_histogram_increment(h, row, pmc_histogram_bucket(h, value));
+    pmc_histogram_add_sum(h, row, value);
+}
+
+void pmc_histogram_observe_n(pmc_histogram_h h,
+                             const double *values,
+                             size_t count)
+{
+    uint64_t *row = NULL;
+    double sum = 0.;
+    size_t i = 0;
+#if defined(__AVX2__)
+    uint64_t index[4];
+    __m256d v;
+    __m256i acc;
+    size_t j;
+#elif defined(__SSE2__)
+    uint64_t index[2];
+    __m128d v;
+    __m128i acc;
+    size_t j;
+#endif
+
+    CHECK_KILLSWITCH();
+
+    assert(NULL != h);
+    assert(NULL != values || 0 == count);
+
+    row = pmc_histogram_row(h);
+
+    /* with few bounds, bin several samples at once: each bound is compared
+     * to a whole vector of samples, and the all-ones masks (-1) are
+     * subtracted from per-sample counters. */
+    if (h->size <= PMC_SIMD_SEARCH_MAX) {
+#if defined(__AVX2__)
+        for (; i + 4 <= count; i += 4) {
+            v = _mm256_loadu_pd(values + i);
+            acc = _mm256_setzero_si256();
+            for (j = 0; j < h->size; j++) {
+                acc = _mm256_sub_epi64(acc, _mm256_castpd_si256(
+                    _mm256_cmp_pd(v, _mm256_broadcast_sd(h->buckets + j),
+                                  _CMP_NLE_UQ)));
+            }
+            _mm256_storeu_si256((__m256i*)index, acc);
+            for (j = 0; j < 4; j++) {
+                pmc_histogram_increment(h, row, (size_t)index[j]);
+            }
+        }
+#elif defined(__SSE2__)
+        for (; i + 2 <= count; i += 2) {
+            v = _mm_loadu_pd(values + i);
+            acc = _mm_setzero_si128();
+            for (j = 0; j < h->size; j++) {
+                acc = _mm_sub_epi64(acc, _mm_castpd_si128(
+                    _mm_cmpnle_pd(v, _mm_set1_pd(h->buckets[j]))));
+            }
+            _mm_storeu_si128((__m128i*)index, acc);
+            pmc_histogram_increment(h, row, (size_t)index[0]);
+            pmc_histogram_increment(h, row, (size_t)index[1]);
+        }
+#endif
+    }
+
+    for (; i < count; i++) {
+        pmc_histogram_increment(h, row, pmc_histogram_bucket(h, values[i]));
+    }
+
+    /* the sum is added once for the whole batch */
+    for (i = 0; i < count; i++) {
+        sum += values[i];
+    }
+    pmc_histogram_add_sum(h, row, sum);
+}
+
+int pmc_update_histogram(pmc_metric_s m,
+                         const char *name,
+                         size_t size,
+                         const float *values)
+{
+    struct pmc_key *it = NULL;
+
+    CHECK_KILLSWITCH(0);
+
+    it = pmc_find(m, PM_HISTOGRAM, name, NULL, NULL, 0);
+    RET_ON_FALSE(NULL != it, PMC_ERROR_INVALID_KEY, -1);
+
+    return pmc_histogram_update((struct pmc_item_histogram*)it, size, values);
+}
+
+/* rank error allowed at rank *r* out of *n* observations: the tightest
+ * over all the target quantiles. Ranks far from every target can be
+ * merged more aggressively. */
+static double pmc_summary_invariant(const struct pmc_item_summary *s,
+                                    double r,
+                                    double n)
+{
+    double bound = HUGE_VAL;
+    double f;
+    double q;
+    size_t i;
+
+    for (i = 0; i < s->size; i++) {
+        q = s->quantiles[i];
+        if ((r >= q * n && q > 0.) || q >= 1.) {
+            f = 2. * s->error * r / q;
+        } else {
+            f = 2. * s->error * (n - r) / (1. - q);
+        }
+        bound = f < bound ? f : bound;
+    }
+    return bound;
+}
+
+static int pmc_compare_double(const void *a, const void *b)
+{
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* merge adjacent samples, from the top, as long as the invariant holds.
+ * Survivors are packed from the end of the list, then moved to the
+ * front. */
+static void pmc_sketch_compress(const struct pmc_item_summary *s,
+                                struct pmc_sketch *sketch)
+{
+    struct pmc_sample *samples = sketch->samples;
+    const double n = (double)sketch->merged;
+    double r;
+    size_t w;
+    size_t i;
+
+    if (sketch->sample_count < 2) {
+        return;
+    }
+
+    w = sketch->sample_count - 1;
+    r = n - 1. - (double)samples[w].width;
+    for (i = sketch->sample_count - 1; i-- > 0;) {
+        if ((double)(samples[i].width + samples[w].width + samples[w].delta)
+            <= pmc_summary_invariant(s, r, n)) {
+            samples[w].width += samples[i].width;
+        } else {
+            samples[--w] = samples[i];
+        }
+        r -= (double)samples[i].width;
+    }
+
+    memmove(samples, samples + w,
+            (sketch->sample_count - w) * sizeof(*samples));
+    sketch->sample_count -= w;
+}
+
+/* merge the sorted buffer of *s* into *sketch*, then compress it.
+ * RETURN VALUE:
+ *  -1 -> allocation failed. The sketch is unchanged.
+ *   0 -> success
+ */
+static int pmc_sketch_merge(const struct pmc_item_summary *s,
+                            struct pmc_sketch *sketch)
+{
+    const size_t old_count = sketch->sample_count;
+    struct pmc_sample *samples = NULL;
+    struct pmc_sample *scratch = NULL;
+    struct pmc_sample sample;
+    size_t capacity;
+    size_t out = 0;
+    size_t i = 0;
+    size_t j;
+    double r = 0.;
+    double f;
+
+    if (old_count + s->buffered > sketch->capacity) {
+        capacity = 2 * (old_count + s->buffered);
+        samples = (struct pmc_sample*)realloc(sketch->samples,
+                                              capacity * sizeof(*samples));
+        if (NULL != samples) {
+            sketch->samples = samples;
+            scratch = (struct pmc_sample*)realloc(sketch->scratch,
+                                                  capacity * sizeof(*scratch));
+        }
+        if (NULL == scratch) {
+            return -1;
+        }
+        sketch->scratch = scratch;
+        sketch->capacity = capacity;
+    }
+
+    /* compression keeps the last sample, the maximum: values above it
+     * have an exact rank. The first sample can be merged away. */
+    for (j = 0; j < s->buffered; j++) {
+        while (i < old_count && sketch->samples[i].value <= s->buffer[j]) {
+            r += (double)sketch->samples[i].width;
+            sketch->scratch[out++] = sketch->samples[i++];
+        }
+
+        sample.value = s->buffer[j];
+        sample.width = 1;
+        sample.delta = 0;
+        if (old_count != i) {
+            f = floor(pmc_summary_invariant(s, r, (double)sketch->merged));
+            sample.delta = f > 1. ? (uint64_t)f - 1 : 0;
+        }
+        sketch->scratch[out++] = sample;
+        sketch->merged++;
+        r += 1.;
+    }
+    while (i < old_count) {
+        sketch->scratch[out++] = sketch->samples[i++];
+    }
+
+    scratch = sketch->samples;
+    sketch->samples = sketch->scratch;
+    sketch->scratch = scratch;
+    sketch->sample_count = out;
+
+    pmc_sketch_compress(s, sketch);
+    return 0;
+}
+
+/* merge the buffered observations into every sketch. Called with the lock
+ * held.
+ * RETURN VALUE:
+ *  -1 -> allocation failed. The buffered observations are dropped from
+ *        the quantiles of some sketches (they still count in _count and
+ *        _sum).
+ *   0 -> success
+ */
+static int pmc_summary_flush(struct pmc_item_summary *s)
+{
+    size_t i;
+    int res = 0;
+
+    if (0 == s->buffered) {
+        return 0;
+    }
+
+    qsort(s->buffer, s->buffered, sizeof(double), pmc_compare_double);
+    for (i = 0; i < s->sketch_count; i++) {
+        res |= pmc_sketch_merge(s, &s->sketches[i]);
+    }
+    s->buffered = 0;
+    return res;
+}
+
+/* reset the sketches whose slot left the window, oldest first. Buffered
+ * observations belong to the slots before: they are merged first. Called
+ * with the lock held. Same RETURN VALUE as pmc_summary_flush. */
+static int pmc_summary_rotate(struct pmc_item_summary *s)
+{
+    uint64_t slot;
+    uint64_t elapsed;
+    struct pmc_sketch *sketch = NULL;
+    int res;
+
+    if (0 == s->slot_ns) {
+        return 0;
+    }
+
+    slot = pmc_clock_ns() / s->slot_ns;
+    if (slot == s->slot) {
+        return 0;
+    }
+
+    res = pmc_summary_flush(s);
+    elapsed = slot - s->slot;
+    elapsed = elapsed < s->sketch_count ? elapsed : s->sketch_count;
+    for (; elapsed > 0; elapsed--) {
+        sketch = &s->sketches[s->head];
+        sketch->sample_count = 0;
+        sketch->merged = 0;
+        s->head = (s->head + 1) % s->sketch_count;
+    }
+    s->slot = slot;
+    return res;
+}
+
+/* value at quantile *q*: the last sample whose rank, error included, is
+ * still within the allowed error of q * n */
+static double pmc_sketch_estimate(const struct pmc_item_summary *s,
+                                  const struct pmc_sketch *sketch,
+                                  double q)
+{
+    const double n = (double)sketch->merged;
+    const struct pmc_sample *prev = NULL;
+    double t;
+    double r = 0.;
+    size_t i;
+
+    if (0 == sketch->sample_count) {
+        return NAN;
+    }
+
+    t = ceil(q * n);
+    t += ceil(pmc_summary_invariant(s, t, n) / 2.);
+
+    prev = &sketch->samples[0];
+    for (i = 1; i < sketch->sample_count; i++) {
+        r += (double)prev->width;
+        if (r + (double)(sketch->samples[i].width
+                         + sketch->samples[i].delta) > t) {
+            break;
+        }
+        prev = &sketch->samples[i];
+    }
+    return prev->value;
+}
+
+/* fill it->estimates, and read count and sum, all under the lock */
+static void pmc_summary_query(struct pmc_item_summary *it,
+                              uint64_t *count,
+                              double *sum)
+{
+    const struct pmc_sketch *sketch = NULL;
+    size_t i;
+
+    pthread_mutex_lock(&it->lock);
+    if (0 != pmc_summary_rotate(it) || 0 != pmc_summary_flush(it)) {
+        pmc_handle_error(PMC_ERROR_ALLOCATION);
+    }
+    sketch = &it->sketches[it->head];
+    for (i = 0; i < it->size; i++) {
+        it->estimates[i] = pmc_sketch_estimate(it, sketch, it->quantiles[i]);
+    }
+    *count = it->count;
+    *sum = it->sum;
+    pthread_mutex_unlock(&it->lock);
+}
+
+static int pmc_put_name(wbuffer_t buffer,
+                        const char *jobname,
+                        const char *name);
+
+/* same as pmc_histogram_prefixes. For each quantile:
+ * '<jobname>_<name>{<labels>,quantile="<q>"} ', then
+ * '<jobname>_<name>_sum{<labels>} ' and the same for _count.
+ * RETURN VALUE:
+ *  -1 -> allocation failed
+ *   0 -> success
+ */
+static int pmc_summary_prefixes(pmc_metric_s m, struct pmc_item_summary *it)
+{
+    const struct pmc_key *key = &it->list.key;
+    wbuffer_t tmp = wbuffer_create();
+    uint32_t *offsets = NULL;
+    size_t i;
+    int res = 0;
+
+    if (NULL == tmp) {
+        return -1;
+    }
+
+    offsets = (uint32_t*)pmc_arena_alloc(&m->arena,
+                                         (it->size + 3) * sizeof(uint32_t),
+                                         sizeof(uint32_t));
+    if (NULL == offsets) {
+        wbuffer_destroy(tmp);
+        return -1;
+    }
+
+    for (i = 0; i < it->size; i++) {
+        offsets[i] = (uint32_t)wbuffer_get_length(tmp);
+        res |= pmc_put_name(tmp, m->jobname, key->name);
+        res |= wbuffer_write(tmp, "{", 1);
+        if (NULL != key->labels) {
+            res |= wbuffer_puts(tmp, key->labels->text);
+            res |= wbuffer_write(tmp, ",", 1);
+        }
+        res |= wbuffer_puts(tmp, "quantile=\"");
+        res |= wbuffer_put_double(tmp, it->quantiles[i]);
+        res |= wbuffer_puts(tmp, "\"} ");
+    }
+
+    offsets[it->size] = (uint32_t)wbuffer_get_length(tmp);
+    res |= pmc_put_series(tmp, m->jobname, key, "_sum");
+    res |= wbuffer_write(tmp, " ", 1);
+    offsets[it->size + 1] = (uint32_t)wbuffer_get_length(tmp);
+    res |= pmc_put_series(tmp, m->jobname, key, "_count");
+    res |= wbuffer_write(tmp, " ", 1);
+    offsets[it->size + 2] = (uint32_t)wbuffer_get_length(tmp);
+
+    return pmc_prefixes_store(m, &it->prefixes, tmp, offsets, res);
+}
+
+/* create and register a summary with *sketch_count* sketches. The window
+ * is set by the caller: windowless, a summary has a single sketch. */
+static struct pmc_item_summary* pmc_summary_new(
+    pmc_metric_s m,
+    const char *name,
+    const char * const *label_keys,
+    const char * const *label_values,
+    size_t label_count,
+    size_t size,
+    const double *quantiles,
+    double error,
+    size_t sketch_count)
+{
+    struct pmc_item_summary *item = NULL;
+    double *copy = NULL;
+    size_t i;
+
+    assert(size > 0);
+    assert(error > 0. && error < 1.);
+
+    item = (struct pmc_item_summary*)pmc_arena_zalloc(&m->arena,
+                                                      sizeof(*item),
+                                                      PMC_ARENA_ALIGN);
+    RET_ON_FALSE(NULL != item, PMC_ERROR_ALLOCATION, NULL);
+
+    copy = (double*)pmc_arena_alloc(&m->arena, 2 * size * sizeof(double),
+                                    sizeof(double));
+    item->buffer = (double*)pmc_arena_alloc(
+        &m->arena, PMC_SUMMARY_BUFFER * sizeof(double), sizeof(double));
+    item->sketches = (struct pmc_sketch*)pmc_arena_zalloc(
+        &m->arena, sketch_count * sizeof(struct pmc_sketch), PMC_ARENA_ALIGN);
+    RET_ON_FALSE(NULL != copy && NULL != item->buffer
+                 && NULL != item->sketches,
+                 PMC_ERROR_ALLOCATION, NULL);
+
+    for (i = 0; i < size; i++) {
+        assert(quantiles[i] >= 0. && quantiles[i] <= 1.);
+        copy[i] = quantiles[i];
+    }
+
+    item->list.dirty = 1;
+    item->size = size;
+    item->quantiles = copy;
+    item->estimates = copy + size;
+    item->error = error;
+    item->sketch_count = sketch_count;
+    pthread_mutex_init(&item->lock, NULL);
+
+    RET_ON_FALSE(0 == pmc_key_init(m, &item->list.key, PM_SUMMARY, name,
+                                   label_keys, label_values, label_count)
+                 && 0 == pmc_summary_prefixes(m, item),
+                 PMC_ERROR_ALLOCATION, NULL);
+    if (0 != pmc_key_link(m, &item->list.key)) {
+        return NULL;
+    }
+    item->next_summary = m->summaries;
+    m->summaries = item;
+    return item;
+}
+
+pmc_summary_h pmc_create_summary(pmc_metric_s m,
+                                 const char *name,
+                                 size_t size,
+                                 const double *quantiles,
+                                 double error)
+{
+    return pmc_create_summary_labels(m, name, NULL, NULL, 0,
+                                     size, quantiles, error);
+}
+
+pmc_summary_h pmc_create_summary_labels(pmc_metric_s m,
+                                        const char *name,
+                                        const char * const *label_keys,
+                                        const char * const *label_values,
+                                        size_t label_count,
+                                        size_t size,
+                                        const double *quantiles,
+                                        double error)
+{
+    CHECK_KILLSWITCH(NULL);
+
+    return pmc_summary_new(m, name, label_keys, label_values, label_count,
+                           size, quantiles, error, 1);
+}
+
+pmc_summary_h pmc_create_windowed_summary(pmc_metric_s m,
+                                          const char *name,
+                                          size_t size,
+                                          const double *quantiles,
+                                          double error,
+                                          unsigned int window_ms,
+                                          size_t slot_count)
+{
+    struct pmc_item_summary *item = NULL;
+
+    CHECK_KILLSWITCH(NULL);
+
+    assert(window_ms > 0);
+    assert(slot_count > 0 && slot_count <= PMC_WINDOW_SLOTS_MAX);
+
+    item = pmc_summary_new(m, name, NULL, NULL, 0, size, quantiles, error,
+                           slot_count);
+    if (NULL == item) {
+        return NULL;
+    }
+
+    item->slot_ns = pmc_window_slot_ns(window_ms, slot_count);
+    item->slot = pmc_clock_ns() / item->slot_ns;
+    return item;
+}
+
+pmc_summary_h pmc_get_summary(pmc_metric_s m, const char *name)
+{
+    return pmc_get_summary_labels(m, name, NULL, NULL, 0);
+}
+
+pmc_summary_h pmc_get_summary_labels(pmc_metric_s m,
+                                     const char *name,
+                                     const char * const *label_keys,
+                                     const char * const *label_values,
+                                     size_t label_count)
+{
+    struct pmc_key *it = NULL;
+
+    CHECK_KILLSWITCH(NULL);
+
+    it = pmc_find(m, PM_SUMMARY, name, label_keys, label_values, label_count);
+    RET_ON_FALSE(NULL != it, PMC_ERROR_INVALID_KEY, NULL);
+
+    return (struct pmc_item_summary*)it;
+}
+
+void pmc_summary_observe(pmc_summary_h h, double value)
+{
+    int res;
+
+    CHECK_KILLSWITCH();
+
+    assert(NULL != h);
+
+    /* NaN has no rank */
+    if (value != value) {
+        return;
+    }
+
+    pthread_mutex_lock(&h->lock);
+    res = pmc_summary_rotate(h);
+    h->count++;
+    h->sum += value;
+    h->buffer[h->buffered++] = value;
+    if (PMC_SUMMARY_BUFFER == h->buffered) {
+        res |= pmc_summary_flush(h);
+    }
+    pthread_mutex_unlock(&h->lock);
+
+    pmc_mark_dirty(&h->list);
+    RET_ON_FALSE(0 == res, PMC_ERROR_ALLOCATION);
+}
+
+/* the samples are the only heap memory of a summary */
+static void pmc_summary_release(struct pmc_item_summary *it)
+{
+    size_t i;
+
+    for (i = 0; i < it->sketch_count; i++) {
+        free(it->sketches[i].samples);
+        free(it->sketches[i].scratch);
+    }
+    pthread_mutex_destroy(&it->lock);
+}
+
+/* the bucket edges of schema *schema*, for pmc_native_key: for j < 2^s,
+ * bounds[j] = 2^(j / 2^s - 1), the j-th edge in [0.5, 1), and bounds[2^s]
+ * is 1. lookup[t] is the first edge not below the lowest mantissa whose
+ * top bits are t. Nothing to do for schemas <= 0. */
+static void pmc_native_tables(struct pmc_item_native *h)
+{
+    const size_t n = h->schema > 0 ? (size_t)1 << h->schema : 0;
+    double low;
+    size_t j;
+    size_t t;
+
+    for (j = 0; j < n; j++) {
+        h->bounds[j] = pow(2., (double)j / (double)n - 1.);
+    }
+    if (0 == n) {
+        return;
+    }
+    h->bounds[n] = 1.;
+
+    for (t = 0, j = 0; t < (size_t)1 << PMC_NATIVE_LOOKUP_BITS; t++) {
+        low = 0.5 + ldexp((double)t, -PMC_NATIVE_LOOKUP_BITS - 1);
+        while (h->bounds[j] < low) {
+            j++;
+        }
+        h->lookup[t] = (uint16_t)j;
+    }
+}
+
+/* floor(value / 2^shift), whatever the sign of *value* */
+static int32_t pmc_floor_shift(int32_t value, int shift)
+{
+    return value >= 0 ? value >> shift : -((-value - 1) >> shift) - 1;
+}
+
+/* the index of the bucket of *value*, positive, above the zero bucket.
+ * value = frac * 2^exp, frac in [0.5, 1), is read off the bits, as frexp
+ * would split it: values that far from 0 are normal. For a positive
+ * schema, 2^s edges split each octave, and frac is between two of them.
+ * An octave holds at most 256 edges, at least 1/256 of an octave apart:
+ * the top 10 bits of the mantissa leave one candidate edge, and a single
+ * comparison settles the index. No search, as the Go client does with a
+ * binary search over the edges. */
+static int32_t pmc_native_key(const struct pmc_item_native *h, double value)
+{
+    const uint64_t bits = double_to_bits(value);
+    const uint64_t mantissa = bits & (((uint64_t)1 << 52) - 1);
+    int32_t exp = (int32_t)((bits >> 52) & 0x7ff) - 1022;
+    double frac;
+    size_t j;
+
+    if (h->schema <= 0) {
+        /* powers of 2 close their bucket */
+        exp -= 0 == mantissa;
+        return pmc_floor_shift(exp + (1 << -h->schema) - 1, -h->schema);
+    }
+
+    frac = bits_to_double(mantissa | ((uint64_t)1022 << 52));
+    j = h->lookup[mantissa >> (52 - PMC_NATIVE_LOOKUP_BITS)];
+    j += frac > h->bounds[j];
+    return (int32_t)j + (exp - 1) * (1 << h->schema);
+}
+
+/* the slot of *key* in *b*, or the free slot where it would go */
+static size_t pmc_native_slot(const struct pmc_native_buckets *b, int32_t key)
+{
+    const size_t mask = b->capacity - 1;
+    uint32_t hash = (uint32_t)key * 0x9E3779B1u;
+    size_t i = (hash ^ (hash >> 16)) & mask;
+
+    while (0 != b->slots[i].count && key != b->slots[i].key) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* move the buckets of *b* to a new table of *capacity* slots. With
+ * *merge*, buckets are merged pairwise, for the schema below: buckets
+ * 2k - 1 and 2k become bucket k.
+ * RETURN VALUE:
+ *  -1 -> allocation failed, *b* is unchanged.
+ *   0 -> success
+ */
+static int pmc_native_rehash(struct pmc_native_buckets *b,
+                             size_t capacity,
+                             int merge)
+{
+    struct pmc_native_buckets out;
+    int32_t key;
+    size_t i;
+    size_t j;
+
+    out.slots = ZERO_ALLOC(struct pmc_native_bucket, capacity);
+    if (NULL == out.slots) {
+        return -1;
+    }
+    out.capacity = capacity;
+    out.count = 0;
+
+    for (i = 0; i < b->capacity; i++) {
+        if (0 == b->slots[i].count) {
+            continue;
+        }
+        key = b->slots[i].key;
+        key = merge ? pmc_floor_shift(key + 1, 1) : key;
+        j = pmc_native_slot(&out, key);
+        out.count += 0 == out.slots[j].count;
+        out.slots[j].key = key;
+        out.slots[j].count += b->slots[i].count;
+    }
+
+    free(b->slots);
+    *b = out;
+    return 0;
+}
+
+/* count one more observation in bucket *key*, created if needed. The
+ * table stays at most 3/4 full.
+ * RETURN VALUE:
+ *  -1 -> allocation failed, the observation is lost.
+ *   0 -> success
+ */
+static int pmc_native_add(struct pmc_native_buckets *b, int32_t key)
+{
+    size_t i = 0;
+
+    if (0 != b->capacity) {
+        i = pmc_native_slot(b, key);
+        if (0 != b->slots[i].count) {
+            b->slots[i].count++;
+            return 0;
+        }
+    }
+
+    if (4 * (b->count + 1) > 3 * b->capacity) {
+        if (0 != pmc_native_rehash(b, 0 == b->capacity ? 16
+                                                       : 2 * b->capacity, 0)) {
+            return -1;
+        }
+        i = pmc_native_slot(b, key);
+    }
+
+    b->slots[i].key = key;
+    b->slots[i].count = 1;
+    b->count++;
+    return 0;
+}
+
+/* halve the resolution: one schema down. RETURN VALUE: as
+ * pmc_native_rehash */
+static int pmc_native_widen(struct pmc_item_native *h)
+{
+    struct pmc_native_buckets *sides[2];
+    size_t i;
+
+    sides[0] = &h->positive;
+    sides[1] = &h->negative;
+    for (i = 0; i < 2; i++) {
+        if (0 != sides[i]->capacity
+            && 0 != pmc_native_rehash(sides[i], sides[i]->capacity, 1)) {
+            return -1;
+        }
+    }
+
+    h->schema--;
+    pmc_native_tables(h);
+    return 0;
+}
+
+static int pmc_compare_bucket(const void *a, const void *b)
+{
+    const int32_t x = ((const struct pmc_native_bucket*)a)->key;
+    const int32_t y = ((const struct pmc_native_bucket*)b)->key;
+
+    return (x > y) - (x < y);
+}
+
+/* what the serializers need of a native histogram, taken at once */
+struct pmc_native_snapshot {
+    int schema;
+    uint64_t count;
+    double sum;
+    uint64_t zero_count;
+    const struct pmc_native_bucket *negative; /* by increasing index */
+    size_t negative_count;
+    const struct pmc_native_bucket *positive; /* same */
+    size_t positive_count;
+};
+
+/* copy the populated buckets in *it->sorted*, then sort them out of the
+ * lock. Only the serializer uses *sorted*.
+ * RETURN VALUE:
+ *  -1 -> allocation failed
+ *   0 -> success
+ */
+static int pmc_native_query(struct pmc_item_native *it,
+                            struct pmc_native_snapshot *out)
+{
+    struct pmc_native_bucket *sorted = NULL;
+    const struct pmc_native_buckets *sides[2];
+    size_t total;
+    size_t i;
+    size_t j;
+    size_t n = 0;
+
+    sides[0] = &it->negative;
+    sides[1] = &it->positive;
+
+    pthread_mutex_lock(&it->lock);
+    total = it->negative.count + it->positive.count;
+    if (total > it->sorted_capacity) {
+        sorted = (struct pmc_native_bucket*)realloc(
+            it->sorted, 2 * total * sizeof(*sorted));
+        if (NULL == sorted) {
+            pthread_mutex_unlock(&it->lock);
+            return -1;
+        }
+        it->sorted = sorted;
+        it->sorted_capacity = 2 * total;
+    }
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < sides[i]->capacity; j++) {
+            if (0 != sides[i]->slots[j].count) {
+                it->sorted[n++] = sides[i]->slots[j];
+            }
+        }
+    }
+
+    out->schema = it->schema;
+    out->count = it->count;
+    out->sum = it->sum;
+    out->zero_count = it->zero_count;
+    out->negative_count = it->negative.count;
+    out->positive_count = it->positive.count;
+    pthread_mutex_unlock(&it->lock);
+
+    out->negative = it->sorted;
+    out->positive = it->sorted + out->negative_count;
+    qsort(it->sorted, out->negative_count, sizeof(*it->sorted),
+          pmc_compare_bucket);
+    qsort(it->sorted + out->negative_count, out->positive_count,
+          sizeof(*it->sorted), pmc_compare_bucket);
+    return 0;
+}
+
+/* the upper edge of bucket *key*: 2^(key / 2^schema) */
+static double pmc_native_bound(int schema, int32_t key)
+{
+    return pow(2., ldexp((double)key, -schema));
+}
+
+pmc_native_histogram_h pmc_create_native_histogram(pmc_metric_s m,
+                                                   const char *name,
+                                                   int schema,
+                                                   size_t max_buckets)
+{
+    return pmc_create_native_histogram_labels(m, name, NULL, NULL, 0,
+                                              schema, max_buckets);
+}
+
+pmc_native_histogram_h pmc_create_native_histogram_labels(
+    pmc_metric_s m,
+    const char *name,
+    const char * const *label_keys,
+    const char * const *label_values,
+    size_t label_count,
+    int schema,
+    size_t max_buckets)
+{
+    struct pmc_item_native *item = NULL;
+    const size_t n = schema > 0 ? (size_t)1 << schema : 0;
+
+    CHECK_KILLSWITCH(NULL);
+
+    assert(schema >= PMC_NATIVE_SCHEMA_MIN && schema <= PMC_NATIVE_SCHEMA_MAX);
+
+    item = (struct pmc_item_native*)pmc_arena_zalloc(&m->arena, sizeof(*item),
+                                                     PMC_ARENA_ALIGN);
+    RET_ON_FALSE(NULL != item, PMC_ERROR_ALLOCATION, NULL);
+
+    /* widening reuses the tables: lower schemas need less */
+    if (n > 0) {
+        item->bounds = (double*)pmc_arena_alloc(
+            &m->arena, (n + 1) * sizeof(double), sizeof(double));
+        item->lookup = (uint16_t*)pmc_arena_alloc(
+            &m->arena, ((size_t)1 << PMC_NATIVE_LOOKUP_BITS) * sizeof(uint16_t),
+            sizeof(uint16_t));
+        RET_ON_FALSE(NULL != item->bounds && NULL != item->lookup,
+                     PMC_ERROR_ALLOCATION, NULL);
+    }
+
+    item->list.dirty = 1;
+    item->schema = schema;
+    item->max_buckets = max_buckets;
+    pmc_native_tables(item);
+    pthread_mutex_init(&item->lock, NULL);
+
+    if (0 != pmc_key_register(m, &item->list.key, PM_NATIVE_HISTOGRAM, name,
+                              label_keys, label_values, label_count)) {
+        pthread_mutex_destroy(&item->lock);
+        return NULL;
+    }
+    item->next_native = m->natives;
+    m->natives = item;
+    return item;
+}
+
+pmc_native_histogram_h pmc_get_native_histogram(pmc_metric_s m,
+                                                const char *name)
+{
+    return pmc_get_native_histogram_labels(m, name, NULL, NULL, 0);
+}
+
+pmc_native_histogram_h pmc_get_native_histogram_labels(
+    pmc_metric_s m,
+    const char *name,
+    const char * const *label_keys,
+    const char * const *label_values,
+    size_t label_count)
+{
+    struct pmc_key *it = NULL;
+
+    CHECK_KILLSWITCH(NULL);
+
+    it = pmc_find(m, PM_NATIVE_HISTOGRAM, name, label_keys, label_values,
+                  label_count);
+    RET_ON_FALSE(NULL != it, PMC_ERROR_INVALID_KEY, NULL);
+
+    return (struct pmc_item_native*)it;
+}
+
+void pmc_native_histogram_observe(pmc_native_histogram_h h, double value)
+{
+    int res = 0;
+
+    CHECK_KILLSWITCH();
+
+    assert(NULL != h);
+
+    pthread_mutex_lock(&h->lock);
+    h->count++;
+    h->sum += value;
+    /* NaN is counted, but in no bucket, as in the Go client */
+    if (fabs(value) <= PMC_NATIVE_ZERO_THRESHOLD) {
+        h->zero_count++;
+    } else if (value == value) {
+        res = pmc_native_add(value > 0. ? &h->positive : &h->negative,
+                             pmc_native_key(h, fabs(value)));
+    }
+
+    while (0 == res && 0 != h->max_buckets
+           && h->positive.count + h->negative.count > h->max_buckets
+           && h->schema > PMC_NATIVE_SCHEMA_MIN) {
+        res = pmc_native_widen(h);
+    }
+    pthread_mutex_unlock(&h->lock);
+
+    pmc_mark_dirty(&h->list);
+    RET_ON_FALSE(0 == res, PMC_ERROR_ALLOCATION);
+}
+
+static void pmc_native_release(struct pmc_item_native *it)
+{
+    free(it->positive.slots);
+    free(it->negative.slots);
+    free(it->sorted);
+    pthread_mutex_destroy(&it->lock);
+}
+
+/* GZIP:
+ * pushed bodies can be gzipped before they reach the sink. Bucket lines
+ * repeat the same names and labels, they shrink a lot. With PMC_HAVE_ZLIB
+ * defined (link with -lz), zlib does the work. Otherwise a small built-in
+ * deflate is used: LZ77 on hash chains, then the fixed Huffman codes of
+ * RFC 1951. Fixed codes spare building trees, and do well on such text.
+ *
+ * The body is compressed in one go, from the serialization buffer to a
+ * second buffer, which keeps the header space in front like the first.
+ */
+
+#define CONTENT_ENCODING_GZIP "Content-Encoding: gzip\r\n"
+
+#if defined(PMC_HAVE_ZLIB)
+
+struct pmc_deflate {
+    z_stream stream;
+};
+
+static struct pmc_deflate* pmc_deflate_create(void)
+{
+    struct pmc_deflate *d = ZERO_ALLOC(struct pmc_deflate, 1);
+
+    if (NULL == d) {
+        return NULL;
+    }
+
+    /* 15 + 16: a 32K window, and the gzip wrapper */
+    if (Z_OK != deflateInit2(&d->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                             15 + 16, 8, Z_DEFAULT_STRATEGY)) {
+        free(d);
+        return NULL;
+    }
+
+    return d;
+}
+
+static void pmc_deflate_destroy(struct pmc_deflate *d)
+{
+    deflateEnd(&d->stream);
+    free(d);
+}
+
+/* append the gzip member of *data* to *out*.
+ * RETURN VALUE:
+ *  -1 -> allocation failed
+ *   0 -> success
+ */
+static int pmc_gzip(struct pmc_deflate *d,
+                    wbuffer_t out,
+                    const char *data,
+                    size_t size)
+{
+    const size_t bound = deflateBound(&d->stream, (uLong)size);
+    char *ptr = wbuffer_reserve(out, bound);
+
+    if (NULL == ptr) {
+        return -1;
+    }
+
+    deflateReset(&d->stream);
+    d->stream.next_in = (Bytef*)data;
+    d->stream.avail_in = (uInt)size;
+    d->stream.next_out = (Bytef*)ptr;
+    d->stream.avail_out = (uInt)bound;
+    if (Z_STREAM_END != deflate(&d->stream, Z_FINISH)) {
+        return -1;
+    }
+
+    wbuffer_commit(out, bound - d->stream.avail_out);
+    return 0;
+}
+
+#else
+
+#define PMC_DEFLATE_WINDOW 32768
+#define PMC_DEFLATE_HASH_BITS 14
+#define PMC_DEFLATE_CHAIN 8 /* candidates tried per position */
+#define PMC_DEFLATE_MIN_MATCH 3
+#define PMC_DEFLATE_MAX_MATCH 258
+
+struct pmc_deflate {
+    /* last position + 1 seen for each hash, 0 when none */
+    uint32_t head[1 << PMC_DEFLATE_HASH_BITS];
+    /* distance from a position to the previous one with the same hash,
+     * 0 when none, or too far */
+    uint16_t prev[PMC_DEFLATE_WINDOW];
+};
+
+static const uint16_t pmc_deflate_length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const unsigned char pmc_deflate_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t pmc_deflate_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+
+static const unsigned char pmc_deflate_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* built once: the fixed literal/length codes, bit-reversed because deflate
+ * sends Huffman codes from their most significant bit, and everything else
+ * from the least. Then the CRC-32 table of the gzip trailer. */
+static uint16_t pmc_deflate_codes[288];
+static unsigned char pmc_deflate_code_bits[288];
+static uint32_t pmc_crc_table[256];
+static pthread_once_t pmc_deflate_once = PTHREAD_ONCE_INIT;
+
+static uint32_t pmc_bit_reverse(uint32_t code, unsigned int bits)
+{
+    uint32_t out = 0;
+
+    while (bits-- > 0) {
+        out = (out << 1) | (code & 1);
+        code >>= 1;
+    }
+
+    return out;
+}
+
+static void pmc_deflate_tables(void)
+{
+    uint32_t code;
+    uint32_t crc;
+    unsigned int bits;
+    unsigned int i;
+    unsigned int k;
+
+    for (i = 0; i < 288; i++) {
+        if (i < 144) {
+            code = 0x30 + i;
+            bits = 8;
+        } else if (i < 256) {
+            code = 0x190 + i - 144;
+            bits = 9;
+        } else if (i < 280) {
+            code = i - 256;
+            bits = 7;
+        } else {
+            code = 0xc0 + i - 280;
+            bits = 8;
+        }
+        pmc_deflate_codes[i] = (uint16_t)pmc_bit_reverse(code, bits);
+        pmc_deflate_code_bits[i] = (unsigned char)bits;
+    }
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (k = 0; k < 8; k++) {
+            crc = (crc & 1) ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+        }
+        pmc_crc_table[i] = crc;
+    }
+}
+
+static struct pmc_deflate* pmc_deflate_create(void)
+{
+    return ALLOC(struct pmc_deflate, 1);
+}
+
+static void pmc_deflate_destroy(struct pmc_deflate *d)
+{
+    free(d);
+}
+
+/* LSB-first bit writer. The output space is reserved beforehand. */
+struct pmc_bits {
+    unsigned char *out;
+    uint32_t acc;
+    unsigned int count; /* bits pending in acc, always < 8 between calls */
+};
+
+static void pmc_bits_put(struct pmc_bits *b, uint32_t value, unsigned int bits)
+{
+    b->acc |= value << b->count;
+    b->count += bits;
+    while (b->count >= 8) {
+        *b->out++ = (unsigned char)b->acc;
+        b->acc >>= 8;
+        b->count -= 8;
+    }
+}
+
+static void pmc_bits_symbol(struct pmc_bits *b, unsigned int symbol)
+{
+    pmc_bits_put(b, pmc_deflate_codes[symbol], pmc_deflate_code_bits[symbol]);
+}
+
+static void pmc_deflate_match(struct pmc_bits *b,
+                              size_t length,
+                              size_t distance)
+{
+    unsigned int code = 28;
+
+    while (pmc_deflate_length_base[code] > length) {
+        code--;
+    }
+    pmc_bits_symbol(b, 257 + code);
+    pmc_bits_put(b, (uint32_t)(length - pmc_deflate_length_base[code]),
+                 pmc_deflate_length_extra[code]);
+
+    code = 29;
+    while (pmc_deflate_dist_base[code] > distance) {
+        code--;
+    }
+    pmc_bits_put(b, pmc_bit_reverse(code, 5), 5);
+    pmc_bits_put(b, (uint32_t)(distance - pmc_deflate_dist_base[code]),
+                 pmc_deflate_dist_extra[code]);
+}
+
+/* chain position *pos* to its hash. Needs PMC_DEFLATE_MIN_MATCH bytes.
+ * RETURN VALUE: the previous position + 1 with the same hash, or 0 */
+static uint32_t pmc_deflate_insert(struct pmc_deflate *d,
+                                   const unsigned char *data,
+                                   size_t pos)
+{
+    const uint32_t key = ((uint32_t)data[pos] << 16)
+                         | ((uint32_t)data[pos + 1] << 8)
+                         | data[pos + 2];
+    const uint32_t hash = (key * 2654435761u) >> (32 - PMC_DEFLATE_HASH_BITS);
+    const uint32_t last = d->head[hash];
+
+    d->prev[pos & (PMC_DEFLATE_WINDOW - 1)] =
+        0 != last && pos - (last - 1) < PMC_DEFLATE_WINDOW
+            ? (uint16_t)(pos - (last - 1)) : 0;
+    d->head[hash] = (uint32_t)pos + 1;
+
+    return last;
+}
+
+static void pmc_put_le32(unsigned char *ptr, uint32_t value)
+{
+    ptr[0] = (unsigned char)value;
+    ptr[1] = (unsigned char)(value >> 8);
+    ptr[2] = (unsigned char)(value >> 16);
+    ptr[3] = (unsigned char)(value >> 24);
+}
+
+/* append the gzip member of *data* to *out*: a single fixed-code block.
+ * RETURN VALUE:
+ *  -1 -> allocation failed, or *data* is over 4GB
+ *   0 -> success
+ */
+static int pmc_gzip(struct pmc_deflate *d,
+                    wbuffer_t out,
+                    const char *data,
+                    size_t size)
+{
+    /* no name, no mtime, OS "unix" */
+    static const unsigned char header[10] = {
+        0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3
+    };
+    const unsigned char *in = (const unsigned char*)data;
+    /* a literal costs at most 9 bits, a 3 bytes match at most 31 */
+    const size_t bound = sizeof(header) + size + size / 2 + 8 + 8;
+    unsigned char *ptr = NULL;
+    struct pmc_bits bits;
+    uint32_t crc = 0xffffffff;
+    uint32_t candidate;
+    size_t best_len;
+    size_t best_dist;
+    size_t limit;
+    size_t len;
+    size_t chain;
+    size_t pos;
+    size_t i;
+
+    if (size >= 0xffffffffu) {
+        return -1;
+    }
+
+    ptr = (unsigned char*)wbuffer_reserve(out, bound);
+    if (NULL == ptr) {
+        return -1;
+    }
+
+    pthread_once(&pmc_deflate_once, pmc_deflate_tables);
+    memset(d->head, 0, sizeof(d->head));
+
+    memcpy(ptr, header, sizeof(header));
+    bits.out = ptr + sizeof(header);
+    bits.acc = 0;
+    bits.count = 0;
+    pmc_bits_put(&bits, 1, 1); /* last block */
+    pmc_bits_put(&bits, 1, 2); /* fixed codes */
+
+    pos = 0;
+    while (pos < size) {
+        best_len = 0;
+        best_dist = 0;
+
+        if (size - pos >= PMC_DEFLATE_MIN_MATCH) {
+            limit = size - pos < PMC_DEFLATE_MAX_MATCH ? size - pos
+                                                       : PMC_DEFLATE_MAX_MATCH;
+            candidate = pmc_deflate_insert(d, in, pos);
+
+            for (chain = PMC_DEFLATE_CHAIN; 0 != candidate && 0 != chain;
+                 chain--) {
+                i = candidate - 1;
+                if (pos - i >= PMC_DEFLATE_WINDOW) {
+                    break;
+                }
+
+                /* only a longer match is worth comparing */
+                if (in[i + best_len] == in[pos + best_len]) {
+                    for (len = 0; len < limit && in[i + len] == in[pos + len];
+                         len++) {
+                    }
+                    if (len > best_len) {
+                        best_len = len;
+                        best_dist = pos - i;
+                        if (len == limit) {
+                            break;
+                        }
+                    }
+                }
+
+                candidate = d->prev[i & (PMC_DEFLATE_WINDOW - 1)];
+                candidate = 0 == candidate ? 0 : (uint32_t)(i - candidate + 1);
+            }
+        }
+
+        if (best_len >= PMC_DEFLATE_MIN_MATCH) {
+            pmc_deflate_match(&bits, best_len, best_dist);
+            /* later matches can start inside this one */
+            for (i = pos + 1; i < pos + best_len
+                              && size - i >= PMC_DEFLATE_MIN_MATCH; i++) {
+                pmc_deflate_insert(d, in, i);
+            }
+            pos += best_len;
+        } else {
+            pmc_bits_symbol(&bits, in[pos]);
+            pos++;
+        }
+    }
+
+    pmc_bits_symbol(&bits, 256); /* end of block */
+    if (0 != bits.count) {
+        pmc_bits_put(&bits, 0, 8 - bits.count);
+    }
+
+    for (i = 0; i < size; i++) {
+        crc = pmc_crc_table[(crc ^ in[i]) & 0xff] ^ (crc >> 8);
+    }
+    pmc_put_le32(bits.out, crc ^ 0xffffffff);
+    pmc_put_le32(bits.out + 4, (uint32_t)size);
+
+    wbuffer_commit(out, (size_t)(bits.out + 8 - ptr));
+    return 0;
+}
+
+#endif
+
+#define HOSTNAME "127.0.0.1"
+#define HTTP_FMT "POST /metrics/job/%s HTTP/1.1\r\n"                   \
+                 "Host: " HOSTNAME "\r\n"                              \
+                 "Content-type: %s\r\n"                                \
+                 "%s"                                                  \
+                 "Content-length: " SIZE_T_FMT "\r\n\r\n"
+
+#define CONTENT_TYPE_TEXT "application/x-www-form-urlencoded"
+#define CONTENT_TYPE_PROTOBUF "application/vnd.google.protobuf; "          \
+                              "proto=io.prometheus.client.MetricFamily; " \
+                              "encoding=delimited"
+
+static const char* pmc_content_type(enum pmc_format format)
+{
+    return PMC_FORMAT_PROTOBUF == format ? CONTENT_TYPE_PROTOBUF
+                                         : CONTENT_TYPE_TEXT;
+}
+
+/* a body ready to send. *ptr* holds *reserved* bytes left for the
+ * header, then the body, up to *length*. */
+struct pmc_packet {
+    const char *content_type;
+    const char *content_encoding; /* a header line, or "" */
+    char *ptr;
+    size_t reserved;
+    size_t length;
+};
+
+/* space to reserve in front of the body for the HTTP header of *jobname*.
+ * Enough for the longest Content-length, the Content-Encoding line, and
+ * snprintf's null byte. */
+static size_t http_header_reserve(const char *jobname, const char *content_type)
+{
+    const int len = snprintf(NULL, 0, HTTP_FMT, jobname, content_type,
+                             CONTENT_ENCODING_GZIP, (size_t)-1);
+    return len < 0 ? 0 : (size_t)len + 1;
+}
+
+/* sinks need not be reentrant: pmc_send and the async sender thread
+ * take turns */
+static pthread_mutex_t pmc_sink_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The header is written right in front of the body, so both are sent at
+ * once, without copying the body. Sinks with pmc_output_datav get the
+ * header and the body as two iovecs.
+ *
+ * RETURN VALUE:
+ *  -1 -> the header did not fit, or the sink failed.
+ *   0 -> the packet was sent.
+ */
+static int send_http_packet(const char *jobname,
+                            const struct pmc_packet *packet)
+{
+    char *ptr = packet->ptr;
+    const size_t reserved = packet->reserved;
+    const size_t body_len = packet->length - reserved;
+    struct iovec iov[2];
+    size_t len;
+    int res;
+
+    /* snprintf writes a null byte: format at the start of the reserved
+     * area, then move the header against the body. */
+    res = snprintf(ptr, reserved, HTTP_FMT, jobname, packet->content_type,
+                   packet->content_encoding, body_len);
+    RET_ON_FALSE(res >= 0 && (size_t)res < reserved, PMC_ERROR_OUTPUT, -1);
+
+    len = (size_t)res;
+
+    pthread_mutex_lock(&pmc_sink_lock);
+    if (NULL != &pmc_output_datav) {
+        iov[0].iov_base = ptr;
+        iov[0].iov_len = len;
+        iov[1].iov_base = ptr + reserved;
+        iov[1].iov_len = body_len;
+
+        res = pmc_output_datav(iov, 2);
+    } else {
+        memmove(ptr + reserved - len, ptr, len);
+        res = pmc_output_data(ptr + reserved - len, len + body_len);
+    }
+    pthread_mutex_unlock(&pmc_sink_lock);
+
+    /* reported once the lock is released: the handler may push too */
+    RET_ON_FALSE(0 == res, PMC_ERROR_OUTPUT, -1);
+    return 0;
+}
+
+/* write "<jobname>_<name>". RETURN VALUE: same as wbuffer_write */
+static int pmc_put_name(wbuffer_t buffer, const char *jobname, const char *name)
+{
+    int res = 0;
+
+    res |= wbuffer_puts(buffer, jobname);
+    res |= wbuffer_write(buffer, "_", 1);
+    res |= wbuffer_puts(buffer, name);
+    return res;
+}
+
+/* write "<jobname>_<name><suffix>{<labels>}". No braces without labels */
+static int pmc_put_series(wbuffer_t buffer,
+                          const char *jobname,
+                          const struct pmc_key *key,
+                          const char *suffix)
+{
+    int res = 0;
+
+    res |= pmc_put_name(buffer, jobname, key->name);
+    res |= wbuffer_puts(buffer, suffix);
+    if (NULL != key->labels) {
+        res |= wbuffer_write(buffer, "{", 1);
+        res |= wbuffer_puts(buffer, key->labels->text);
+        res |= wbuffer_write(buffer, "}", 1);
+    }
+    return res;
+}
+
+/* the serializers below OR the wbuffer_* results: any failure leaves a
+ * negative value. A failed write leaves the buffer unchanged, so carrying
+ * on is harmless. */
+static int pmc_output_gauge(wbuffer_t buffer,
+                            const char *jobname,
+                            const struct pmc_key *key,
+                            double value)
+{
+    int res = 0;
+
+    res |= pmc_put_series(buffer, jobname, key, "");
+    res |= wbuffer_write(buffer, " ", 1);
+    res |= wbuffer_put_double(buffer, value);
+    res |= wbuffer_write(buffer, "\n", 1);
+    RET_ON_FALSE(0 == res, PMC_ERROR_OUTPUT, -1);
+
+    return 0;
+}
+
+static int pmc_output_counter(wbuffer_t buffer,
+                              const char *jobname,
+                              const struct pmc_key *key,
+                              double value)
+{
+    int res = 0;
+
+    res |= pmc_put_series(buffer, jobname, key, pmc_name_suffix(key));
+    res |= wbuffer_write(buffer, " ", 1);
+    res |= wbuffer_put_double(buffer, value);
+    res |= wbuffer_write(buffer, "\n", 1);
+    RET_ON_FALSE(0 == res, PMC_ERROR_OUTPUT, -1);
+
+    return 0;
+}
+
+/* the rows of *it* whose slot is still in the window, as a bit mask. 0
+ * for histograms without a window. Computed once per serialization, so
+ * all the buckets see the same rows. */
+static uint64_t pmc_window_live(const struct pmc_item_histogram *it)
+{
+    const struct pmc_window *w = it->window;
+    uint64_t live = 0;
+    uint64_t now;
+    size_t r;
+
+    if (NULL == w) {
+        return 0;
+    }
+
+    /* unused rows hold UINT64_MAX, and rows of a slot started after *now*
+     * are skipped too: both wrap around */
+    now = pmc_clock_ns() / w->slot_ns;
+    for (r = 0; r < w->slot_count; r++) {
+        if (now - __atomic_load_n(&w->slots[r], __ATOMIC_ACQUIRE)
+            < w->slot_count) {
+            live |= (uint64_t)1 << r;
+        }
+    }
+    return live;
+}
+
+/* number of observations in bucket *i* (*size* for +Inf): shards and the
+ * *live* rows of the window merged */
+static uint64_t pmc_histogram_get_bucket(const struct pmc_item_histogram *it,
+                                         size_t i,
+                                         uint64_t live)
+{
+    uint64_t value = i < it->size ? it->counts[i] : it->overflow;
+    size_t s;
+
+    for (s = 0; s < it->shard_count; s++) {
+        value += ATOMIC_LOAD(&it->shards[s * it->shard_stride + i]);
+    }
+    for (s = 0; 0 != live; s++, live >>= 1) {
+        if (live & 1) {
+            value += ATOMIC_LOAD(&it->window->rows[s * it->window->stride
+                                                   + i]);
+        }
+    }
+    return value;
+}
+
+/* sum of the observed values: shards and *live* rows merged like
+ * buckets */
+static double pmc_histogram_get_sum(const struct pmc_item_histogram *it,
+                                    uint64_t live)
+{
+    double sum = it->sum;
+    size_t s;
+
+    for (s = 0; s < it->shard_count; s++) {
+        sum += atomic_load_double(&it->shards[s * it->shard_stride
+                                              + PMC_ROW_SUM(it->size)]);
+    }
+    for (s = 0; 0 != live; s++, live >>= 1) {
+        if (live & 1) {
+            sum += atomic_load_double(&it->window->rows[
+                s * it->window->stride + PMC_ROW_SUM(it->size)]);
+        }
+    }
+    return sum;
+}
+
+/* write "<jobname>_<name>_bucket{<labels>,le=\"" */
+static int pmc_put_bucket(wbuffer_t buffer,
+                          const char *jobname,
+                          const struct pmc_key *key)
+{
+    int res = 0;
+
+    res |= pmc_put_name(buffer, jobname, key->name);
+    res |= wbuffer_puts(buffer, "_bucket{");
+    if (NULL != key->labels) {
+        res |= wbuffer_puts(buffer, key->labels->text);
+        res |= wbuffer_write(buffer, ",", 1);
+    }
+    res |= wbuffer_puts(buffer, "le=\"");
+    return res;
+}
+
+/* copy the prefix of line *i* (see struct pmc_prefixes), and return where
+ * the value goes. PMC_NUMBER_MAX + 1 bytes are reserved there, for the
+ * value and the newline. */
+static char* pmc_put_prefix(wbuffer_t buffer,
+                            const struct pmc_prefixes *prefixes,
+                            size_t i)
+{
+    const size_t len = prefixes->offsets[i + 1] - prefixes->offsets[i];
+    char *ptr = wbuffer_reserve(buffer, len + PMC_NUMBER_MAX + 1);
+
+    if (NULL == ptr) {
+        return NULL;
+    }
+
+    memcpy(ptr, prefixes->text + prefixes->offsets[i], len);
+    wbuffer_commit(buffer, len);
+    return ptr + len;
+}
+
+/* a line holding a count: integer formatting only */
+static int pmc_put_count_line(wbuffer_t buffer,
+                              const struct pmc_prefixes *prefixes,
+                              size_t i,
+                              uint64_t count)
+{
+    char *ptr = pmc_put_prefix(buffer, prefixes, i);
+    size_t len;
+
+    if (NULL == ptr) {
+        return -1;
+    }
+
+    len = pmc_format_u64(ptr, count);
+    ptr[len] = '\n';
+    wbuffer_commit(buffer, len + 1);
+    return 0;
+}
+
+static int pmc_put_value_line(wbuffer_t buffer,
+                              const struct pmc_prefixes *prefixes,
+                              size_t i,
+                              double value)
+{
+    char *ptr = pmc_put_prefix(buffer, prefixes, i);
+    size_t len;
+
+    if (NULL == ptr) {
+        return -1;
+    }
+
+    len = pmc_format_double(ptr, value);
+    ptr[len] = '\n';
+    wbuffer_commit(buffer, len + 1);
+    return 0;
+}
+
+/* only the counts are formatted, the rest of the lines is copied */
+static int pmc_output_histogram(wbuffer_t buffer,
+                                struct pmc_item_histogram *it)
+{
+    const struct pmc_prefixes *prefixes = &it->prefixes;
+    const uint64_t live = pmc_window_live(it);
+    int res = 0;
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < it->size; i++) {
+        count += pmc_histogram_get_bucket(it, i, live);
+        res |= pmc_put_count_line(buffer, prefixes, i, count);
+    }
+
+    count += pmc_histogram_get_bucket(it, it->size, live);
+    res |= pmc_put_count_line(buffer, prefixes, it->size, count);
+    res |= pmc_put_count_line(buffer, prefixes, it->size + 1, count);
+    res |= pmc_put_value_line(buffer, prefixes, it->size + 2,
+                              pmc_histogram_get_sum(it, live));
+    RET_ON_FALSE(0 == res, PMC_ERROR_OUTPUT, -1);
+
+    return 0;
+}
+
+/* the quantile lines, then _sum and _count, as the Go client does */
+static int pmc_output_summary(wbuffer_t buffer, struct pmc_item_summary *it)
+{
+    const struct pmc_prefixes *prefixes = &it->prefixes;
+    uint64_t count;
+    double sum;
+    size_t i;
+    int res = 0;
+
+    pmc_summary_query(it, &count, &sum);
+
+    for (i = 0; i < it->size; i++) {
+        res |= pmc_put_value_line(buffer, prefixes, i, it->estimates[i]);
+    }
+    res |= pmc_put_value_line(buffer, prefixes, it->size, sum);
+    res |= pmc_put_count_line(buffer, prefixes, it->size + 1, count);
+    RET_ON_FALSE(0 == res, PMC_ERROR_OUTPUT, -1);
+
+    return 0;
+}
+
+/* write "<count>\n". RETURN VALUE: same as wbuffer_write */
+static int pmc_put_count(wbuffer_t buffer, uint64_t count)
+{
+    char *ptr = wbuffer_reserve(buffer, PMC_NUMBER_MAX + 1);
+    size_t len;
+
+    if (NULL == ptr) {
+        return -1;
+    }
+
+    len = pmc_format_u64(ptr, count);
+    ptr[len] = '\n';
+    wbuffer_commit(buffer, len + 1);
+    return 0;
+}
+
+/* write one "<jobname>_<name>_bucket{<labels>,le="<bound>"} <count>" line */
+static int pmc_put_native_line(wbuffer_t buffer,
+                               const char *jobname,
+                               const struct pmc_key *key,
+                               double bound,
+                               uint64_t count)
+{
+    int res = 0;
+
+    res |= pmc_put_bucket(buffer, jobname, key);
+    res |= wbuffer_put_double(buffer, bound);
+    res |= wbuffer_puts(buffer, "\"} ");
+    res |= pmc_put_count(buffer, count);
+    return res;
+}
+
+/* the text format has no native histograms: the populated buckets are
+ * written as classic ones, each bounded by its upper edge. Negative
+ * buckets come first, from the lowest values, then the zero bucket. */
+static int pmc_output_native(wbuffer_t buffer,
+                             const char *jobname,
+                             struct pmc_item_native *it)
+{
+    const struct pmc_key *key = &it->list.key;
+    struct pmc_native_snapshot snap;
+    uint64_t count = 0;
+    size_t i;
+    int res = 0;
+
+    RET_ON_FALSE(0 == pmc_native_query(it, &snap), PMC_ERROR_ALLOCATION, -1);
+
+    for (i = snap.negative_count; i > 0; i--) {
+        count += snap.negative[i - 1].count;
+        res |= pmc_put_native_line(
+            buffer, jobname, key,
+            -pmc_native_bound(snap.schema, snap.negative[i - 1].key - 1),
+            count);
+    }
+    if (0 != snap.zero_count) {
+        count += snap.zero_count;
+        res |= pmc_put_native_line(buffer, jobname, key,
+                                   PMC_NATIVE_ZERO_THRESHOLD, count);
+    }
+    for (i = 0; i < snap.positive_count; i++) {
+        count += snap.positive[i].count;
+        res |= pmc_put_native_line(
+            buffer, jobname, key,
+            pmc_native_bound(snap.schema, snap.positive[i].key), count);
+    }
+
+    /* NaN observations only show in _count */
+    res |= pmc_put_bucket(buffer, jobname, key);
+    res |= wbuffer_puts(buffer, "+Inf\"} ");
+    res |= pmc_put_count(buffer, snap.count);
+    res |= pmc_put_series(buffer, jobname, key, "_count");
+    res |= wbuffer_write(buffer, " ", 1);
+    res |= pmc_put_count(buffer, snap.count);
+    res |= pmc_put_series(buffer, jobname, key, "_sum");
+    res |= wbuffer_write(buffer, " ", 1);
+    res |= wbuffer_put_double(buffer, snap.sum);
+    res |= wbuffer_write(buffer, "\n", 1);
+    RET_ON_FALSE(0 == res, PMC_ERROR_OUTPUT, -1);
+
+    return 0;
+}
+
+static int pmc_output_item(wbuffer_t buffer,
+                           const char *jobname,
+                           struct pmc_item_list *item)
+{
+    switch (item->key.type) {
+        case PM_HISTOGRAM:
+            return pmc_output_histogram(buffer,
+                                        (struct pmc_item_histogram*)item);
+        case PM_SUMMARY:
+            return pmc_output_summary(buffer,
+                                      (struct pmc_item_summary*)item);
+        case PM_NATIVE_HISTOGRAM:
+            return pmc_output_native(buffer, jobname,
+                                     (struct pmc_item_native*)item);
+        case PM_GAUGE:      /* fallthrough: see pmc_serialize_gauge */
+        case PM_COUNTER:    /* fallthrough: see pmc_serialize_counter */
+        case PM_TYPE_COUNT: /* fallthrough */
+        case PM_NONE:       /* fallthrough */
+            assert(0); /* implementation safeguard */
+            break;
+    }
+    return -1;
+}
+
+/* SERIALIZATION CACHE:
+ * most items of a large set do not change between two sends. Each item
+ * keeps a copy of its last rendering, reused as is while the item is not
+ * dirty. Updates set the flag after storing the value; the serializer
+ * clears it before reading the value, so an update racing with the
+ * rendering leaves the flag set, and is picked up by the next send.
+ * Sharded histograms are always rendered: their writers would otherwise
+ * all share the flag's cache line.
+ * Gauges compare their value with the one of the fragment instead, see
+ * struct pmc_gauge_block, and so do counters.
+ */
+
+/* keep what was written to *buffer* since *start* as *fragment*.
+ * RETURN VALUE:
+ *  -1 -> allocation failed, the fragment is unchanged.
+ *   0 -> stored.
+ */
+static int pmc_fragment_store(pmc_metric_s metric,
+                              struct pmc_fragment *fragment,
+                              wbuffer_t buffer,
+                              size_t start)
+{
+    const size_t len = wbuffer_get_length(buffer) - start;
+    char *ptr = NULL;
+
+    /* the old fragment stays in the arena: leave some room to grow, so
+     * values getting longer do not reallocate on every send */
+    if (len > fragment->size) {
+        ptr = (char*)pmc_arena_alloc(&metric->arena, len + len / 4, 1);
+        if (NULL == ptr) {
+            return -1;
+        }
+        fragment->ptr = ptr;
+        fragment->size = len + len / 4;
+    }
+
+    memcpy(fragment->ptr, (char*)wbuffer_get_ptr(buffer) + start, len);
+    fragment->len = len;
+    return 0;
+}
+
+static int pmc_serialize_item(wbuffer_t buffer,
+                              pmc_metric_s metric,
+                              struct pmc_item_list *item)
+{
+    const struct pmc_item_histogram *h = NULL;
+    const struct pmc_item_summary *summary = NULL;
+    size_t start;
+    int res;
+
+    /* sharded items are never marked dirty, and windowed ones change with
+     * time alone */
+    if (PM_HISTOGRAM == item->key.type) {
+        h = (const struct pmc_item_histogram*)item;
+        if (NULL != h->shards || NULL != h->window) {
+            return pmc_output_item(buffer, metric->jobname, item);
+        }
+    }
+    if (PM_SUMMARY == item->key.type) {
+        summary = (const struct pmc_item_summary*)item;
+        if (0 != summary->slot_ns) {
+            return pmc_output_item(buffer, metric->jobname, item);
+        }
+    }
+
+    if (!__atomic_exchange_n(&item->dirty, 0, __ATOMIC_ACQ_REL)) {
+        return wbuffer_write(buffer, item->fragment.ptr, item->fragment.len);
+    }
+
+    start = wbuffer_get_length(buffer);
+    res = pmc_output_item(buffer, metric->jobname, item);
+    if (0 != res || 0 != pmc_fragment_store(metric, &item->fragment,
+                                            buffer, start)) {
+        /* not cached this time */
+        pmc_mark_dirty(item);
+    }
+    return res;
+}
+
+static int pmc_serialize_gauge(wbuffer_t buffer,
+                               pmc_metric_s metric,
+                               const struct pmc_gauge_key *key)
+{
+    struct pmc_gauge_block *block = key->block;
+    const size_t i = (size_t)(key - block->keys);
+    struct pmc_fragment *fragment = &block->fragments[i];
+    const uint64_t bits = ATOMIC_LOAD(&key->value->value);
+    size_t start;
+    int res;
+
+    if (NULL != fragment->ptr && bits == block->rendered[i]) {
+        return wbuffer_write(buffer, fragment->ptr, fragment->len);
+    }
+
+    start = wbuffer_get_length(buffer);
+    res = pmc_output_gauge(buffer, metric->jobname, &key->key,
+                           bits_to_double(bits));
+    if (0 != res) {
+        return res;
+    }
+    /* on failure, the old fragment still matches the old value */
+    if (0 == pmc_fragment_store(metric, fragment, buffer, start)) {
+        block->rendered[i] = bits;
+    }
+
+    return 0;
+}
+
+static int pmc_serialize_counter(wbuffer_t buffer,
+                                 pmc_metric_s metric,
+                                 struct pmc_item_counter *it)
+{
+    struct pmc_fragment *fragment = &it->list.fragment;
+    const double value = pmc_counter_value(it);
+    const uint64_t bits = double_to_bits(value);
+    size_t start;
+    int res;
+
+    if (NULL != fragment->ptr && bits == it->rendered) {
+        return wbuffer_write(buffer, fragment->ptr, fragment->len);
+    }
+
+    start = wbuffer_get_length(buffer);
+    res = pmc_output_counter(buffer, metric->jobname, &it->list.key, value);
+    if (0 != res) {
+        return res;
+    }
+    if (0 == pmc_fragment_store(metric, fragment, buffer, start)) {
+        it->rendered = bits;
+    }
+
+    return 0;
+}
+
+/* write the whole metric set, in the text exposition format: each family
+ * header, then its series */
+static int pmc_serialize_text(wbuffer_t buffer, pmc_metric_s metric)
+{
+    const struct pmc_family *family = NULL;
+    struct pmc_key *key = NULL;
+    int res;
+
+    for (family = metric->families; NULL != family; family = family->next) {
+        /* a family whose first series failed to register */
+        if (NULL == family->first) {
+            continue;
+        }
+
+        res = wbuffer_write(buffer, family->header, family->header_len);
+        RET_ON_FALSE(0 == res, PMC_ERROR_OUTPUT, -1);
+
+        for (key = family->first; NULL != key; key = key->sibling) {
+            if (PM_GAUGE == key->type) {
+                res = pmc_serialize_gauge(buffer, metric,
+                                          (struct pmc_gauge_key*)key);
+            } else if (PM_COUNTER == key->type) {
+                res = pmc_serialize_counter(buffer, metric,
+                                            (struct pmc_item_counter*)key);
+            } else {
+                res = pmc_serialize_item(buffer, metric,
+                                         (struct pmc_item_list*)key);
+            }
+            RET_ON_FALSE(0 == res, PMC_ERROR_OUTPUT, -1);
+        }
+    }
+
+    return 0;
+}
+
+/* PROTOBUF:
+ * hand-written encoder for the delimited protobuf format: each
+ * io.prometheus.client.MetricFamily message is prefixed with its length as
+ * a varint. Only the fields this client needs are written:
+ *  MetricFamily: name = 1, help = 2, type = 3, metric = 4
+ *  Metric: label = 1, gauge = 2, counter = 3, summary = 4, histogram = 7
+ *  LabelPair: name = 1, value = 2
+ *  Gauge, Counter: value = 1
+ *  Summary: sample_count = 1, sample_sum = 2, quantile = 3
+ *  Quantile: quantile = 1, value = 2
+ *  Histogram: sample_count = 1, sample_sum = 2, bucket = 3, schema = 5,
+ *             zero_threshold = 6, zero_count = 7, negative_span = 9,
+ *             negative_delta = 10, positive_span = 12, positive_delta = 13
+ *  Bucket: cumulative_count = 1, upper_bound = 2
+ *  BucketSpan: offset = 1, length = 2
+ * As in the Go client, the +Inf bucket is implied by sample_count.
+ * Values are always read fresh: the text fragments are not used here.
+ */
+#define PB_VARINT 0
+#define PB_FIXED64 1
+#define PB_BYTES 2
+#define PB_TAG(Field, Wire) ((uint64_t)(((Field) << 3) | (Wire)))
+
+#define PB_TYPE_COUNTER 0
+#define PB_TYPE_GAUGE 1
+#define PB_TYPE_SUMMARY 2
+#define PB_TYPE_HISTOGRAM 4
+
+static size_t pb_varint_size(uint64_t value)
+{
+    size_t size = 1;
+
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static size_t pb_encode_varint(char *out, uint64_t value)
+{
+    size_t i = 0;
+
+    while (value >= 0x80) {
+        out[i++] = (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out[i++] = (char)value;
+    return i;
+}
+
+static int pb_put_varint(wbuffer_t buffer, uint64_t value)
+{
+    char tmp[10];
+    return wbuffer_write(buffer, tmp, pb_encode_varint(tmp, value));
+}
+
+static int pb_put_uint(wbuffer_t buffer, unsigned int field, uint64_t value)
+{
+    char tmp[20];
+    size_t len;
+
+    len = pb_encode_varint(tmp, PB_TAG(field, PB_VARINT));
+    len += pb_encode_varint(tmp + len, value);
+    return wbuffer_write(buffer, tmp, len);
+}
+
+/* doubles are little-endian on the wire, whatever the host */
+static int pb_put_double(wbuffer_t buffer, unsigned int field, double value)
+{
+    const uint64_t bits = double_to_bits(value);
+    char tmp[9];
+    size_t i;
+
+    tmp[0] = (char)PB_TAG(field, PB_FIXED64);
+    for (i = 0; i < 8; i++) {
+        tmp[1 + i] = (char)((bits >> (8 * i)) & 0xff);
+    }
+    return wbuffer_write(buffer, tmp, sizeof(tmp));
+}
+
+/* start a length-delimited field (field 0: the top-level delimiter, no
+ * tag). One byte is left for the length, *mark* is its offset. */
+static int pb_begin(wbuffer_t buffer, unsigned int field, size_t *mark)
+{
+    int res = 0;
+
+    if (0 != field) {
+        res |= pb_put_varint(buffer, PB_TAG(field, PB_BYTES));
+    }
+    *mark = wbuffer_get_length(buffer);
+    res |= wbuffer_write(buffer, "", 1);
+    return res;
+}
+
+/* write the length of the field started at *mark*. Short fields fit the
+ * byte left by pb_begin; longer ones are moved to make room. */
+static int pb_end(wbuffer_t buffer, size_t mark)
+{
+    const size_t len = wbuffer_get_length(buffer) - mark - 1;
+    const size_t size = pb_varint_size(len);
+    char *ptr = NULL;
+
+    if (size > 1) {
+        RET_ON_FALSE(NULL != wbuffer_reserve(buffer, size - 1),
+                     PMC_ERROR_ALLOCATION, -1);
+        ptr = (char*)wbuffer_get_ptr(buffer);
+        memmove(ptr + mark + size, ptr + mark + 1, len);
+        wbuffer_commit(buffer, size - 1);
+    }
+
+    ptr = (char*)wbuffer_get_ptr(buffer);
+    pb_encode_varint(ptr + mark, len);
+    return 0;
+}
+
+static int pb_put_string(wbuffer_t buffer, unsigned int field, const char *str)
+{
+    const size_t len = strlen(str);
+    int res = 0;
+
+    res |= pb_put_varint(buffer, PB_TAG(field, PB_BYTES));
+    res |= pb_put_varint(buffer, len);
+    res |= wbuffer_write(buffer, str, len);
+    return res;
+}
+
+/* the LabelPairs of a Metric */
+static int pb_output_labels(wbuffer_t buffer, const struct pmc_key *key)
+{
+    size_t mark;
+    size_t i;
+    int res = 0;
+
+    for (i = 0; NULL != key->labels && i < key->labels->count; i++) {
+        res |= pb_begin(buffer, 1, &mark);
+        res |= pb_put_string(buffer, 1, key->labels->names[i]);
+        res |= pb_put_string(buffer, 2, key->labels->values[i]);
+        res |= pb_end(buffer, mark);
+    }
+    return res;
+}
+
+static uint64_t pb_type(pmc_type_e type)
+{
+    switch (type) {
+        case PM_COUNTER:
+            return PB_TYPE_COUNTER;
+        case PM_HISTOGRAM:        /* fallthrough */
+        case PM_NATIVE_HISTOGRAM:
+            return PB_TYPE_HISTOGRAM;
+        case PM_SUMMARY:
+            return PB_TYPE_SUMMARY;
+        case PM_GAUGE:      /* fallthrough */
+        case PM_TYPE_COUNT: /* fallthrough */
+        case PM_NONE:       /* fallthrough */
+            break;
+    }
+    return PB_TYPE_GAUGE;
+}
+
+/* a Metric, labels included. *field* is the Metric field of the value:
+ * gauge or counter */
+static int pb_output_value(wbuffer_t buffer,
+                           const struct pmc_key *key,
+                           unsigned int field,
+                           double value)
+{
+    size_t metric;
+    size_t mark;
+    int res = 0;
+
+    res |= pb_begin(buffer, 4, &metric);
+    res |= pb_output_labels(buffer, key);
+    res |= pb_begin(buffer, field, &mark);
+    res |= pb_put_double(buffer, 1, value);
+    res |= pb_end(buffer, mark);
+    res |= pb_end(buffer, metric);
+    return res;
+}
+
+static int pb_output_histogram(wbuffer_t buffer,
+                               const struct pmc_item_histogram *it)
+{
+    size_t metric;
+    size_t histogram;
+    size_t bucket;
+    const uint64_t live = pmc_window_live(it);
+    uint64_t count = 0;
+    size_t i;
+    int res = 0;
+
+    res |= pb_begin(buffer, 4, &metric);
+    res |= pb_output_labels(buffer, &it->list.key);
+    res |= pb_begin(buffer, 7, &histogram);
+
+    for (i = 0; i < it->size; i++) {
+        count += pmc_histogram_get_bucket(it, i, live);
+
+        res |= pb_begin(buffer, 3, &bucket);
+        res |= pb_put_uint(buffer, 1, count);
+        res |= pb_put_double(buffer, 2, (double)(float)it->buckets[i]);
+        res |= pb_end(buffer, bucket);
+    }
+    count += pmc_histogram_get_bucket(it, it->size, live);
+
+    res |= pb_put_uint(buffer, 1, count);
+    res |= pb_put_double(buffer, 2, pmc_histogram_get_sum(it, live));
+    res |= pb_end(buffer, histogram);
+    res |= pb_end(buffer, metric);
+    return res;
+}
+
+static int pb_output_summary(wbuffer_t buffer, struct pmc_item_summary *it)
+{
+    size_t metric;
+    size_t summary;
+    size_t quantile;
+    uint64_t count;
+    double sum;
+    size_t i;
+    int res = 0;
+
+    pmc_summary_query(it, &count, &sum);
+
+    res |= pb_begin(buffer, 4, &metric);
+    res |= pb_output_labels(buffer, &it->list.key);
+    res |= pb_begin(buffer, 4, &summary);
+    res |= pb_put_uint(buffer, 1, count);
+    res |= pb_put_double(buffer, 2, sum);
+    for (i = 0; i < it->size; i++) {
+        res |= pb_begin(buffer, 3, &quantile);
+        res |= pb_put_double(buffer, 1, it->quantiles[i]);
+        res |= pb_put_double(buffer, 2, it->estimates[i]);
+        res |= pb_end(buffer, quantile);
+    }
+    res |= pb_end(buffer, summary);
+    res |= pb_end(buffer, metric);
+    return res;
+}
+
+/* sint32 and sint64 fields */
+static uint64_t pb_zigzag(int64_t value)
+{
+    return value < 0 ? ~((uint64_t)value << 1) : (uint64_t)value << 1;
+}
+
+/* the BucketSpans (field *field*) and the packed deltas (*field* + 1) of
+ * one side of a native histogram. Spans are runs of consecutive buckets:
+ * up to PMC_NATIVE_GAP_MAX empty buckets are sent, as deltas, rather than
+ * starting a new span, as the Go client does. The first delta is a count,
+ * the others are the difference with the previous bucket. */
+static int pb_output_native_side(wbuffer_t buffer,
+                                 unsigned int field,
+                                 const struct pmc_native_bucket *buckets,
+                                 size_t count)
+{
+    size_t mark;
+    size_t first;
+    size_t i;
+    int64_t gap;
+    int64_t offset;
+    uint64_t previous = 0;
+    int res = 0;
+
+    if (0 == count) {
+        return 0;
+    }
+
+    for (i = 0; i < count; i = first) {
+        offset = 0 == i ? (int64_t)buckets[0].key
+                        : (int64_t)buckets[i].key - buckets[i - 1].key - 1;
+        for (first = i + 1; first < count; first++) {
+            gap = (int64_t)buckets[first].key - buckets[first - 1].key - 1;
+            if (gap > PMC_NATIVE_GAP_MAX) {
+                break;
+            }
+        }
+
+        res |= pb_begin(buffer, field, &mark);
+        res |= pb_put_uint(buffer, 1, pb_zigzag(offset));
+        res |= pb_put_uint(buffer, 2, (uint64_t)(buckets[first - 1].key
+                                                 - buckets[i].key + 1));
+        res |= pb_end(buffer, mark);
+    }
+
+    res |= pb_begin(buffer, field + 1, &mark);
+    for (i = 0; i < count; i++) {
+        gap = 0 == i ? 0 : (int64_t)buckets[i].key - buckets[i - 1].key - 1;
+        for (; gap > 0 && gap <= PMC_NATIVE_GAP_MAX; gap--) {
+            res |= pb_put_varint(buffer, pb_zigzag(-(int64_t)previous));
+            previous = 0;
+        }
+        res |= pb_put_varint(buffer, pb_zigzag((int64_t)(buckets[i].count
+                                                         - previous)));
+        previous = buckets[i].count;
+    }
+    res |= pb_end(buffer, mark);
+    return res;
+}
+
+/* native fields only: no classic buckets. The zero threshold is always
+ * set, which tells native histograms from classic ones. */
+static int pb_output_native(wbuffer_t buffer, struct pmc_item_native *it)
+{
+    struct pmc_native_snapshot snap;
+    size_t metric;
+    size_t histogram;
+    int res = 0;
+
+    RET_ON_FALSE(0 == pmc_native_query(it, &snap), PMC_ERROR_ALLOCATION, -1);
+
+    res |= pb_begin(buffer, 4, &metric);
+    res |= pb_output_labels(buffer, &it->list.key);
+    res |= pb_begin(buffer, 7, &histogram);
+    res |= pb_put_uint(buffer, 1, snap.count);
+    res |= pb_put_double(buffer, 2, snap.sum);
+    res |= pb_put_uint(buffer, 5, pb_zigzag(snap.schema));
+    res |= pb_put_double(buffer, 6, PMC_NATIVE_ZERO_THRESHOLD);
+    res |= pb_put_uint(buffer, 7, snap.zero_count);
+    res |= pb_output_native_side(buffer, 9, snap.negative,
+                                 snap.negative_count);
+    res |= pb_output_native_side(buffer, 12, snap.positive,
+                                 snap.positive_count);
+    res |= pb_end(buffer, histogram);
+    res |= pb_end(buffer, metric);
+    return res;
+}
+
+static int pb_output_series(wbuffer_t buffer, const struct pmc_key *key)
+{
+    const struct pmc_gauge_key *gauge = NULL;
+
+    switch (key->type) {
+        case PM_GAUGE:
+            gauge = (const struct pmc_gauge_key*)key;
+            return pb_output_value(
+                buffer, key, 2,
+                atomic_load_double(&gauge->value->value));
+        case PM_COUNTER:
+            return pb_output_value(
+                buffer, key, 3,
+                pmc_counter_value((const struct pmc_item_counter*)key));
+        case PM_HISTOGRAM:
+            return pb_output_histogram(
+                buffer, (const struct pmc_item_histogram*)key);
+        case PM_SUMMARY:
+            /* estimates are computed in the item */
+            return pb_output_summary(buffer, (struct pmc_item_summary*)key);
+        case PM_NATIVE_HISTOGRAM:
+            return pb_output_native(buffer, (struct pmc_item_native*)key);
+        case PM_TYPE_COUNT: /* fallthrough */
+        case PM_NONE:       /* fallthrough */
+            assert(0); /* implementation safeguard */
+            break;
+    }
+    return -1;
+}
+
+/* one MetricFamily per family, one Metric per series */
+static int pmc_serialize_protobuf(wbuffer_t buffer, pmc_metric_s metric)
+{
+    const struct pmc_family *family = NULL;
+    const struct pmc_key *key = NULL;
+    size_t marks[2];
+    int res = 0;
+
+    for (family = metric->families; 0 == res && NULL != family;
+         family = family->next) {
+        if (NULL == family->first) {
+            continue;
+        }
+
+        res |= pb_begin(buffer, 0, &marks[0]);
+        res |= pb_begin(buffer, 1, &marks[1]);
+        res |= pmc_put_name(buffer, metric->jobname, family->key.name);
+        res |= wbuffer_puts(buffer, pmc_name_suffix(&family->key));
+        res |= pb_end(buffer, marks[1]);
+        if (NULL != family->help) {
+            res |= pb_put_string(buffer, 2, family->help);
+        }
+        res |= pb_put_uint(buffer, 3, pb_type(family->key.type));
+
+        for (key = family->first; NULL != key; key = key->sibling) {
+            res |= pb_output_series(buffer, key);
+        }
+        res |= pb_end(buffer, marks[0]);
+    }
+
+    RET_ON_FALSE(0 == res, PMC_ERROR_OUTPUT, -1);
+    return 0;
+}
+
+static int pmc_serialize(wbuffer_t buffer,
+                         pmc_metric_s metric,
+                         enum pmc_format format)
+{
+    if (PMC_FORMAT_PROTOBUF == format) {
+        return pmc_serialize_protobuf(buffer, metric);
+    }
+    return pmc_serialize_text(buffer, metric);
+}
+
+void pmc_set_format(pmc_metric_s metric, enum pmc_format format)
+{
+    CHECK_KILLSWITCH();
+
+    assert(NULL != metric);
+    metric->format = format;
+}
+
+void pmc_set_compression(pmc_metric_s metric, size_t threshold)
+{
+    CHECK_KILLSWITCH();
+
+    assert(NULL != metric);
+    metric->gzip_threshold = threshold;
+}
+
+/* gzip the body of *packet* in the set's second buffer. When that does not
+ * make it smaller, *packet* is left untouched.
+ *
+ * RETURN VALUE:
+ *  -1 -> allocation failed. The error is already reported.
+ *   0 -> success
+ */
+static int pmc_compress(pmc_metric_s metric, struct pmc_packet *packet)
+{
+    const size_t body_len = packet->length - packet->reserved;
+
+    if (NULL == metric->deflate) {
+        metric->deflate = pmc_deflate_create();
+        RET_ON_FALSE(NULL != metric->deflate, PMC_ERROR_ALLOCATION, -1);
+    }
+    if (NULL == metric->gzip_buffer) {
+        metric->gzip_buffer = wbuffer_create();
+        RET_ON_FALSE(NULL != metric->gzip_buffer, PMC_ERROR_ALLOCATION, -1);
+    }
+
+    wbuffer_reset(metric->gzip_buffer);
+    RET_ON_FALSE(NULL != wbuffer_reserve(metric->gzip_buffer, packet->reserved),
+                 PMC_ERROR_ALLOCATION, -1);
+    wbuffer_commit(metric->gzip_buffer, packet->reserved);
+
+    RET_ON_FALSE(0 == pmc_gzip(metric->deflate, metric->gzip_buffer,
+                               packet->ptr + packet->reserved, body_len),
+                 PMC_ERROR_ALLOCATION, -1);
+
+    if (wbuffer_get_length(metric->gzip_buffer) - packet->reserved
+        >= body_len) {
+        return 0;
+    }
+
+    packet->content_encoding = CONTENT_ENCODING_GZIP;
+    packet->ptr = (char*)wbuffer_get_ptr(metric->gzip_buffer);
+    packet->length = wbuffer_get_length(metric->gzip_buffer);
+    return 0;
+}
+
+/* serialize *metric* in its own buffer: [header space][body], and gzip the
+ * body when it is over the threshold. Buffers are reused from one call to
+ * the next.
+ *
+ * RETURN VALUE:
+ *  -1 -> serialization failed. The error is already reported.
+ *   0 -> *packet* is ready to send.
+ */
+static int pmc_prepare(pmc_metric_s metric, struct pmc_packet *packet)
+{
+    int res;
+
+    if (NULL == metric->buffer) {
+        metric->buffer = wbuffer_create();
+        RET_ON_FALSE(NULL != metric->buffer, PMC_ERROR_ALLOCATION, -1);
+    }
+
+    packet->content_type = pmc_content_type(metric->format);
+    packet->content_encoding = "";
+
+    wbuffer_reset(metric->buffer);
+    packet->reserved = http_header_reserve(metric->jobname,
+                                           packet->content_type);
+    RET_ON_FALSE(NULL != wbuffer_reserve(metric->buffer, packet->reserved),
+                 PMC_ERROR_ALLOCATION, -1);
+    wbuffer_commit(metric->buffer, packet->reserved);
+
+    res = pmc_serialize(metric->buffer, metric, metric->format);
+    RET_ON_FALSE(0 == res, PMC_ERROR_OUTPUT, -1);
+
+    packet->ptr = (char*)wbuffer_get_ptr(metric->buffer);
+    packet->length = wbuffer_get_length(metric->buffer);
+
+    if (0 == metric->gzip_threshold
+        || packet->length - packet->reserved < metric->gzip_threshold) {
+        return 0;
+    }
+
+    return pmc_compress(metric, packet);
+}
+
+int pmc_send(pmc_metric_s metric)
+{
+    struct pmc_packet packet;
+
+    CHECK_KILLSWITCH(0);
+
+    if (0 != pmc_prepare(metric, &packet)) {
+        return -1;
+    }
+
+    return send_http_packet(metric->jobname, &packet);
+}
+
+/* ASYNC MODE:
+ * pmc_send_async serializes the metric set, copies the result in a
+ * snapshot, and hands it to a sender thread, which does the network I/O.
+ * Snapshots go through a bounded multi-producer/multi-consumer queue
+ * (Dmitry Vyukov's design): each cell carries a sequence number telling
+ * whether it is free for the producer of a given position, or ready for
+ * the consumer of that position. Positions are claimed with a CAS, no
+ * lock is ever taken. A semaphore only wakes the sender thread up.
+ */
+
+struct pmc_snapshot {
+    char *jobname;             /* points inside the same allocation */
+    struct pmc_packet packet;  /* its buffer too */
+};
+
+struct pmc_async_cell {
+    size_t sequence;
+    struct pmc_snapshot *snapshot;
+};
+
+struct pmc_async {
+    struct pmc_async_cell *cells;
+    size_t mask;
+    enum pmc_async_policy policy;
+    int stop;
+    char padding0[PMC_CACHE_LINE - sizeof(void*) - sizeof(size_t)
+                  - sizeof(enum pmc_async_policy) - sizeof(int)];
+    size_t enqueue_pos; /* producers and consumer on their own lines */
+    char padding1[PMC_CACHE_LINE - sizeof(size_t)];
+    size_t dequeue_pos;
+    char padding2[PMC_CACHE_LINE - sizeof(size_t)];
+    sem_t ready;
+    pthread_t thread;
+};
+
+static struct pmc_async *pmc_async = NULL;
+static size_t pmc_async_drop_count = 0; /* kept after pmc_async_stop */
+
+static int pmc_async_enqueue(struct pmc_async *q, struct pmc_snapshot *snapshot)
+{
+    struct pmc_async_cell *cell = NULL;
+    size_t pos = ATOMIC_LOAD(&q->enqueue_pos);
+    size_t seq;
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            if (ATOMIC_CAS(&q->enqueue_pos, &pos, pos + 1)) {
+                break;
+            }
+        } else if (seq < pos) {
+            return -1; /* full */
+        } else {
+            pos = ATOMIC_LOAD(&q->enqueue_pos);
+        }
+    }
+
+    cell->snapshot = snapshot;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static struct pmc_snapshot* pmc_async_dequeue(struct pmc_async *q)
+{
+    struct pmc_async_cell *cell = NULL;
+    struct pmc_snapshot *snapshot = NULL;
+    size_t pos = ATOMIC_LOAD(&q->dequeue_pos);
+    size_t seq;
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+        if (seq == pos + 1) {
+            if (ATOMIC_CAS(&q->dequeue_pos, &pos, pos + 1)) {
+                break;
+            }
+        } else if (seq < pos + 1) {
+            return NULL; /* empty */
+        } else {
+            pos = ATOMIC_LOAD(&q->dequeue_pos);
+        }
+    }
+
+    snapshot = cell->snapshot;
+    __atomic_store_n(&cell->sequence, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return snapshot;
+}
+
+static void* pmc_async_main(void *arg)
+{
+    struct pmc_async *q = (struct pmc_async*)arg;
+    struct pmc_snapshot *snapshot = NULL;
+
+    for (;;) {
+        while (0 != sem_wait(&q->ready)) {
+            /* EINTR */
+        }
+
+        /* an entry can be missing: DROP_OLDEST producers dequeue too */
+        snapshot = pmc_async_dequeue(q);
+        if (NULL != snapshot) {
+            send_http_packet(snapshot->jobname, &snapshot->packet);
+            free(snapshot);
+            continue;
+        }
+
+        /* queue empty: leave only once everything is sent */
+        if (__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE)) {
             break;
         }
+    }
+
+    return NULL;
+}
 
-        res = 0;
-    } while (0);
+int pmc_async_start(size_t queue_size, enum pmc_async_policy policy)
+{
+    struct pmc_async *q = NULL;
+    size_t capacity = 2; /* with 1 cell, "full" and "empty" look alike */
+    size_t i;
 
-    if (0 != res) {
-        pmc_handle_error(PMC_ERROR_OUTPUT);
+    CHECK_KILLSWITCH(0);
+
+    assert(NULL == pmc_async);
+
+    while (capacity < queue_size) {
+        capacity *= 2;
     }
 
-    wbuffer_destroy(buffer);
-    return res;
+    q = (struct pmc_async*)pmc_aligned_alloc(PMC_CACHE_LINE, sizeof(*q));
+    RET_ON_FALSE(NULL != q, PMC_ERROR_ALLOCATION, -1);
+
+    q->cells = ZERO_ALLOC(struct pmc_async_cell, capacity);
+    if (NULL == q->cells || 0 != sem_init(&q->ready, 0, 0)) {
+        free(q->cells);
+        free(q);
+        pmc_handle_error(PMC_ERROR_ALLOCATION);
+        return -1;
+    }
+
+    for (i = 0; i < capacity; i++) {
+        q->cells[i].sequence = i;
+    }
+    q->mask = capacity - 1;
+    q->policy = policy;
+    ATOMIC_STORE(&pmc_async_drop_count, 0);
+
+    if (0 != pthread_create(&q->thread, NULL, pmc_async_main, q)) {
+        sem_destroy(&q->ready);
+        free(q->cells);
+        free(q);
+        pmc_handle_error(PMC_ERROR_ALLOCATION);
+        return -1;
+    }
+
+    pmc_async = q;
+    return 0;
 }
 
-static int pmc_output_gauge(wbuffer_t buffer, const char *jobname, struct pmc_item_gauge *it)
+int pmc_send_async(pmc_metric_s metric)
 {
-    int res;
+    struct pmc_snapshot *snapshot = NULL;
+    struct pmc_snapshot *oldest = NULL;
+    struct pmc_packet packet;
+    size_t jobname_len;
+    char *ptr = NULL;
 
-    res = wbuffer_printf(buffer, "# TYPE %s_%s gauge\n", jobname, it->name);
-    RET_ON_FALSE(res >= 0, PMC_ERROR_OUTPUT, -1);
+    CHECK_KILLSWITCH(0);
 
-    res = wbuffer_printf(buffer, "%s_%s %f\n", jobname, it->name,
-                         (double)it->value);
-    RET_ON_FALSE(res >= 0, PMC_ERROR_OUTPUT, -1);
+    RET_ON_FALSE(NULL != pmc_async, PMC_ERROR_OUTPUT, -1);
+
+    if (0 != pmc_prepare(metric, &packet)) {
+        return -1;
+    }
+
+    /* one allocation: the snapshot, the jobname, then the packet */
+    jobname_len = strlen(metric->jobname) + 1;
+    ptr = ALLOC(char, sizeof(*snapshot) + jobname_len + packet.length);
+    RET_ON_FALSE(NULL != ptr, PMC_ERROR_ALLOCATION, -1);
 
+    snapshot = (struct pmc_snapshot*)ptr;
+    snapshot->jobname = ptr + sizeof(*snapshot);
+    snapshot->packet = packet;
+    snapshot->packet.ptr = snapshot->jobname + jobname_len;
+    memcpy(snapshot->jobname, metric->jobname, jobname_len);
+    memcpy(snapshot->packet.ptr + packet.reserved,
+           packet.ptr + packet.reserved, packet.length - packet.reserved);
+
+    while (0 != pmc_async_enqueue(pmc_async, snapshot)) {
+        if (PMC_ASYNC_DROP_NEWEST == pmc_async->policy) {
+            __atomic_add_fetch(&pmc_async_drop_count, 1, __ATOMIC_RELAXED);
+            free(snapshot);
+            return 1;
+        }
+
+        /* make room by dropping the oldest pending snapshot. Its wake-up
+         * is left in the semaphore, the sender copes with it. The sender
+         * may have emptied the queue meanwhile: then nothing is dropped. */
+        oldest = pmc_async_dequeue(pmc_async);
+        if (NULL != oldest) {
+            __atomic_add_fetch(&pmc_async_drop_count, 1, __ATOMIC_RELAXED);
+            free(oldest);
+        }
+    }
+
+    sem_post(&pmc_async->ready);
     return 0;
 }
 
-static int pmc_output_histogram(wbuffer_t buffer, const char *jobname, struct pmc_item_histogram *it)
+size_t pmc_async_dropped(void)
 {
-    int res;
-    float sum = 0.f;
-    float count = 0.f;
+    return ATOMIC_LOAD(&pmc_async_drop_count);
+}
+
+void pmc_async_stop(void)
+{
+    struct pmc_async *q = pmc_async;
+
+    if (NULL == q) {
+        return;
+    }
+
+    __atomic_store_n(&q->stop, 1, __ATOMIC_RELEASE);
+    sem_post(&q->ready);
+    pthread_join(q->thread, NULL);
+
+    sem_destroy(&q->ready);
+    free(q->cells);
+    free(q);
+    pmc_async = NULL;
+}
+
+/* PULL MODE:
+ * pmc_serve runs a small HTTP server in the calling thread. Registered
+ * metric sets are serialized on each scrape of /metrics, directly in the
+ * response buffer of the connection: nothing is rendered when nobody asks.
+ * One epoll loop, non-blocking sockets, keep-alive connections.
+ */
+
+struct pmc_registry {
+    pmc_metric_s *sets;
+    size_t count;
+    size_t capacity;
+    pthread_mutex_t lock;
+};
+
+static struct pmc_registry pmc_registry = {
+    NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER
+};
+
+int pmc_register(pmc_metric_s metric)
+{
+    pmc_metric_s *sets = NULL;
+    size_t capacity;
     size_t i;
 
-    res = wbuffer_printf(buffer, "# TYPE %s_%s histogram\n", jobname, it->name);
-    RET_ON_FALSE(res >= 0, PMC_ERROR_OUTPUT, -1);
+    CHECK_KILLSWITCH(0);
 
-    for (i = 0; i < it->size; i++) {
-        count += it->values[i];
-        res = wbuffer_printf(buffer, "%s_%s_bucket{le=\"%f\"} %f\n",
-                             jobname, it->name, (double)it->buckets[i],
-                             (double)count);
-        RET_ON_FALSE(res >= 0, PMC_ERROR_OUTPUT, -1);
+    pthread_mutex_lock(&pmc_registry.lock);
 
-        sum += it->values[i] * it->buckets[i];
+    for (i = 0; i < pmc_registry.count; i++) {
+        if (pmc_registry.sets[i] == metric) {
+            pthread_mutex_unlock(&pmc_registry.lock);
+            return 0;
+        }
     }
 
-    res = wbuffer_printf(buffer, "%s_%s_count %f\n", jobname, it->name,
-                         (double)count);
-    RET_ON_FALSE(res >= 0, PMC_ERROR_OUTPUT, -1);
+    if (pmc_registry.count == pmc_registry.capacity) {
+        capacity = 0 == pmc_registry.capacity ? 4 : pmc_registry.capacity * 2;
+        sets = (pmc_metric_s*)realloc(pmc_registry.sets,
+                                      sizeof(*sets) * capacity);
+        if (NULL == sets) {
+            pthread_mutex_unlock(&pmc_registry.lock);
+            pmc_handle_error(PMC_ERROR_ALLOCATION);
+            return -1;
+        }
+        pmc_registry.sets = sets;
+        pmc_registry.capacity = capacity;
+    }
 
-    res = wbuffer_printf(buffer, "%s_%s_sum %f\n", jobname, it->name,
-                         (double)sum);
-    RET_ON_FALSE(res >= 0, PMC_ERROR_OUTPUT, -1);
+    pmc_registry.sets[pmc_registry.count++] = metric;
+    pthread_mutex_unlock(&pmc_registry.lock);
     return 0;
 }
 
-int pmc_send(pmc_metric_s metric)
+void pmc_unregister(pmc_metric_s metric)
+{
+    size_t i;
+
+    pthread_mutex_lock(&pmc_registry.lock);
+
+    for (i = 0; i < pmc_registry.count; i++) {
+        if (pmc_registry.sets[i] == metric) {
+            /* keep the scrape order stable */
+            memmove(pmc_registry.sets + i, pmc_registry.sets + i + 1,
+                    sizeof(pmc_metric_s) * (pmc_registry.count - i - 1));
+            pmc_registry.count--;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&pmc_registry.lock);
+}
+
+/* the wake-up pipe is created by the first pmc_serve, and never closed:
+ * pmc_serve_stop can always write to it safely. */
+static int pmc_serve_stopping = 0;
+static int pmc_serve_wake[2] = { -1, -1 };
+
+void pmc_serve_stop(void)
+{
+    const char byte = 0;
+    int fd;
+
+    /* async-signal-safe: an atomic store and a write */
+    __atomic_store_n(&pmc_serve_stopping, 1, __ATOMIC_RELEASE);
+    fd = __atomic_load_n(&pmc_serve_wake[1], __ATOMIC_ACQUIRE);
+    if (fd >= 0) {
+        if (write(fd, &byte, 1) < 0) {
+            /* the pipe is full: pmc_serve is already waking up */
+        }
+    }
+}
+
+#if defined(__linux__)
+
+#define PMC_SERVE_MAX_EVENTS 32
+#define PMC_SERVE_REQUEST_MAX 4096
+#define PMC_SERVE_HEADER_MAX 256
+
+#define PMC_SERVE_FMT "HTTP/1.1 %s\r\n"                                 \
+                      "Content-Type: %s\r\n"                            \
+                      "Content-Length: " SIZE_T_FMT "\r\n"              \
+                      "%s\r\n"
+
+#define PMC_SERVE_CONTENT_TYPE_TEXT "text/plain; version=0.0.4"
+
+struct pmc_conn {
+    struct pmc_conn *prev;
+    struct pmc_conn *next;
+    int fd;
+    uint32_t events;    /* the epoll interest set */
+    int keep_alive;
+    int sending;        /* a response is being written */
+    size_t consumed;    /* request bytes answered by this response */
+    size_t sent;        /* response bytes already written */
+    wbuffer_t response; /* [header space][body], reused */
+    size_t request_len;
+    char request[PMC_SERVE_REQUEST_MAX];
+};
+
+/* addresses used as epoll tags for the non-connection descriptors */
+static char pmc_serve_listen_tag;
+static char pmc_serve_wake_tag;
+
+/* serialize every registered set after the header space. */
+static int pmc_serve_serialize(wbuffer_t buffer, enum pmc_format format)
+{
+    size_t i;
+    int res = 0;
+
+    pthread_mutex_lock(&pmc_registry.lock);
+    for (i = 0; 0 == res && i < pmc_registry.count; i++) {
+        res = pmc_serialize(buffer, pmc_registry.sets[i], format);
+    }
+    pthread_mutex_unlock(&pmc_registry.lock);
+
+    return res;
+}
+
+/* build the response to the request ending at *end*. */
+static int pmc_conn_respond(struct pmc_conn *c, const char *end)
+{
+    char header[PMC_SERVE_HEADER_MAX];
+    const char *status = "200 OK";
+    const char *eol = strstr(c->request, "\r\n");
+    const char *path = c->request + 4;
+    const char *field = NULL;
+    const char *accept_end = NULL;
+    enum pmc_format format = PMC_FORMAT_TEXT;
+    size_t path_len;
+    size_t body_len;
+    int len;
+
+    c->consumed = (size_t)(end - c->request) + 4;
+
+    /* HTTP/1.1 keeps the connection, unless asked otherwise */
+    field = strcasestr(c->request, "\r\nConnection: close");
+    c->keep_alive = eol - c->request >= 8
+                    && 0 == strncmp(eol - 8, "HTTP/1.1", 8)
+                    && (NULL == field || field >= end);
+
+    /* the scraper asks for protobuf first when it supports it */
+    field = strcasestr(c->request, "\r\nAccept:");
+    if (NULL != field && field < end) {
+        accept_end = strstr(field + 2, "\r\n");
+        field = strstr(field, "application/vnd.google.protobuf");
+        if (NULL != field && field < accept_end) {
+            format = PMC_FORMAT_PROTOBUF;
+        }
+    }
+
+    wbuffer_reset(c->response);
+    RET_ON_FALSE(NULL != wbuffer_reserve(c->response, PMC_SERVE_HEADER_MAX),
+                 PMC_ERROR_ALLOCATION, -1);
+    wbuffer_commit(c->response, PMC_SERVE_HEADER_MAX);
+
+    path_len = strcspn(path, " ?\r");
+    if (0 != strncmp(c->request, "GET ", 4)) {
+        status = "405 Method Not Allowed";
+    } else if (8 != path_len || 0 != strncmp(path, "/metrics", 8)) {
+        status = "404 Not Found";
+    } else if (0 != pmc_serve_serialize(c->response, format)) {
+        status = "500 Internal Server Error";
+        wbuffer_reset(c->response);
+        wbuffer_commit(c->response, PMC_SERVE_HEADER_MAX);
+    }
+
+    /* the header goes right in front of the body */
+    body_len = wbuffer_get_length(c->response) - PMC_SERVE_HEADER_MAX;
+    len = snprintf(header, sizeof(header), PMC_SERVE_FMT, status,
+                   PMC_FORMAT_PROTOBUF == format ? CONTENT_TYPE_PROTOBUF
+                                                 : PMC_SERVE_CONTENT_TYPE_TEXT,
+                   body_len, c->keep_alive ? "" : "Connection: close\r\n");
+    assert(len > 0 && len < PMC_SERVE_HEADER_MAX);
+
+    c->sent = PMC_SERVE_HEADER_MAX - (size_t)len;
+    memcpy((char*)wbuffer_get_ptr(c->response) + c->sent, header, (size_t)len);
+    c->sending = 1;
+    return 0;
+}
+
+/* RETURN VALUE:
+ *  -1 -> the connection must be closed.
+ *   0 -> the response is sent.
+ *   1 -> the socket is full, wait for EPOLLOUT.
+ */
+static int pmc_conn_flush(struct pmc_conn *c)
+{
+    const char *ptr = (const char*)wbuffer_get_ptr(c->response);
+    const size_t length = wbuffer_get_length(c->response);
+    ssize_t res;
+
+    while (c->sent < length) {
+        res = send(c->fd, ptr + c->sent, length - c->sent, MSG_NOSIGNAL);
+        if (res < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return EAGAIN == errno || EWOULDBLOCK == errno ? 1 : -1;
+        }
+        c->sent += (size_t)res;
+    }
+
+    if (!c->keep_alive) {
+        return -1;
+    }
+
+    /* pipelined requests may follow */
+    c->request_len -= c->consumed;
+    memmove(c->request, c->request + c->consumed, c->request_len);
+    c->request[c->request_len] = 0;
+    c->sending = 0;
+    return 0;
+}
+
+/* answer every complete request received so far.
+ * Same return value as pmc_conn_flush, 0 meaning "wait for more input". */
+static int pmc_conn_process(struct pmc_conn *c)
 {
-    wbuffer_t buffer;
-    struct pmc_item_list *head = NULL;
-    const char ZERO = 0;
+    const char *end = NULL;
     int res;
 
+    for (;;) {
+        if (c->sending) {
+            res = pmc_conn_flush(c);
+            if (0 != res) {
+                return res;
+            }
+            continue;
+        }
+
+        end = strstr(c->request, "\r\n\r\n");
+        if (NULL == end) {
+            return 0;
+        }
+        if (0 != pmc_conn_respond(c, end)) {
+            return -1;
+        }
+    }
+}
+
+/* RETURN VALUE:
+ *  -1 -> the connection must be closed.
+ *   0 -> everything available was read.
+ */
+static int pmc_conn_read(struct pmc_conn *c)
+{
+    ssize_t res;
+
+    for (;;) {
+        if (c->request_len + 1 >= sizeof(c->request)) {
+            return -1; /* headers too large */
+        }
+
+        res = recv(c->fd, c->request + c->request_len,
+                   sizeof(c->request) - c->request_len - 1, 0);
+        if (res < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+        }
+        if (0 == res) {
+            return -1;
+        }
+
+        c->request_len += (size_t)res;
+        c->request[c->request_len] = 0;
+    }
+}
+
+static void pmc_conn_close(int epfd, struct pmc_conn **list,
+                           struct pmc_conn *c)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+
+    if (NULL != c->prev) {
+        c->prev->next = c->next;
+    } else {
+        *list = c->next;
+    }
+    if (NULL != c->next) {
+        c->next->prev = c->prev;
+    }
+
+    wbuffer_destroy(c->response);
+    free(c);
+}
+
+static void pmc_serve_accept(int epfd, int listener, struct pmc_conn **list)
+{
+    struct epoll_event ev;
+    struct pmc_conn *c = NULL;
+    int fd;
+
+    for (;;) {
+        fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return; /* EAGAIN, or a connection aborted before accept */
+        }
+
+        c = ZERO_ALLOC(struct pmc_conn, 1);
+        if (NULL != c) {
+            c->response = wbuffer_create();
+        }
+        if (NULL == c || NULL == c->response) {
+            free(c);
+            close(fd);
+            pmc_handle_error(PMC_ERROR_ALLOCATION);
+            continue;
+        }
+
+        c->fd = fd;
+        c->events = EPOLLIN;
+        ev.events = c->events;
+        ev.data.ptr = c;
+        if (0 != epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            wbuffer_destroy(c->response);
+            free(c);
+            close(fd);
+            continue;
+        }
+
+        c->next = *list;
+        if (NULL != *list) {
+            (*list)->prev = c;
+        }
+        *list = c;
+    }
+}
+
+static void pmc_conn_event(int epfd, struct pmc_conn **list,
+                           struct pmc_conn *c, uint32_t events)
+{
+    struct epoll_event ev;
+    int res = 0;
+
+    if (0 != (events & EPOLLIN) && !c->sending) {
+        res = pmc_conn_read(c);
+    } else if (0 != (events & (EPOLLERR | EPOLLHUP))) {
+        res = -1;
+    }
+
+    if (0 == res) {
+        res = pmc_conn_process(c);
+    }
+    if (res < 0) {
+        pmc_conn_close(epfd, list, c);
+        return;
+    }
+
+    /* waiting either for room to write, or for the next request */
+    ev.events = 1 == res ? EPOLLOUT : EPOLLIN;
+    if (ev.events != c->events) {
+        c->events = ev.events;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+}
+
+static int pmc_serve_listen(uint16_t port)
+{
+    struct sockaddr_in addr;
+    const int one = 1;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (0 != bind(fd, (struct sockaddr*)&addr, sizeof(addr))
+        || 0 != listen(fd, SOMAXCONN)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int pmc_serve(uint16_t port)
+{
+    struct epoll_event events[PMC_SERVE_MAX_EVENTS];
+    struct epoll_event ev;
+    struct pmc_conn *list = NULL;
+    char drain[64];
+    int wake[2];
+    int listener = -1;
+    int epfd = -1;
+    int res = -1;
+    int count;
+    int i;
+
     CHECK_KILLSWITCH(0);
 
-    buffer = wbuffer_create();
-    RET_ON_FALSE(NULL != buffer, PMC_ERROR_ALLOCATION, -1);
+    __atomic_store_n(&pmc_serve_stopping, 0, __ATOMIC_RELEASE);
 
-    head = metric->head;
-    while (head != NULL) {
-        switch (head->type) {
-            case PM_GAUGE:
-                res = pmc_output_gauge(buffer, metric->jobname,
-                                       (struct pmc_item_gauge*)head);
-                RET_ON_FALSE(0 >= res, PMC_ERROR_OUTPUT, -1);
-                break;
-            case PM_HISTOGRAM:
-                res = pmc_output_histogram(buffer, metric->jobname,
-                                           (struct pmc_item_histogram*)head);
-                RET_ON_FALSE(0 >= res, PMC_ERROR_OUTPUT, -1);
-                break;
-            case PM_TYPE_COUNT: /* fallthrough */
-            case PM_NONE:       /* fallthrough */
-                assert(0); /* implementation safeguard */
-                break;
+    if (pmc_serve_wake[0] < 0) {
+        if (0 != pipe2(wake, O_NONBLOCK | O_CLOEXEC)) {
+            goto out;
         }
-        head = head->next;
+        pmc_serve_wake[0] = wake[0];
+        __atomic_store_n(&pmc_serve_wake[1], wake[1], __ATOMIC_RELEASE);
+    }
+    while (read(pmc_serve_wake[0], drain, sizeof(drain)) > 0) {
+        /* stale wake-ups from a previous run */
+    }
+
+    listener = pmc_serve_listen(port);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (listener < 0 || epfd < 0) {
+        goto out;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &pmc_serve_listen_tag;
+    if (0 != epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev)) {
+        goto out;
+    }
+    ev.data.ptr = &pmc_serve_wake_tag;
+    if (0 != epoll_ctl(epfd, EPOLL_CTL_ADD, pmc_serve_wake[0], &ev)) {
+        goto out;
     }
 
-    res = wbuffer_write(buffer, &ZERO, 1);
-    RET_ON_FALSE(0 >= res, PMC_ERROR_OUTPUT, -1);
-    res = send_http_packet(metric->jobname, wbuffer_get_ptr(buffer));
-    RET_ON_FALSE(0 >= res, PMC_ERROR_OUTPUT, -1);
+    while (!__atomic_load_n(&pmc_serve_stopping, __ATOMIC_ACQUIRE)) {
+        count = epoll_wait(epfd, events, PMC_SERVE_MAX_EVENTS, -1);
+        if (count < 0 && EINTR != errno) {
+            goto out;
+        }
+
+        for (i = 0; i < count; i++) {
+            if (&pmc_serve_listen_tag == events[i].data.ptr) {
+                pmc_serve_accept(epfd, listener, &list);
+            } else if (&pmc_serve_wake_tag == events[i].data.ptr) {
+                while (read(pmc_serve_wake[0], drain, sizeof(drain)) > 0) {
+                    /* the flag tells why we were woken up */
+                }
+            } else {
+                pmc_conn_event(epfd, &list,
+                               (struct pmc_conn*)events[i].data.ptr,
+                               events[i].events);
+            }
+        }
+    }
+    res = 0;
 
-    res = wbuffer_destroy(buffer);
-    RET_ON_FALSE(0 >= res, PMC_ERROR_ALLOCATION, -1);
+out:
+    while (NULL != list) {
+        pmc_conn_close(epfd, &list, list);
+    }
+    if (epfd >= 0) {
+        close(epfd);
+    }
+    if (listener >= 0) {
+        close(listener);
+    }
 
+    RET_ON_FALSE(0 == res, PMC_ERROR_OUTPUT, -1);
     return 0;
 }
 
+#else /* !__linux__ */
+
+int pmc_serve(uint16_t port)
+{
+    (void)port;
+    CHECK_KILLSWITCH(0);
+
+    /* epoll only for now */
+    pmc_handle_error(PMC_ERROR_OUTPUT);
+    return -1;
+}
+
+#endif /* __linux__ */
+
 void pmc_destroy(pmc_metric_s metric)
 {
-    struct pmc_item_list *head = NULL;
-    struct pmc_item_list *next = NULL;
-    struct pmc_item_gauge *g = NULL;
-    struct pmc_item_histogram *h = NULL;
+    struct pmc_item_summary *summary = NULL;
+    struct pmc_item_native *native = NULL;
 
     CHECK_KILLSWITCH();
 
@@ -569,45 +6204,49 @@ void pmc_destroy(pmc_metric_s metric)
         return;
     }
 
-    head = metric->head;
-    while (head != NULL) {
-        next = head->next;
+    pmc_unregister(metric);
 
-        switch (head->type) {
-        case PM_GAUGE:
-            g = (struct pmc_item_gauge*)head;
-            free(g->name);
-            free(g);
-            break;
-        case PM_HISTOGRAM:
-            h = (struct pmc_item_histogram*)head;
-            free(h->name);
-            free(h->buckets);
-            free(h->values);
-            free(h);
-            break;
-        case PM_TYPE_COUNT: /* fallthrough */
-        case PM_NONE:       /* fallthrough */
-            assert(0); /* implementation safeguard */
-            break;
-        }
+    for (summary = metric->summaries; NULL != summary;
+         summary = summary->next_summary) {
+        pmc_summary_release(summary);
+    }
+    for (native = metric->natives; NULL != native;
+         native = native->next_native) {
+        pmc_native_release(native);
+    }
 
-        head = next;
+    free(metric->index.slots);
+    free(metric->family_index.slots);
+    free(metric->sample_index.slots);
+    free(metric->strings.slots);
+    if (NULL != metric->buffer) {
+        wbuffer_destroy(metric->buffer);
+    }
+    if (NULL != metric->gzip_buffer) {
+        wbuffer_destroy(metric->gzip_buffer);
+    }
+    if (NULL != metric->deflate) {
+        pmc_deflate_destroy(metric->deflate);
     }
 
-    free(metric->jobname);
-    free(metric);
+    /* items, names and the set itself go with the arena */
+    pmc_arena_release(&metric->arena);
 }
 
 
-int pmc_send_gauge(const char* job_name, const char* name, float value)
+/* helpers build their one-metric set on the stack. Large histograms
+ * overflow to the heap. */
+#define PMC_HELPER_MEMORY 1024
+
+int pmc_send_gauge(const char* job_name, const char* name, double value)
 {
+    char memory[PMC_HELPER_MEMORY];
     int res;
     pmc_metric_s m = NULL;
 
     CHECK_KILLSWITCH(0);
 
-    m = pmc_initialize(job_name);
+    m = pmc_initialize_with_memory(job_name, memory, sizeof(memory));
     RET_ON_FALSE(NULL != m, PMC_ERROR_ALLOCATION, -1);
 
     res = pmc_add_gauge(m, name, value);
@@ -626,12 +6265,13 @@ int pmc_send_histogram(const char* jobname,
                        const float *buckets,
                        const float *values)
 {
+    char memory[PMC_HELPER_MEMORY];
     int res;
     pmc_metric_s m = NULL;
 
     CHECK_KILLSWITCH(0);
 
-    m = pmc_initialize(jobname);
+    m = pmc_initialize_with_memory(jobname, memory, sizeof(memory));
     RET_ON_FALSE(NULL != m, PMC_ERROR_ALLOCATION, -1);
 
     res = pmc_add_histogram(m, name, size, buckets, values);
@@ -2,6 +2,7 @@
 #define H_PROMETHEUS_CLIENT_
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #if defined(__cplusplus)
@@ -19,9 +20,23 @@ enum pmc_error {
  * this is the only function you need to implement.
  * I will use this function to send the HTTP request.
  * It can be a write to a socket, or a serial output, or anything.
+ * It need not be reentrant: calls never overlap, even in async mode (see
+ * ASYNC MODE), where pmc_send and the sender thread take turns.
  */
 int pmc_output_data(const void *bytes, size_t size);
 
+/*
+ * OPTIONAL scatter-gather variant of pmc_output_data. If a sink defines
+ * it, it is used instead of pmc_output_data: the HTTP header and the body
+ * are passed as separate iovecs, and are never copied together.
+ * A sink can forward them to writev/sendmsg.
+ * All *count* iovecs, in order, make one HTTP request.
+ * Same return value as pmc_output_data.
+ *
+ * This symbol is weak: sinks not implementing it still link.
+ */
+int pmc_output_datav(const struct iovec *iov, int count);
+
 /* error handling function to implement.
  * This function can let the user handle pmc related errors.
  * This function CAN return. You can either abort() or just log/disable
@@ -33,6 +48,11 @@ int pmc_output_data(const void *bytes, size_t size);
 void pmc_handle_error(enum pmc_error err);
 
 typedef struct pmc_metric* pmc_metric_s;
+typedef struct pmc_item_gauge* pmc_gauge_h;
+typedef struct pmc_item_histogram* pmc_histogram_h;
+typedef struct pmc_item_counter* pmc_counter_h;
+typedef struct pmc_item_summary* pmc_summary_h;
+typedef struct pmc_item_native* pmc_native_histogram_h;
 
 /* there is two methods to use this client:
  *  - using helper functions
@@ -50,44 +70,114 @@ typedef struct pmc_metric* pmc_metric_s;
  *
  * Calling the kill-switch function will disable the following functions:
  * - pmc_initialize      -> will always return NULL.
+ * - pmc_initialize_with_memory -> will always return NULL.
  * - pmc_destroy         -> will free every metrics passed.
  *
  * - pmc_send            -> will do nothing, accepts NULL
  * - pmc_add_gauge       -> will do nothing, accepts NULL
+ * - pmc_add_gauge_labels -> will do nothing, accepts NULL
  * - pmc_add_histogram   -> will do nothing, accepts NULL
  * - pmc_update_hisogram -> will do nothing, accepts NULL
+ * - pmc_create_gauge    -> will always return NULL.
+ * - pmc_create_histogram -> will always return NULL.
+ * - pmc_get_gauge       -> will always return NULL.
+ * - pmc_get_histogram   -> will always return NULL.
+ * - pmc_create_*_labels -> will always return NULL.
+ * - pmc_get_*_labels    -> will always return NULL.
+ * - pmc_gauge_set       -> will do nothing, accepts NULL
+ * - pmc_gauge_add       -> will do nothing, accepts NULL
+ * - pmc_create_gauges   -> will always return NULL.
+ * - pmc_gauge_set_many  -> will do nothing, accepts NULL
+ * - pmc_add_counter     -> will do nothing, accepts NULL
+ * - pmc_create_counter  -> will always return NULL.
+ * - pmc_get_counter     -> will always return NULL.
+ * - pmc_counter_inc     -> will do nothing, accepts NULL
+ * - pmc_counter_add     -> will do nothing, accepts NULL
+ * - pmc_histogram_update -> will do nothing, accepts NULL
+ * - pmc_histogram_set_counts -> will do nothing, accepts NULL
+ * - pmc_histogram_observe -> will do nothing, accepts NULL
+ * - pmc_histogram_observe_n -> will do nothing, accepts NULL
+ * - pmc_create_sharded_histogram -> will always return NULL.
+ * - pmc_create_summary  -> will always return NULL.
+ * - pmc_create_windowed_histogram -> will always return NULL.
+ * - pmc_create_windowed_summary -> will always return NULL.
+ * - pmc_get_summary     -> will always return NULL.
+ * - pmc_summary_observe -> will do nothing, accepts NULL
+ * - pmc_create_native_histogram -> will always return NULL.
+ * - pmc_get_native_histogram -> will always return NULL.
+ * - pmc_native_histogram_observe -> will do nothing, accepts NULL
+ * - pmc_async_start     -> will do nothing, no thread is started.
+ * - pmc_send_async      -> will do nothing, accepts NULL
+ * - pmc_set_format      -> will do nothing, accepts NULL
+ * - pmc_set_help        -> will do nothing, accepts NULL
+ * - pmc_set_compression -> will do nothing, accepts NULL
+ * - pmc_register        -> will do nothing, accepts NULL
+ * - pmc_serve           -> will return immediately.
  * - pmc_send_gauge      -> will do nothing, accepts NULL
  * - pmc_send_histogram  -> will do nothing, accepts NULL
  */
 void pmc_disable(void);
 
 
+/* THREADS:
+ * building a metric set (pmc_initialize, pmc_add_*, pmc_create_*, pmc_get_*,
+ * pmc_destroy) is NOT thread-safe. Do it from one thread, or serialize it.
+ * Once created, gauges, counters, sharded histograms and summaries can be
+ * updated through their handles from any number of threads without
+ * locking, while another thread calls pmc_send. Updates are atomic:
+ * pmc_send sees each value either before or after a concurrent update,
+ * never a torn value.
+ * A given set must not be serialized by two threads at once (pmc_send,
+ * pmc_send_async, or a scrape of a registered set): each set keeps its
+ * last serialization around, to only render what changed since.
+ */
+
 /* BEGIN MANUAL API */
 
 /* initialize a metric set. Usually the first call */
 pmc_metric_s pmc_initialize(const char *jobname);
 
 /*
- * add a gauge to the metric set. Already existing gauge are not
- * checked. Thus adding two time the same gauge WILL generate two
- * metrics with the same name, both showing in the final HTTP request.
+ * same as pmc_initialize, but the metric set (items, names, values...) is
+ * first built in *memory*. When it is full, the set falls back to the
+ * heap. *memory* must stay valid until pmc_destroy, and is not freed by it.
+ *
+ * PARAMETERS:
+ *  jobname: the name of the job.
+ *  memory: backing memory for the set. Can be NULL.
+ *  size: size of *memory* in bytes.
+ */
+pmc_metric_s pmc_initialize_with_memory(const char *jobname,
+                                        void *memory,
+                                        size_t size);
+
+/*
+ * add a gauge to the metric set. A series exists only once: adding a
+ * gauge with the name (and labels) of an existing one fails with
+ * PMC_ERROR_INVALID_KEY, and returns -1. See FAMILIES.
  *
  *  m: the metric set. Created using **pmc_initialize**
  *  name: the name of the metric. Valid characters: [A-Za-z0-9_] (not checked)
  *  value: the value of the metric.
  */
-int pmc_add_gauge(pmc_metric_s m, const char* name, float value);
+int pmc_add_gauge(pmc_metric_s m, const char* name, double value);
 
 /*
- * add an histogram to the metric set. Already existing histograms are not
- * checked. Thus adding two time the same histogram WILL generate two
- * histograms with the same name. Both will show in the final HTTP request.
+ * add an histogram to the metric set. Same rules as **pmc_add_gauge**
+ * regarding duplicated names: adding an existing histogram fails with
+ * PMC_ERROR_INVALID_KEY.
  *
  *  m: the metric set. Created using **pmc_initialize**
  *  name: the name of the metric. Valid characters: [A-Za-z0-9_] (not checked)
  *  size: the number of buckets. Also the size of the two following arrays.
  *  buckets: array of floats. Each entry represents 1 bucket.
  *  values: the number of values in each bucket. (Not the sum of the previous)
+ *          NULL means all buckets start empty. Counts are stored as 64-bit
+ *          integers: values are rounded to the nearest one, negative
+ *          values count as 0.
+ * Counts given in bulk (here, or with the update functions below) carry no
+ * values: _sum is then estimated as each count times its bucket bound, and
+ * observations add their exact value to it.
  */
 int pmc_add_histogram(pmc_metric_s m,
                       const char *name,
@@ -97,7 +187,8 @@ int pmc_add_histogram(pmc_metric_s m,
 
 /*
  * update a previously created histogram. WILL FAIL if no histogram with
- * the name *name* can be found.
+ * the name *name* can be found. Lookup is a hash table access, it does
+ * not depend on the number of metrics in the set.
  * The histogram size will not be changed. The parameter **size** MUST be
  * smaller or equal to the size given when creating the histogram.
  * If **size** is smaller than the previously given size, only the first
@@ -113,6 +204,434 @@ int pmc_update_histogram(pmc_metric_s m,
                          size_t size,
                          const float *values);
 
+/* HANDLES:
+ * pmc_create_* functions behave like their pmc_add_* counterpart, but
+ * return a handle on the created metric instead of a status. Handles are
+ * stable pointers on the metric: updating through them needs no lookup.
+ * They remain valid until the metric set is destroyed.
+ * On failure, NULL is returned (and pmc_handle_error is called).
+ */
+pmc_gauge_h pmc_create_gauge(pmc_metric_s m, const char* name, double value);
+
+/*
+ * create *count* gauges at once. Their values are stored contiguously:
+ * the returned handle is the first gauge, see **pmc_gauge_at** for the
+ * others.
+ *
+ *  m: the metric set. Created using **pmc_initialize**
+ *  names: *count* names.
+ *  count: the number of gauges. Must not be 0.
+ *  values: *count* initial values. NULL means 0 for all.
+ */
+pmc_gauge_h pmc_create_gauges(pmc_metric_s m,
+                              const char * const *names,
+                              size_t count,
+                              const double *values);
+
+pmc_histogram_h pmc_create_histogram(pmc_metric_s m,
+                                     const char *name,
+                                     size_t size,
+                                     const float *buckets,
+                                     const float *values);
+
+/*
+ * create a histogram meant to be observed by many threads at once.
+ * Each thread observes into its own shard (a cache-line aligned row of
+ * counts), so concurrent pmc_histogram_observe calls do not contend.
+ * Shards are summed only when the histogram is serialized.
+ * Buckets start empty. pmc_histogram_update still sets the base values,
+ * which are added to the shards.
+ *
+ *  m: the metric set. Created using **pmc_initialize**
+ *  name: the name of the metric. Valid characters: [A-Za-z0-9_] (not checked)
+ *  size: the number of buckets.
+ *  buckets: array of floats. Each entry represents 1 bucket.
+ *  shard_count: number of shards. 0 means one per configured CPU.
+ */
+pmc_histogram_h pmc_create_sharded_histogram(pmc_metric_s m,
+                                             const char *name,
+                                             size_t size,
+                                             const float *buckets,
+                                             size_t shard_count);
+
+/*
+ * create a histogram which only counts the observations of the last
+ * *window_ms* milliseconds. The window is cut in *slot_count* slots, and
+ * moves one slot at a time: what is sent covers between
+ * (slot_count - 1) / slot_count and all of the window. More slots make it
+ * smoother, and serialization a bit longer.
+ * Observing allocates nothing: when a slot starts, the counts of the slot
+ * that left the window are cleared, in O(size). Like regular histograms,
+ * observe from one thread at a time.
+ * pmc_histogram_update still sets base values, which never expire.
+ *
+ *  m: the metric set. Created using **pmc_initialize**
+ *  name: the name of the metric. Valid characters: [A-Za-z0-9_] (not checked)
+ *  size: the number of buckets.
+ *  buckets: array of floats. Each entry represents 1 bucket.
+ *  window_ms: the length of the window, in milliseconds. Not 0.
+ *  slot_count: the number of slots, from 1 to 64.
+ */
+pmc_histogram_h pmc_create_windowed_histogram(pmc_metric_s m,
+                                              const char *name,
+                                              size_t size,
+                                              const float *buckets,
+                                              unsigned int window_ms,
+                                              size_t slot_count);
+
+/* BUCKET LAYOUTS:
+ * helpers filling bucket bounds, to pass to the pmc_create_*histogram
+ * functions. Bounds following one of these laws are recognized when the
+ * histogram is created (however they were computed): the bucket of an
+ * observation is then computed arithmetically, in constant time however
+ * many buckets there are. Other bounds are searched.
+ */
+
+/* *count* bounds: start, start + width, start + 2 * width...
+ * *width* must be positive. */
+void pmc_linear_buckets(float *buckets,
+                        size_t count,
+                        double start,
+                        double width);
+
+/* *count* bounds: start, start * factor, start * factor^2...
+ * *start* must be positive, and *factor* greater than 1. */
+void pmc_exponential_buckets(float *buckets,
+                             size_t count,
+                             double start,
+                             double factor);
+
+/*
+ * log-linear (HDR-style) bounds: each power of 2, from 2^min_exponent to
+ * 2^max_exponent, is split in 2^sub_bits equal parts. The relative width
+ * of a bucket stays under 2^-sub_bits, with far fewer buckets than a
+ * linear layout would need.
+ * Returns the number of bounds, (max_exponent - min_exponent) *
+ * 2^sub_bits + 1. With a NULL *buckets*, only the count is returned.
+ *
+ *  buckets: where to write the bounds. NULL to only get the count.
+ *  min_exponent: the first bound is 2^min_exponent. From -126.
+ *  max_exponent: the last bound is 2^max_exponent. Up to 127.
+ *  sub_bits: from 0 to 16.
+ */
+size_t pmc_log_linear_buckets(float *buckets,
+                              int min_exponent,
+                              int max_exponent,
+                              unsigned int sub_bits);
+
+/* NATIVE HISTOGRAMS:
+ * exponential buckets, without a layout to choose, as Prometheus native
+ * histograms. With schema s, bucket i holds (2^((i-1)/2^s), 2^(i/2^s)]:
+ * each power of 2 is split in 2^s buckets, of the same relative width.
+ * Negative values have their own buckets, and values within 2^-128 of 0
+ * go to a zero bucket. Only populated buckets are stored, and the bucket
+ * of a value is computed in O(1), with no search.
+ * They are sent as native histograms in the protobuf format only. The
+ * text format gets a classic histogram, one bucket per populated bucket.
+ * A name is either a classic or a native histogram, not both.
+ */
+
+/*
+ * add a native histogram to the metric set.
+ *
+ *  m: the metric set. Created using **pmc_initialize**
+ *  name: the name of the metric. Valid characters: [A-Za-z0-9_] (not checked)
+ *  schema: the resolution, from -4 to 8. 3 splits each power of 2 in 8
+ *          buckets, each about 9% wide, as the Go client defaults to.
+ *  max_buckets: 0 for no limit. Otherwise, when more buckets are
+ *               populated, the schema is decreased until they fit: the
+ *               resolution halves each time.
+ */
+pmc_native_histogram_h pmc_create_native_histogram(pmc_metric_s m,
+                                                   const char *name,
+                                                   int schema,
+                                                   size_t max_buckets);
+pmc_native_histogram_h pmc_create_native_histogram_labels(
+    pmc_metric_s m,
+    const char *name,
+    const char * const *label_keys,
+    const char * const *label_values,
+    size_t label_count,
+    int schema,
+    size_t max_buckets);
+
+/* find a previously created native histogram. Same rules as
+ * **pmc_get_histogram** */
+pmc_native_histogram_h pmc_get_native_histogram(pmc_metric_s m,
+                                                const char *name);
+pmc_native_histogram_h pmc_get_native_histogram_labels(
+    pmc_metric_s m,
+    const char *name,
+    const char * const *label_keys,
+    const char * const *label_values,
+    size_t label_count);
+
+/*
+ * record one observation. NaN is counted in _count and _sum, in no
+ * bucket. Thread-safe: the histogram has a lock. Observing allocates only
+ * when a bucket is populated for the first time.
+ *
+ *  h: a native histogram handle.
+ *  value: the observed value.
+ */
+void pmc_native_histogram_observe(pmc_native_histogram_h h, double value);
+
+/* SUMMARIES:
+ * a summary reports quantiles of the observed values (latencies...),
+ * without any bucket layout. Quantiles are estimated by a streaming sketch
+ * (CKMS), whose memory only grows with the log of the observation count.
+ * Observations are buffered, and merged in the sketch every few hundred:
+ * an observation is O(1), amortized.
+ */
+
+/*
+ * add a summary to the metric set.
+ *
+ *  m: the metric set. Created using **pmc_initialize**
+ *  name: the name of the metric. Valid characters: [A-Za-z0-9_] (not checked)
+ *  size: the number of quantiles. Must not be 0.
+ *  quantiles: the quantiles to report, in [0, 1]. (0.5, 0.9, 0.99...)
+ *  error: the target rank error, in (0, 1). With 0.001, the value reported
+ *         for 0.99 is the one of a quantile close to [0.989, 0.991]. As in
+ *         the Go client, the bound is approximate. Lower errors keep more
+ *         samples.
+ */
+pmc_summary_h pmc_create_summary(pmc_metric_s m,
+                                 const char *name,
+                                 size_t size,
+                                 const double *quantiles,
+                                 double error);
+pmc_summary_h pmc_create_summary_labels(pmc_metric_s m,
+                                        const char *name,
+                                        const char * const *label_keys,
+                                        const char * const *label_values,
+                                        size_t label_count,
+                                        size_t size,
+                                        const double *quantiles,
+                                        double error);
+
+/*
+ * create a summary whose quantiles only cover the last *window_ms*
+ * milliseconds, give or take a slot, as **pmc_create_windowed_histogram**.
+ * One sketch is kept per slot, and each observation goes into all of
+ * them: keep *slot_count* small (the Go client uses 5). _count and _sum
+ * cover all the observations.
+ *
+ *  window_ms: the length of the window, in milliseconds. Not 0.
+ *  slot_count: the number of slots, from 1 to 64.
+ */
+pmc_summary_h pmc_create_windowed_summary(pmc_metric_s m,
+                                          const char *name,
+                                          size_t size,
+                                          const double *quantiles,
+                                          double error,
+                                          unsigned int window_ms,
+                                          size_t slot_count);
+
+/* find a previously created summary. Same rules as **pmc_get_histogram** */
+pmc_summary_h pmc_get_summary(pmc_metric_s m, const char *name);
+pmc_summary_h pmc_get_summary_labels(pmc_metric_s m,
+                                     const char *name,
+                                     const char * const *label_keys,
+                                     const char * const *label_values,
+                                     size_t label_count);
+
+/*
+ * record one observation. NaN is ignored. Thread-safe: the sketch has a
+ * lock, held for a buffer append, and for the merge when the buffer is
+ * full.
+ *
+ *  h: a summary handle.
+ *  value: the observed value.
+ */
+void pmc_summary_observe(pmc_summary_h h, double value);
+
+/*
+ * find a previously created gauge, and return a handle on it.
+ * Same rules as **pmc_get_histogram**.
+ */
+pmc_gauge_h pmc_get_gauge(pmc_metric_s m, const char *name);
+
+/* LABELS:
+ * the *_labels variants create or find a series with labels. A series is
+ * identified by its name and its whole label set: "requests" with
+ * {method="GET"} and with {method="POST"} are two series, each with its
+ * own handle. Labels can be given in any order.
+ * Label names and values are copied once per metric set, however many
+ * series use them. Values are escaped as the text format requires.
+ *
+ *  label_keys: *label_count* label names. Valid characters: [A-Za-z0-9_]
+ *              (not checked). A name must not appear twice.
+ *  label_values: *label_count* label values. Any string.
+ *  label_count: can be 0, then the series has no labels.
+ */
+int pmc_add_gauge_labels(pmc_metric_s m,
+                         const char *name,
+                         const char * const *label_keys,
+                         const char * const *label_values,
+                         size_t label_count,
+                         double value);
+pmc_gauge_h pmc_create_gauge_labels(pmc_metric_s m,
+                                    const char *name,
+                                    const char * const *label_keys,
+                                    const char * const *label_values,
+                                    size_t label_count,
+                                    double value);
+pmc_gauge_h pmc_get_gauge_labels(pmc_metric_s m,
+                                 const char *name,
+                                 const char * const *label_keys,
+                                 const char * const *label_values,
+                                 size_t label_count);
+
+pmc_counter_h pmc_create_counter_labels(pmc_metric_s m,
+                                        const char *name,
+                                        const char * const *label_keys,
+                                        const char * const *label_values,
+                                        size_t label_count);
+pmc_counter_h pmc_get_counter_labels(pmc_metric_s m,
+                                     const char *name,
+                                     const char * const *label_keys,
+                                     const char * const *label_values,
+                                     size_t label_count);
+
+pmc_histogram_h pmc_create_histogram_labels(pmc_metric_s m,
+                                            const char *name,
+                                            const char * const *label_keys,
+                                            const char * const *label_values,
+                                            size_t label_count,
+                                            size_t size,
+                                            const float *buckets,
+                                            const float *values);
+pmc_histogram_h pmc_get_histogram_labels(pmc_metric_s m,
+                                         const char *name,
+                                         const char * const *label_keys,
+                                         const char * const *label_values,
+                                         size_t label_count);
+
+/* set the value of a gauge. Thread-safe. */
+void pmc_gauge_set(pmc_gauge_h h, double value);
+
+/* add *delta* to the value of a gauge. *delta* can be negative.
+ * Thread-safe: concurrent additions are never lost. */
+void pmc_gauge_add(pmc_gauge_h h, double delta);
+
+/* handle of the *i*-th gauge created with *first* by pmc_create_gauges */
+pmc_gauge_h pmc_gauge_at(pmc_gauge_h first, size_t i);
+
+/* set *count* gauges created together by pmc_create_gauges, starting at
+ * *first* (which can be any of them). Thread-safe, as pmc_gauge_set on
+ * each gauge in turn, but NOT atomic as a whole: a concurrent pmc_send
+ * can see part of the new values. */
+void pmc_gauge_set_many(pmc_gauge_h first, size_t count, const double *values);
+
+/*
+ * add a counter to the metric set. A counter starts at 0 and only goes up.
+ * Same rules as **pmc_add_gauge** regarding duplicated names.
+ * Samples are named "<name>_total", unless *name* already ends in "_total".
+ * Each counter has one cell per CPU: increments from different CPUs do not
+ * contend, and pmc_send reports the sum.
+ *
+ *  m: the metric set. Created using **pmc_initialize**
+ *  name: the name of the metric. Valid characters: [A-Za-z0-9_] (not checked)
+ */
+int pmc_add_counter(pmc_metric_s m, const char* name);
+pmc_counter_h pmc_create_counter(pmc_metric_s m, const char* name);
+pmc_counter_h pmc_get_counter(pmc_metric_s m, const char *name);
+
+/* increment a counter by one. Thread-safe. */
+void pmc_counter_inc(pmc_counter_h h);
+
+/* add *delta* to a counter. Negative and NaN deltas are ignored.
+ * Thread-safe. */
+void pmc_counter_add(pmc_counter_h h, double delta);
+
+/*
+ * find a previously created histogram, and return a handle on it.
+ * The handle remains valid until the metric set is destroyed.
+ * Returns NULL if no histogram with the name *name* can be found.
+ *
+ *  m: the metric set. Created using **pmc_initialize**
+ *  name: the name of the metric.
+ */
+pmc_histogram_h pmc_get_histogram(pmc_metric_s m, const char *name);
+
+/*
+ * same as **pmc_update_histogram**, but without any lookup. Use this on
+ * hot paths.
+ *
+ *  h: a histogram handle. Returned by **pmc_get_histogram**
+ *  size: the number of buckets. MUST be smaller or equal to the size given
+ *        when creating the histogram.
+ *  values: the number of values in each bucket. (Not the sum of the previous)
+ *          Rounded like in **pmc_add_histogram**.
+ */
+int pmc_histogram_update(pmc_histogram_h h, size_t size, const float *values);
+
+/*
+ * same as **pmc_histogram_update**, with exact counts. Floats only count
+ * exactly up to 2^24: past that, use this one.
+ *
+ *  h: a histogram handle.
+ *  size: the number of buckets. MUST be smaller or equal to the size given
+ *        when creating the histogram.
+ *  counts: the number of values in each bucket. (Not the sum of the previous)
+ */
+int pmc_histogram_set_counts(pmc_histogram_h h,
+                             size_t size,
+                             const uint64_t *counts);
+
+/*
+ * record one observation: the first bucket whose bound is greater or equal
+ * to *value* is incremented. Bucket bounds MUST be sorted in increasing
+ * order. Values above the last bound (and NaN) are only counted in the +Inf
+ * bucket. The bucket search is branchless, and vectorized (SSE2/AVX) for
+ * small bucket counts. It is O(1) for the bucket layouts above.
+ * *value* itself is added to _sum.
+ * Thread-safe for sharded histograms only.
+ *
+ *  h: a histogram handle.
+ *  value: the observed value.
+ */
+void pmc_histogram_observe(pmc_histogram_h h, double value);
+
+/*
+ * record *count* observations at once. Same result as calling
+ * **pmc_histogram_observe** on each value, but histograms with few buckets
+ * bin several values per vector compare.
+ *
+ *  h: a histogram handle.
+ *  values: the observed values.
+ *  count: the number of values.
+ */
+void pmc_histogram_observe_n(pmc_histogram_h h,
+                             const double *values,
+                             size_t count);
+
+/* FAMILIES:
+ * series with the same name and type form a family, whatever their labels.
+ * A family is serialized in one piece, under a single # HELP / # TYPE
+ * header. Families come out in the order they were created, and series in
+ * a family too.
+ * A name belongs to a single family: creating a series of another type
+ * under the name of an existing family fails with PMC_ERROR_INVALID_KEY
+ * (NULL handle, or -1). So does a name any family writes samples under:
+ * "<name>_total" for a counter, "<name>_bucket", "<name>_count" and
+ * "<name>_sum" for a histogram, "<name>_count" and "<name>_sum" for a
+ * summary. So does a series that already exists, with the same name and
+ * labels: use pmc_get_* to find it again.
+ */
+
+/*
+ * set the help text of the family *name*, shown in its # HELP line.
+ * Newlines and backslashes are escaped as the text format requires.
+ * Returns -1 if no series with the name *name* exists yet.
+ *
+ *  m: the metric set. Created using **pmc_initialize**
+ *  name: the name of the family, without the jobname prefix.
+ *  help: the help text. Copied.
+ */
+int pmc_set_help(pmc_metric_s m, const char *name, const char *help);
+
 /*
  * send the HTTP request to the push gateway. The metric set is not invalidated
  * or modified when sent. Thus it can be updated then resent without additional
@@ -122,8 +641,127 @@ int pmc_update_histogram(pmc_metric_s m,
  */
 int pmc_send(pmc_metric_s metric);
 
+/* FORMATS:
+ * TEXT is the text exposition format, the default.
+ * PROTOBUF is the delimited protobuf format (one length-prefixed
+ * io.prometheus.client.MetricFamily message per metric). Smaller and
+ * cheaper to produce for large histograms. No protobuf library is needed.
+ */
+enum pmc_format {
+    PMC_FORMAT_TEXT,
+    PMC_FORMAT_PROTOBUF
+};
+
+/* choose the format used by pmc_send and pmc_send_async for *metric*.
+ * pmc_serve picks the format from the Accept header of each scrape. */
+void pmc_set_format(pmc_metric_s metric, enum pmc_format format);
+
+/* gzip the bodies pushed by pmc_send and pmc_send_async for *metric*, when
+ * they are *threshold* bytes or more. Smaller pushes are sent as they are,
+ * so are bodies gzip would not make smaller. 0 disables it, the default.
+ * Built with PMC_HAVE_ZLIB, zlib is used. Otherwise a built-in deflate is.
+ */
+void pmc_set_compression(pmc_metric_s metric, size_t threshold);
+
+/* ASYNC MODE:
+ * pmc_send blocks on the sink, thus on the network. In async mode, a
+ * background thread does the output: pmc_send_async only serializes the
+ * metric set, copies the packet and queues it. It never waits on the sink.
+ *
+ * The queue is bounded. When the sink is slower than the pushes, the
+ * policy decides which push is lost.
+ *
+ * pmc_send can still be called while the thread runs: sink calls are
+ * serialized, so it waits for the push in progress, if any.
+ */
+enum pmc_async_policy {
+    PMC_ASYNC_DROP_NEWEST, /* the push being queued is dropped */
+    PMC_ASYNC_DROP_OLDEST  /* the oldest queued push is dropped */
+};
+
+/*
+ * start the background sender thread. Only one can run at a time.
+ *
+ * PARAMETERS:
+ *  queue_size: maximum number of pending pushes (rounded up to a power
+ *              of 2, at least 2).
+ *  policy: what to drop when the queue is full.
+ *
+ * RETURN VALUE:
+ *  -1 -> the thread or the queue could not be created.
+ *   0 -> the thread is running.
+ */
+int pmc_async_start(size_t queue_size, enum pmc_async_policy policy);
+
+/*
+ * queue the current state of *metric* for the sender thread.
+ * The metric set can be modified or destroyed right after the call.
+ * Calls on the same metric set must not run concurrently (the
+ * serialization buffer is shared), calls on different sets can.
+ *
+ * RETURN VALUE:
+ *  -1 -> serialization failed, or async mode is not started.
+ *   0 -> queued.
+ *   1 -> the queue was full, and this push was dropped (DROP_NEWEST).
+ */
+int pmc_send_async(pmc_metric_s metric);
+
+/* number of pushes dropped because the queue was full, since the last
+ * pmc_async_start. Still valid after pmc_async_stop. */
+size_t pmc_async_dropped(void);
+
+/*
+ * send every queued push, then stop the sender thread.
+ * pmc_send_async must not be called during or after this call, unless
+ * pmc_async_start is called again.
+ */
+void pmc_async_stop(void);
+
+/* PULL MODE:
+ * instead of pushing to a gateway, the process can be scraped directly by
+ * Prometheus. Metric sets are registered once, then pmc_serve answers
+ * "GET /metrics" with all registered sets, serialized on each scrape.
+ * The server is single-threaded, and runs in the thread calling pmc_serve.
+ * Linux only (epoll).
+ *
+ * As for pmc_send, metrics can be updated through their handles while a
+ * scrape is answered. Items must not be added to a registered set while
+ * pmc_serve runs.
+ */
+
+/*
+ * expose *metric* on the next scrapes. Registering twice is a no-op.
+ * The metric names are prefixed by the jobname, as for pmc_send.
+ *
+ * RETURN VALUE:
+ *  -1 -> allocation failure.
+ *   0 -> the set is registered.
+ */
+int pmc_register(pmc_metric_s metric);
+
+/* stop exposing *metric*. pmc_destroy does it too. */
+void pmc_unregister(pmc_metric_s metric);
+
+/*
+ * serve registered metric sets on *port*, all interfaces, until
+ * pmc_serve_stop is called.
+ *
+ * RETURN VALUE:
+ *  -1 -> the server could not start, or epoll failed.
+ *   0 -> stopped by pmc_serve_stop.
+ */
+int pmc_serve(uint16_t port);
+
+/*
+ * make the running pmc_serve return. Can be called from any thread, or
+ * from a signal handler.
+ */
+void pmc_serve_stop(void);
+
 /*
- * free a previously initialized metric set
+ * free a previously initialized metric set. Everything is released at
+ * once, whatever the number of items, but summaries and native
+ * histograms: their memory is freed one series at a time.
  * metric : the metric to send, previously created with pmc_initialize
  */
 void pmc_destroy(pmc_metric_s metric);
@@ -139,7 +777,7 @@ void pmc_destroy(pmc_metric_s metric);
  *
  * **jobname** and **name** characters must be [A-Za-z0-9_] (non checked)
  */
-int pmc_send_gauge(const char* job_name, const char* name, float value);
+int pmc_send_gauge(const char* job_name, const char* name, double value);
 
 /*
  * Sends an HTTP request containing only one histogram.
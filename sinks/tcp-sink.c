@@ -3,60 +3,305 @@
 #endif
 
 #include <assert.h>
+#include <errno.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "prometheus-client.h"
 
-int pmc_output_data(const void *bytes, size_t size)
+/* This sink keeps one HTTP/1.1 connection to the push gateway open across
+ * pushes. The address is resolved once. When the connection breaks, it is
+ * re-established on the next push, but not before a backoff delay, which
+ * doubles on each failed attempt (up to BACKOFF_MAX_MS). While waiting,
+ * pushes fail immediately instead of blocking on connect.
+ */
+
+#define HOSTNAME "127.0.0.1"
+#define PORT "9091"
+#define BACKOFF_MIN_MS 100
+#define BACKOFF_MAX_MS 30000
+#define IO_TIMEOUT_S 5
+
+struct tcp_sink {
+    struct addrinfo *info;   /* resolved once, never freed */
+    int sock;                /* -1 when not connected */
+    unsigned int backoff_ms; /* 0 after a successful connect */
+    struct timespec retry_at;
+};
+
+static struct tcp_sink sink = { NULL, -1, 0, { 0, 0 } };
+
+static void now(struct timespec *ts)
 {
-    const char *HOSTNAME = "127.0.0.1";
-    const char *PORT = "9091";
-    struct addrinfo hints, *info;
-    int sock, res;
-    char rbuffer[1024];
-
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    getaddrinfo(HOSTNAME, PORT, &hints, &info);
-
-    sock = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
-    if (sock < 0) {
-        return -1;
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static int is_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec
+           || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void disconnect(void)
+{
+    if (sink.sock >= 0) {
+        close(sink.sock);
+        sink.sock = -1;
     }
+}
 
-    res = connect(sock, info->ai_addr, info->ai_addrlen);
-    if (res < 0) {
-        return -1;
+static void schedule_retry(void)
+{
+    sink.backoff_ms = sink.backoff_ms == 0 ? BACKOFF_MIN_MS
+                                           : sink.backoff_ms * 2;
+    if (sink.backoff_ms > BACKOFF_MAX_MS) {
+        sink.backoff_ms = BACKOFF_MAX_MS;
     }
 
-    freeaddrinfo(info);
+    now(&sink.retry_at);
+    sink.retry_at.tv_sec += sink.backoff_ms / 1000;
+    sink.retry_at.tv_nsec += (long)(sink.backoff_ms % 1000) * 1000000;
+    if (sink.retry_at.tv_nsec >= 1000000000) {
+        sink.retry_at.tv_sec += 1;
+        sink.retry_at.tv_nsec -= 1000000000;
+    }
+}
 
-    res = send(sock, bytes, size, 0);
-    if (res < 0) {
-        return -1;
+/* RETURN VALUE:
+ *  -1 -> no connection. Either still backing off, or connect failed.
+ *   0 -> sink.sock is connected.
+ */
+static int ensure_connected(void)
+{
+    const struct timeval timeout = { IO_TIMEOUT_S, 0 };
+    struct addrinfo hints;
+    struct addrinfo *it;
+    struct timespec ts;
+
+    if (sink.sock >= 0) {
+        return 0;
     }
 
-    res = recv(sock, rbuffer, sizeof(rbuffer), 0);
-    if (res < 0) {
+    now(&ts);
+    if (sink.backoff_ms != 0 && is_before(&ts, &sink.retry_at)) {
         return -1;
     }
 
-    close(sock);
+    if (NULL == sink.info) {
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (0 != getaddrinfo(HOSTNAME, PORT, &hints, &sink.info)) {
+            sink.info = NULL;
+            schedule_retry();
+            return -1;
+        }
+    }
 
-    if (strncmp(rbuffer, "HTTP/1.0 202", 12) != 0) {
-        fprintf(stderr, "pushgate answer:\n%s\n", rbuffer);
-        pmc_disable();
-        return -1;
+    for (it = sink.info; NULL != it; it = it->ai_next) {
+        sink.sock = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (sink.sock < 0) {
+            continue;
+        }
+
+        setsockopt(sink.sock, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout));
+        setsockopt(sink.sock, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                   sizeof(timeout));
+
+        if (0 == connect(sink.sock, it->ai_addr, it->ai_addrlen)) {
+            sink.backoff_ms = 0;
+            return 0;
+        }
+
+        disconnect();
+    }
+
+    schedule_retry();
+    return -1;
+}
+
+/* send every iovec, whatever the number of partial writes it takes.
+ * *iov* is copied: the caller's array is left untouched. */
+static int send_all(const struct iovec *iov, int count)
+{
+    struct iovec stack[16];
+    struct iovec *local = stack;
+    struct msghdr msg;
+    ssize_t res = 0;
+    size_t done;
+    int first = 0;
+
+    if (count > (int)(sizeof(stack) / sizeof(stack[0]))) {
+        local = (struct iovec*)malloc(sizeof(*iov) * (size_t)count);
+        if (NULL == local) {
+            return -1;
+        }
+    }
+    memcpy(local, iov, sizeof(*iov) * (size_t)count);
+
+    while (first < count) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = local + first;
+        msg.msg_iovlen = (size_t)(count - first);
+
+        res = sendmsg(sink.sock, &msg, MSG_NOSIGNAL);
+        if (res < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            break;
+        }
+
+        /* skip what was fully sent, then trim the partial iovec */
+        done = (size_t)res;
+        while (first < count && done >= local[first].iov_len) {
+            done -= local[first].iov_len;
+            first++;
+        }
+        if (first < count) {
+            local[first].iov_base = (char*)local[first].iov_base + done;
+            local[first].iov_len -= done;
+        }
+    }
+
+    if (local != stack) {
+        free(local);
+    }
+    return res < 0 ? -1 : 0;
+}
+
+/* read one HTTP response, body included, so the connection can be reused.
+ * The body is delimited by Content-Length only: without it (chunked or
+ * read-until-close bodies), the body is not read and *keep_alive* is
+ * cleared, so the connection is dropped.
+ * RETURN VALUE:
+ *  -1 -> connection error. The connection must be dropped.
+ *   0 -> the push was accepted.
+ *   1 -> the push gateway answered with an error status.
+ */
+static int read_response(int *keep_alive)
+{
+    char rbuffer[2048];
+    char scratch[1024];
+    size_t usage = 0;
+    size_t header_len;
+    size_t body_read;
+    size_t content_length = 0;
+    int has_length = 0;
+    const char *end = NULL;
+    const char *field = NULL;
+    ssize_t res;
+
+    /* headers first */
+    while (NULL == end) {
+        if (usage + 1 >= sizeof(rbuffer)) {
+            return -1;
+        }
+
+        res = recv(sink.sock, rbuffer + usage, sizeof(rbuffer) - usage - 1, 0);
+        if (res < 0 && EINTR == errno) {
+            continue;
+        }
+        if (res <= 0) {
+            return -1;
+        }
+
+        usage += (size_t)res;
+        rbuffer[usage] = 0;
+        end = strstr(rbuffer, "\r\n\r\n");
+    }
+
+    header_len = (size_t)(end - rbuffer) + 4;
+
+    field = strcasestr(rbuffer, "\r\nContent-Length:");
+    if (NULL != field && field < end) {
+        content_length = strtoul(field + 17, NULL, 10);
+        has_length = 1;
+    }
+
+    field = strcasestr(rbuffer, "\r\nConnection: close");
+    *keep_alive = has_length && (NULL == field || field > end);
+
+    /* then drain the body */
+    body_read = usage - header_len;
+    while (has_length && body_read < content_length) {
+        res = recv(sink.sock, scratch, sizeof(scratch), 0);
+        if (res < 0 && EINTR == errno) {
+            continue;
+        }
+        if (res <= 0) {
+            return -1;
+        }
+        body_read += (size_t)res;
+    }
+
+    if (0 != strncmp(rbuffer + 8, " 200", 4)
+        && 0 != strncmp(rbuffer + 8, " 202", 4)) {
+        fprintf(stderr, "pushgate answer:\n%.*s\n", (int)header_len, rbuffer);
+        return 1;
     }
 
     return 0;
 }
 
+int pmc_output_datav(const struct iovec *iov, int count)
+{
+    int attempt;
+    int reused;
+    int keep_alive = 0;
+    int res;
+
+    /* a reused connection may have been closed by the gateway while idle.
+     * In that case only, retry once on a fresh connection. */
+    for (attempt = 0; attempt < 2; attempt++) {
+        reused = sink.sock >= 0;
+        if (0 != ensure_connected()) {
+            return -1;
+        }
+
+        res = send_all(iov, count);
+        if (0 == res) {
+            res = read_response(&keep_alive);
+        }
+
+        /* an error status is not a connection failure: the client
+         * reports it, through pmc_handle_error(PMC_ERROR_OUTPUT) */
+        if (res >= 0) {
+            if (!keep_alive) {
+                disconnect();
+            }
+            return res > 0 ? -1 : 0;
+        }
+
+        disconnect();
+        if (!reused) {
+            schedule_retry();
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+/* header and body are handed to pmc_output_datav by the client. This is
+ * only here for completeness. */
+int pmc_output_data(const void *bytes, size_t size)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void*)bytes;
+    iov.iov_len = size;
+    return pmc_output_datav(&iov, 1);
+}
+
 void pmc_handle_error(enum pmc_error err)
 {
     switch (err) {
@@ -65,8 +310,15 @@ void pmc_handle_error(enum pmc_error err)
             pmc_disable();
             break;
         case PMC_ERROR_OUTPUT:
-            fprintf(stderr, "pmc: output sink failed. Disabling now.\n");
-            pmc_disable();
+            /* the sink reconnects by itself, with a backoff. Error
+             * statuses were logged by read_response, and the next push
+             * is tried all the same. */
+            fprintf(stderr, "pmc: output sink failed.\n");
+            break;
+        case PMC_ERROR_INVALID_KEY:
+            /* a naming mistake of the caller: the item was not created,
+             * everything else still works */
+            fprintf(stderr, "pmc: invalid or already used metric name.\n");
             break;
 
         case PMC_ERROR_COUNT: /* fallthrough */
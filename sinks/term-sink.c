@@ -1,3 +1,5 @@
+#include <assert.h>
+#include <stdio.h>
 #include <unistd.h>
 
 #include "prometheus-client.h"
@@ -18,6 +20,11 @@ void pmc_handle_error(enum pmc_error err)
             fprintf(stderr, "pmc: output sink failed. Disabling now.\n");
             pmc_disable();
             break;
+        case PMC_ERROR_INVALID_KEY:
+            /* a naming mistake of the caller: the item was not created,
+             * everything else still works */
+            fprintf(stderr, "pmc: invalid or already used metric name.\n");
+            break;
 
         case PMC_ERROR_COUNT: /* fallthrough */
         default:
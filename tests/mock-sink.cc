@@ -1,10 +1,12 @@
 #include <assert.h>
+#include <atomic>
 #include <regex>
 #include <sstream>
 #include <string.h>
 #include <unordered_map>
 #include <vector>
 #include <list>
+#include <map>
 
 #include "test.hh"
 #include "mock-sink.hh"
@@ -13,33 +15,58 @@
 typedef enum {
     MT_INVALID,
     MT_HISTOGRAM,
-    MT_GAUGE
+    MT_GAUGE,
+    MT_COUNTER,
+    MT_SUMMARY
 } mtype_e;
 
 struct Histogram
 {
     float count_;
-    float sum_;
+    uint64_t samples_; /* count_, exactly */
+    double sum_;
+    float inf_;
     std::vector<float> buckets_;
     std::vector<float> values_;
+    /* native histograms, protobuf only */
+    int schema_;
+    uint64_t zero_count_;
+    std::map<int, uint64_t> positive_;
+    std::map<int, uint64_t> negative_;
+};
+
+struct Summary
+{
+    uint64_t count_;
+    double sum_;
+    std::map<double, double> quantiles_;
 };
 
 static std::unordered_map<std::string, std::pair<mtype_e, float>> *metrics_store;
 static std::unordered_map<std::string, float> *gauges;
+static std::unordered_map<std::string, double> *counters;
 static std::unordered_map<std::string, Histogram> *histograms;
+static std::unordered_map<std::string, Summary> *summaries;
+static std::unordered_map<std::string, std::string> *helps;
 
 void mock_init()
 {
     metrics_store = new std::unordered_map<std::string, std::pair<mtype_e, float>>;
     gauges = new std::unordered_map<std::string, float>;
+    counters = new std::unordered_map<std::string, double>;
     histograms = new std::unordered_map<std::string, Histogram>;
+    summaries = new std::unordered_map<std::string, Summary>;
+    helps = new std::unordered_map<std::string, std::string>;
 }
 
 void mock_deinit()
 {
     delete metrics_store;
     delete gauges;
+    delete counters;
     delete histograms;
+    delete summaries;
+    delete helps;
 }
 
 float mock_gauge_get_value(std::string name)
@@ -52,6 +79,18 @@ size_t mock_gauge_get_count()
     return gauges->size();
 }
 
+double mock_counter_get_value(std::string name)
+{
+    ASSERT_TRUE(counters->count(name) == 1, "unknown counter '%s'",
+                name.c_str());
+    return (*counters)[name];
+}
+
+size_t mock_counter_get_count()
+{
+    return counters->size();
+}
+
 float mock_histogram_get_bucket(std::string name, float bucket)
 {
     ASSERT_TRUE(histograms->count(name) == 1, "unknown histogram '%s'",
@@ -76,11 +115,88 @@ size_t mock_histogram_count_buckets(std::string name)
     return h.buckets_.size();
 }
 
+float mock_histogram_get_inf(std::string name)
+{
+    ASSERT_TRUE(histograms->count(name) == 1, "unknown histogram '%s'",
+                name.c_str());
+    return (*histograms)[name].inf_;
+}
+
+uint64_t mock_histogram_get_samples(std::string name)
+{
+    ASSERT_TRUE(histograms->count(name) == 1, "unknown histogram '%s'",
+                name.c_str());
+    return (*histograms)[name].samples_;
+}
+
+double mock_histogram_get_sum(std::string name)
+{
+    ASSERT_TRUE(histograms->count(name) == 1, "unknown histogram '%s'",
+                name.c_str());
+    return (*histograms)[name].sum_;
+}
+
 size_t mock_histogram_get_count()
 {
     return histograms->size();
 }
 
+static Histogram const& native_histogram(std::string const& name)
+{
+    ASSERT_TRUE(histograms->count(name) == 1, "unknown histogram '%s'",
+                name.c_str());
+    return (*histograms)[name];
+}
+
+int mock_native_get_schema(std::string name)
+{
+    return native_histogram(name).schema_;
+}
+
+uint64_t mock_native_get_zero_count(std::string name)
+{
+    return native_histogram(name).zero_count_;
+}
+
+uint64_t mock_native_get_bucket(std::string name, bool negative, int index)
+{
+    Histogram const& h = native_histogram(name);
+    std::map<int, uint64_t> const& buckets = negative ? h.negative_
+                                                      : h.positive_;
+    auto it = buckets.find(index);
+    return it == buckets.end() ? 0 : it->second;
+}
+
+std::map<int, uint64_t> mock_native_get_buckets(std::string name,
+                                                bool negative)
+{
+    Histogram const& h = native_histogram(name);
+    return negative ? h.negative_ : h.positive_;
+}
+
+double mock_summary_get_quantile(std::string name, double quantile)
+{
+    ASSERT_TRUE(summaries->count(name) == 1, "unknown summary '%s'",
+                name.c_str());
+    Summary const& s = (*summaries)[name];
+    ASSERT_TRUE(s.quantiles_.count(quantile) == 1, "unknown quantile");
+    return s.quantiles_.at(quantile);
+}
+
+uint64_t mock_summary_get_samples(std::string name)
+{
+    ASSERT_TRUE(summaries->count(name) == 1, "unknown summary '%s'",
+                name.c_str());
+    return (*summaries)[name].count_;
+}
+
+double mock_summary_get_sum(std::string name)
+{
+    ASSERT_TRUE(summaries->count(name) == 1, "unknown summary '%s'",
+                name.c_str());
+    return (*summaries)[name].sum_;
+}
+
 static mtype_e string2mtype(std::string s)
 {
     if (s == "histogram") {
@@ -89,45 +205,73 @@ static mtype_e string2mtype(std::string s)
     if (s == "gauge") {
         return MT_GAUGE;
     }
+    if (s == "counter") {
+        return MT_COUNTER;
+    }
+    if (s == "summary") {
+        return MT_SUMMARY;
+    }
     return MT_INVALID;
 }
 
+/* series are stored as "<name>{<labels>}", labels as the client renders
+ * them. Bucket lines carry the labels before le. */
+static std::string series_name(const std::string& name,
+                               const std::string& labels)
+{
+    if (labels.empty()) {
+        return name;
+    }
+    return name + "{" + labels.substr(0, labels.size() - 1) + "}";
+}
+
 static bool parse_histogram(std::list<std::string>& body)
 {
-    std::regex re_bucket("([A-Za-z0-9_]+)_bucket\\{le=\"([0-9\\.]+)\"\\}\\s+([0-9\\.]+)");
-    std::regex re_count("([A-Za-z0-9_]+)_count +([0-9.]+)$");
-    std::regex re_sum("([A-Za-z0-9_]+)_sum +([0-9.]+)$");
+    std::regex re_bucket("([A-Za-z0-9_]+)_bucket\\{(.*,)?le=\"([-0-9.e+]+)\"\\}\\s+([0-9\\.]+)");
+    std::regex re_inf("([A-Za-z0-9_]+)_bucket\\{(.*,)?le=\"\\+Inf\"\\}\\s+([0-9\\.]+)");
+    std::regex re_count("([A-Za-z0-9_]+)_count(\\{.*\\})? +([0-9.]+)$");
+    std::regex re_sum("([A-Za-z0-9_]+)_sum(\\{.*\\})? +([-0-9.e+]+)$");
     std::smatch match;
 
     bool has_bucket = false;
+    bool has_inf = false;
     bool has_count = false;
     bool has_sum = false;
 
     Histogram histogram;
     std::string name;
 
-    while (body.size() > 0 && !(has_bucket && has_count && has_sum))
+    while (body.size() > 0 && !(has_bucket && has_inf && has_count && has_sum))
     {
         std::string line = body.front();
         body.pop_front();
 
         if (std::regex_search(line, match, re_bucket)) {
             has_bucket = true;
-            ASSERT_TRUE(4 == match.size(), "incomplete histogram bucket");
+            ASSERT_TRUE(5 == match.size(), "incomplete histogram bucket");
 
-            name = match[1];
-            histogram.buckets_.push_back(std::stof(match[2]));
-            histogram.values_.push_back(std::stof(match[3]));
+            name = series_name(match[1], match[2]);
+            /* stod: bounds below FLT_MIN would throw with stof */
+            histogram.buckets_.push_back((float)std::stod(match[3]));
+            histogram.values_.push_back(std::stof(match[4]));
+        }
+        else if (std::regex_search(line, match, re_inf)) {
+            has_inf = true;
+            ASSERT_TRUE(4 == match.size(), "invalid histogram +Inf bucket");
+            histogram.inf_ = std::stof(match[3]);
         }
         else if (std::regex_match(line, match, re_count)) {
             has_count = true;
-            ASSERT_TRUE(3 == match.size(), "invalid histogram count");
-            histogram.count_ = std::stoul(match[2]);
+            ASSERT_TRUE(4 == match.size(), "invalid histogram count");
+            ASSERT_TRUE(match[1].str() + match[2].str() == name,
+                        "histogram count of another series");
+            histogram.count_ = std::stof(match[3]);
+            histogram.samples_ = std::stoull(match[3]);
         }
         else if (std::regex_match(line, match, re_sum)) {
             has_sum = true;
-            ASSERT_TRUE(3 == match.size(), "invalid histogram size");
-            histogram.sum_ = std::stoul(match[2]);
+            ASSERT_TRUE(4 == match.size(), "invalid histogram size");
+            histogram.sum_ = std::stod(match[3]);
         }
         else {
             fprintf(stderr, "error at '%s': invalid histogram.\n", line.c_str());
@@ -135,33 +279,94 @@ static bool parse_histogram(std::list<std::string>& body)
         }
     }
 
-    ASSERT_TRUE(has_bucket && has_count && has_sum, "incomplete histogram");
+    ASSERT_TRUE(has_bucket && has_inf && has_count && has_sum,
+                "incomplete histogram");
+    ASSERT_TRUE(compare(histogram.inf_, histogram.count_) == 0,
+                "+Inf bucket and histogram count mismatch");
 
     assert(histogram.buckets_.size() == histogram.values_.size());
     histograms->insert_or_assign(name, histogram);
     return true;
 }
 
+/* quantile lines, then _sum and _count */
+static bool parse_summary(std::list<std::string>& body)
+{
+    const std::regex re_quantile("([A-Za-z0-9_]+)\\{(.*,)?quantile=\"([0-9.e-]+)\"\\} +(NaN|[-0-9.e+]+)$");
+    const std::regex re_sum("([A-Za-z0-9_]+)_sum(\\{.*\\})? +([-0-9.e+]+)$");
+    const std::regex re_count("([A-Za-z0-9_]+)_count(\\{.*\\})? +([0-9]+)$");
+    std::smatch match;
+    Summary summary = {};
+    std::string name;
+
+    while (body.size() > 0
+           && std::regex_match(body.front(), match, re_quantile)) {
+        name = series_name(match[1], match[2]);
+        summary.quantiles_[std::stod(match[3])] = std::stod(match[4]);
+        body.pop_front();
+    }
+
+    ASSERT_TRUE(body.size() > 0
+                && std::regex_match(body.front(), match, re_sum),
+                "summary without _sum");
+    ASSERT_TRUE(match[1].str() + match[2].str() == name,
+                "summary sum of another series");
+    summary.sum_ = std::stod(match[3]);
+    body.pop_front();
+
+    ASSERT_TRUE(body.size() > 0
+                && std::regex_match(body.front(), match, re_count),
+                "summary without _count");
+    ASSERT_TRUE(match[1].str() + match[2].str() == name,
+                "summary count of another series");
+    summary.count_ = std::stoull(match[3]);
+    body.pop_front();
+
+    summaries->insert_or_assign(name, summary);
+    return true;
+}
+
 static bool parse_gauge(std::list<std::string>& body)
 {
-    const std::regex re_metric_gauge("([A-Za-z0-9_]+) +([0-9.]+)$");
+    const std::regex re_metric_gauge("([A-Za-z0-9_]+(\\{.*\\})?) +([0-9.]+)$");
     std::smatch match;
     std::string line = body.front();
     body.pop_front();
 
     bool res = std::regex_match(line, match, re_metric_gauge);
-    if (false == res || 3 != match.size()) {
+    if (false == res || 4 != match.size()) {
         fprintf(stderr, "error at '%s': invalid gauge.\n", line.c_str());
         return false;
     }
 
-    (*gauges)[match[1].str()] = std::stof(match[2]);
+    (*gauges)[match[1].str()] = std::stof(match[3]);
+    return true;
+}
+
+static bool parse_counter(std::list<std::string>& body)
+{
+    const std::regex re_metric_counter("([A-Za-z0-9_]+(\\{.*\\})?) +([0-9.]+)$");
+    std::smatch match;
+    std::string line = body.front();
+    body.pop_front();
+
+    bool res = std::regex_match(line, match, re_metric_counter);
+    if (false == res || 4 != match.size()) {
+        fprintf(stderr, "error at '%s': invalid counter.\n", line.c_str());
+        return false;
+    }
+
+    (*counters)[match[1].str()] = std::stod(match[3]);
     return true;
 }
 
+/* a family: "# HELP" (optional), "# TYPE", then its series. A family must
+ * not appear twice in a body. */
 static bool parse_metrics(std::list<std::string>& body)
 {
-    const std::regex re_metric_type("# TYPE ([A-Za-z0-9_]+) (histogram|gauge)");
+    const std::regex re_metric_type("# TYPE ([A-Za-z0-9_]+) (histogram|gauge|counter|summary)");
+    const std::regex re_metric_help("# HELP ([A-Za-z0-9_]+) (.*)");
+    std::unordered_map<std::string, bool> families;
     std::smatch match;
 
     bool result = true;
@@ -169,14 +374,21 @@ static bool parse_metrics(std::list<std::string>& body)
 
     while (body.size() > 0 && result) {
         std::string line = body.front();
-        body.pop_front();
 
-        if (false == std::regex_match(line, match, re_metric_type)) {
-            fprintf(stderr, "error at '%s': expected type.\n", line.c_str());
-            return false;
+        if (std::regex_match(line, match, re_metric_help)) {
+            body.pop_front();
+            (*helps)[match[1].str()] = match[2].str();
+            continue;
         }
 
-        type = string2mtype(match[2]);
+        if (std::regex_match(line, match, re_metric_type)) {
+            body.pop_front();
+            ASSERT_TRUE(families.count(match[1].str()) == 0,
+                        "family split in two");
+            families[match[1].str()] = true;
+            type = string2mtype(match[2]);
+            continue;
+        }
 
         switch (type) {
         case MT_HISTOGRAM:
@@ -185,8 +397,14 @@ static bool parse_metrics(std::list<std::string>& body)
         case MT_GAUGE:
             result = parse_gauge(body);
             break;
+        case MT_COUNTER:
+            result = parse_counter(body);
+            break;
+        case MT_SUMMARY:
+            result = parse_summary(body);
+            break;
         case MT_INVALID: /* fallthrough */
-            fprintf(stderr, "error at '%s': invalid type.\n", line.c_str());
+            fprintf(stderr, "error at '%s': expected type.\n", line.c_str());
             return false;
         }
     }
@@ -194,6 +412,12 @@ static bool parse_metrics(std::list<std::string>& body)
     return result;
 }
 
+std::string mock_get_help(std::string name)
+{
+    ASSERT_TRUE(helps->count(name) == 1, "no help for this family");
+    return (*helps)[name];
+}
+
 struct http_hdr {
     bool is_post;
     char padding[7];
@@ -217,17 +441,17 @@ static bool parse_http(char *input,
     const std::regex re_content_length("Content-length: *([0-9]+)");
     const std::regex re_content_type("Content-type: *(.+)");
     const std::regex re_hostname("Host: *([^ ]+)");
-    const std::regex re_rq("(POST|GET) /metrics/job/([a-zA-Z0-9_]+) HTTP/1.0");
+    const std::regex re_rq("(POST|GET) /metrics/job/([a-zA-Z0-9_]+) HTTP/1.[01]");
 
     char *tmp = strtok_r(input, "\r\n", &state);
-    /* first line MUST be valid. POST ... HTTP/1.0 */
+    /* first line MUST be valid. POST ... HTTP/1.x */
     ASSERT_TRUE(nullptr != tmp, "http request ill-formed");
 
 
     while (nullptr != tmp && false == has_content_length) {
         std::string line(tmp);
         if (false == has_http_rq) {
-            /* first line MUST be POST ... HTTP/1.0 */
+            /* first line MUST be POST ... HTTP/1.x */
             ASSERT_TRUE(std::regex_match(line, match, re_rq),
                         "Invalid http request header");
             ASSERT_TRUE(match.size() == 3, "invalid http request header");
@@ -277,8 +501,559 @@ static bool parse_http(char *input,
     return has_hostname && has_content_length && has_content_type;
 }
 
+/* protobuf delimited format: just what the client writes */
+struct pb_reader {
+    const uint8_t *ptr;
+    const uint8_t *end;
+
+    uint64_t varint()
+    {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            ASSERT_TRUE(ptr < end, "truncated varint");
+            uint8_t byte = *ptr++;
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if (0 == (byte & 0x80)) {
+                return value;
+            }
+        }
+        ASSERT_TRUE(false, "varint too long");
+        return 0;
+    }
+
+    double fixed64()
+    {
+        uint64_t bits = 0;
+        ASSERT_TRUE(end - ptr >= 8, "truncated double");
+        for (int i = 0; i < 8; i++) {
+            bits |= (uint64_t)ptr[i] << (8 * i);
+        }
+        ptr += 8;
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    pb_reader sub()
+    {
+        uint64_t len = varint();
+        ASSERT_TRUE(len <= (uint64_t)(end - ptr), "truncated message");
+        pb_reader out = { ptr, ptr + len };
+        ptr += len;
+        return out;
+    }
+
+    bool done() const { return ptr >= end; }
+};
+
+static double pb_value(pb_reader msg)
+{
+    double value = 0.;
+    while (!msg.done()) {
+        uint64_t tag = msg.varint();
+        ASSERT_TRUE(tag == ((1 << 3) | 1), "unexpected value field");
+        value = msg.fixed64();
+    }
+    return value;
+}
+
+static Histogram pb_histogram(pb_reader msg)
+{
+    Histogram h = {};
+    std::vector<std::pair<int64_t, uint64_t>> spans[2]; /* negative first */
+    std::vector<int64_t> deltas[2];
+    while (!msg.done()) {
+        uint64_t tag = msg.varint();
+        if (tag == ((1 << 3) | 0)) {
+            h.samples_ = msg.varint();
+            h.count_ = (float)h.samples_;
+        } else if (tag == ((4 << 3) | 1)) {
+            h.count_ = (float)msg.fixed64();
+        } else if (tag == ((2 << 3) | 1)) {
+            h.sum_ = msg.fixed64();
+        } else if (tag == ((3 << 3) | 2)) {
+            pb_reader bucket = msg.sub();
+            while (!bucket.done()) {
+                uint64_t btag = bucket.varint();
+                if (btag == ((1 << 3) | 0)) {
+                    h.values_.push_back((float)bucket.varint());
+                } else if (btag == ((4 << 3) | 1)) {
+                    h.values_.push_back((float)bucket.fixed64());
+                } else if (btag == ((2 << 3) | 1)) {
+                    h.buckets_.push_back((float)bucket.fixed64());
+                } else {
+                    ASSERT_TRUE(false, "unexpected bucket field");
+                }
+            }
+        } else if (tag == ((5 << 3) | 0)) {
+            uint64_t zigzag = msg.varint();
+            h.schema_ = (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+        } else if (tag == ((6 << 3) | 1)) {
+            msg.fixed64();
+        } else if (tag == ((7 << 3) | 0)) {
+            h.zero_count_ = msg.varint();
+        } else if (tag == ((9 << 3) | 2) || tag == ((12 << 3) | 2)) {
+            pb_reader span = msg.sub();
+            int64_t offset = 0;
+            uint64_t length = 0;
+            while (!span.done()) {
+                uint64_t stag = span.varint();
+                uint64_t value = span.varint();
+                if (stag == ((1 << 3) | 0)) {
+                    offset = (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+                } else if (stag == ((2 << 3) | 0)) {
+                    length = value;
+                } else {
+                    ASSERT_TRUE(false, "unexpected span field");
+                }
+            }
+            spans[tag >> 3 == 12].push_back({offset, length});
+        } else if (tag == ((10 << 3) | 2) || tag == ((13 << 3) | 2)) {
+            pb_reader packed = msg.sub();
+            while (!packed.done()) {
+                uint64_t value = packed.varint();
+                deltas[tag >> 3 == 13].push_back(
+                    (int64_t)(value >> 1) ^ -(int64_t)(value & 1));
+            }
+        } else {
+            ASSERT_TRUE(false, "unexpected histogram field");
+        }
+    }
+
+    /* spans give the indexes, deltas the counts. Empty buckets are
+     * allowed within spans: they are not stored. */
+    for (int side = 0; side < 2; side++) {
+        std::map<int, uint64_t>& buckets = side ? h.positive_ : h.negative_;
+        size_t delta = 0;
+        int64_t index = 0;
+        int64_t count = 0;
+        for (size_t i = 0; i < spans[side].size(); i++) {
+            index += spans[side][i].first;
+            for (uint64_t j = 0; j < spans[side][i].second; j++) {
+                ASSERT_TRUE(delta < deltas[side].size(), "missing delta");
+                count += deltas[side][delta++];
+                ASSERT_TRUE(count >= 0, "negative bucket count");
+                if (count > 0) {
+                    buckets[(int)index] = (uint64_t)count;
+                }
+                index++;
+            }
+        }
+        ASSERT_TRUE(delta == deltas[side].size(), "deltas without span");
+    }
+
+    /* +Inf is implied by the sample count */
+    h.inf_ = h.count_;
+    ASSERT_TRUE(h.buckets_.size() == h.values_.size(), "incomplete bucket");
+    return h;
+}
+
+static Summary pb_summary(pb_reader msg)
+{
+    Summary s = {};
+    while (!msg.done()) {
+        uint64_t tag = msg.varint();
+        if (tag == ((1 << 3) | 0)) {
+            s.count_ = msg.varint();
+        } else if (tag == ((2 << 3) | 1)) {
+            s.sum_ = msg.fixed64();
+        } else if (tag == ((3 << 3) | 2)) {
+            pb_reader quantile = msg.sub();
+            double q = 0.;
+            double value = 0.;
+            while (!quantile.done()) {
+                uint64_t qtag = quantile.varint();
+                if (qtag == ((1 << 3) | 1)) {
+                    q = quantile.fixed64();
+                } else if (qtag == ((2 << 3) | 1)) {
+                    value = quantile.fixed64();
+                } else {
+                    ASSERT_TRUE(false, "unexpected quantile field");
+                }
+            }
+            s.quantiles_[q] = value;
+        } else {
+            ASSERT_TRUE(false, "unexpected summary field");
+        }
+    }
+    return s;
+}
+
+/* LabelPair, rendered and escaped as in the text format */
+static std::string pb_label(pb_reader msg)
+{
+    std::string name;
+    std::string value;
+    while (!msg.done()) {
+        uint64_t tag = msg.varint();
+        pb_reader str = msg.sub();
+        std::string s((const char*)str.ptr, str.end - str.ptr);
+        if (tag == ((1 << 3) | 2)) {
+            name = s;
+        } else if (tag == ((2 << 3) | 2)) {
+            value = s;
+        } else {
+            ASSERT_TRUE(false, "unexpected label field");
+        }
+    }
+
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return name + "=\"" + escaped + "\"";
+}
+
+static void parse_protobuf(const uint8_t *ptr, size_t size)
+{
+    pb_reader body = { ptr, ptr + size };
+    std::unordered_map<std::string, bool> families;
+
+    while (!body.done()) {
+        pb_reader family = body.sub();
+        std::string name;
+        uint64_t type = 3;
+
+        while (!family.done()) {
+            uint64_t tag = family.varint();
+            if (tag == ((1 << 3) | 2)) {
+                pb_reader str = family.sub();
+                name.assign((const char*)str.ptr, str.end - str.ptr);
+                ASSERT_TRUE(families.count(name) == 0, "family split in two");
+                families[name] = true;
+            } else if (tag == ((2 << 3) | 2)) {
+                pb_reader str = family.sub();
+                std::string help((const char*)str.ptr, str.end - str.ptr);
+                (*helps)[name] = help;
+            } else if (tag == ((3 << 3) | 0)) {
+                type = family.varint();
+            } else if (tag == ((4 << 3) | 2)) {
+                pb_reader metric = family.sub();
+                std::string labels;
+                while (!metric.done()) {
+                    uint64_t mtag = metric.varint();
+                    ASSERT_TRUE((mtag & 7) == 2, "unexpected metric field");
+                    pb_reader value = metric.sub();
+                    std::string series = series_name(name, labels);
+                    if (mtag >> 3 == 1) {
+                        labels += pb_label(value) + ",";
+                    } else if (mtag >> 3 == 2 && type == 1) {
+                        (*gauges)[series] = (float)pb_value(value);
+                    } else if (mtag >> 3 == 3 && type == 0) {
+                        (*counters)[series] = pb_value(value);
+                    } else if (mtag >> 3 == 4 && type == 2) {
+                        summaries->insert_or_assign(series, pb_summary(value));
+                    } else if (mtag >> 3 == 7 && type == 4) {
+                        histograms->insert_or_assign(series,
+                                                     pb_histogram(value));
+                    } else {
+                        ASSERT_TRUE(false, "metric and family type mismatch");
+                    }
+                }
+            } else {
+                ASSERT_TRUE(false, "unexpected family field");
+            }
+        }
+    }
+}
+
+/* gzip bodies: a small inflater (RFC 1951/1952), independent from the
+ * client's deflate. Stored, fixed and dynamic blocks are all accepted, so
+ * a client built with zlib is checked too. */
+struct inflater {
+    const uint8_t *ptr;
+    const uint8_t *end;
+    uint32_t acc = 0;
+    int count = 0;
+    std::string out;
+
+    struct huffman {
+        std::vector<uint16_t> counts;
+        std::vector<uint16_t> symbols;
+    };
+
+    int bits(int n)
+    {
+        while (count < n) {
+            ASSERT_TRUE(ptr < end, "truncated deflate stream");
+            acc |= (uint32_t)*ptr++ << count;
+            count += 8;
+        }
+        int value = (int)(acc & ((1u << n) - 1));
+        acc >>= n;
+        count -= n;
+        return value;
+    }
+
+    static huffman build(const uint8_t *lengths, int n)
+    {
+        huffman h;
+        h.counts.assign(16, 0);
+        for (int i = 0; i < n; i++) {
+            h.counts[lengths[i]]++;
+        }
+        std::vector<uint16_t> offsets(16, 0);
+        for (int len = 1; len < 15; len++) {
+            offsets[len + 1] = offsets[len] + h.counts[len];
+        }
+        h.symbols.assign(n, 0);
+        for (int i = 0; i < n; i++) {
+            if (lengths[i] != 0) {
+                h.symbols[offsets[lengths[i]]++] = (uint16_t)i;
+            }
+        }
+        return h;
+    }
+
+    /* canonical codes come MSB first, one bit at a time */
+    int decode(const huffman& h)
+    {
+        int code = 0, first = 0, index = 0;
+        for (int len = 1; len < 16; len++) {
+            code |= bits(1);
+            int n = h.counts[len];
+            if (code - n < first) {
+                return h.symbols[index + (code - first)];
+            }
+            index += n;
+            first = (first + n) << 1;
+            code <<= 1;
+        }
+        ASSERT_TRUE(false, "bad huffman code");
+        return -1;
+    }
+
+    void codes(const huffman& lit, const huffman& dist)
+    {
+        static const uint16_t lbase[29] = {
+            3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        static const uint8_t lextra[29] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+            3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+        static const uint16_t dbase[30] = {
+            1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+            257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+            8193, 12289, 16385, 24577 };
+        static const uint8_t dextra[30] = {
+            0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+            7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+        for (;;) {
+            int symbol = decode(lit);
+            if (symbol < 256) {
+                out.push_back((char)symbol);
+                continue;
+            }
+            if (symbol == 256) {
+                return;
+            }
+            symbol -= 257;
+            ASSERT_TRUE(symbol < 29, "bad length symbol");
+            size_t len = lbase[symbol] + bits(lextra[symbol]);
+            int d = decode(dist);
+            ASSERT_TRUE(d < 30, "bad distance symbol");
+            size_t distance = dbase[d] + bits(dextra[d]);
+            ASSERT_TRUE(distance <= out.size(), "distance too far back");
+            for (size_t i = 0; i < len; i++) {
+                out.push_back(out[out.size() - distance]);
+            }
+        }
+    }
+
+    void block_dynamic()
+    {
+        static const uint8_t order[19] = {
+            16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+        int nlen = bits(5) + 257;
+        int ndist = bits(5) + 1;
+        int ncode = bits(4) + 4;
+        uint8_t lengths[320] = { 0 };
+
+        for (int i = 0; i < ncode; i++) {
+            lengths[order[i]] = (uint8_t)bits(3);
+        }
+        huffman lencode = build(lengths, 19);
+
+        int index = 0;
+        while (index < nlen + ndist) {
+            int symbol = decode(lencode);
+            if (symbol < 16) {
+                lengths[index++] = (uint8_t)symbol;
+                continue;
+            }
+            uint8_t len = 0;
+            int repeat;
+            if (symbol == 16) {
+                ASSERT_TRUE(index > 0, "repeat with no length");
+                len = lengths[index - 1];
+                repeat = 3 + bits(2);
+            } else if (symbol == 17) {
+                repeat = 3 + bits(3);
+            } else {
+                repeat = 11 + bits(7);
+            }
+            ASSERT_TRUE(index + repeat <= nlen + ndist, "too many lengths");
+            while (repeat-- > 0) {
+                lengths[index++] = len;
+            }
+        }
+
+        codes(build(lengths, nlen), build(lengths + nlen, ndist));
+    }
+
+    void block_fixed()
+    {
+        uint8_t lengths[288 + 30];
+        for (int i = 0; i < 288; i++) {
+            lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+        }
+        for (int i = 0; i < 30; i++) {
+            lengths[288 + i] = 5;
+        }
+        codes(build(lengths, 288), build(lengths + 288, 30));
+    }
+
+    void block_stored()
+    {
+        acc = 0;
+        count = 0;
+        ASSERT_TRUE(end - ptr >= 4, "truncated stored block");
+        size_t len = ptr[0] | (ptr[1] << 8);
+        ASSERT_TRUE((len ^ 0xffff) == (size_t)(ptr[2] | (ptr[3] << 8)),
+                    "bad stored block length");
+        ptr += 4;
+        ASSERT_TRUE((size_t)(end - ptr) >= len, "truncated stored block");
+        out.append((const char*)ptr, len);
+        ptr += len;
+    }
+};
+
+static uint32_t le32(const uint8_t *ptr)
+{
+    return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+static std::string gunzip(const uint8_t *ptr, size_t size)
+{
+    ASSERT_TRUE(size >= 18, "gzip member too short");
+    ASSERT_TRUE(ptr[0] == 0x1f && ptr[1] == 0x8b && ptr[2] == 8,
+                "bad gzip magic");
+    ASSERT_TRUE(ptr[3] == 0, "unexpected gzip flags");
+
+    inflater in;
+    in.ptr = ptr + 10;
+    in.end = ptr + size - 8;
+    int last;
+    do {
+        last = in.bits(1);
+        int type = in.bits(2);
+        if (type == 0) {
+            in.block_stored();
+        } else if (type == 1) {
+            in.block_fixed();
+        } else {
+            ASSERT_TRUE(type == 2, "bad block type");
+            in.block_dynamic();
+        }
+    } while (!last);
+    ASSERT_TRUE(in.ptr == in.end, "trailing bytes after the last block");
+
+    uint32_t crc = 0xffffffff;
+    for (unsigned char c : in.out) {
+        crc ^= c;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+        }
+    }
+    ASSERT_TRUE((crc ^ 0xffffffff) == le32(ptr + size - 8), "bad gzip CRC");
+    ASSERT_TRUE(in.out.size() == le32(ptr + size - 4), "bad gzip size");
+
+    return in.out;
+}
+
+static int last_iovec_count = 0;
+static size_t packet_count = 0;
+static bool last_was_protobuf = false;
+static bool last_was_gzip = false;
+static size_t last_body_size = 0;
+
+bool mock_last_was_protobuf()
+{
+    return last_was_protobuf;
+}
+
+bool mock_last_was_gzip()
+{
+    return last_was_gzip;
+}
+
+size_t mock_get_last_body_size()
+{
+    return last_body_size;
+}
+
+int mock_get_last_iovec_count()
+{
+    return last_iovec_count;
+}
+
+size_t mock_get_packet_count()
+{
+    return packet_count;
+}
+
 int pmc_output_data(const void *bytes, size_t size)
 {
+    const std::string packet((const char*)bytes, size);
+    const size_t end = packet.find("\r\n\r\n");
+    ASSERT_TRUE(std::string::npos != end, "no end of HTTP header");
+
+    /* inflate the body, then check the plain packet it stands for */
+    const std::string encoding("Content-Encoding: gzip\r\n");
+    const size_t encoding_at = packet.substr(0, end).find(encoding);
+    if (std::string::npos != encoding_at) {
+        const std::string length_field = "Content-length: "
+                                          + std::to_string(size - end - 4);
+        const size_t length_at = packet.find(length_field);
+        ASSERT_TRUE(length_at < end, "bad Content-length");
+
+        std::string body = gunzip((const uint8_t*)bytes + end + 4,
+                                  size - end - 4);
+        std::string header = packet.substr(0, end + 4);
+        header.replace(length_at, length_field.size(),
+                       "Content-length: " + std::to_string(body.size()));
+        header.erase(header.find(encoding), encoding.size());
+
+        std::string plain = header + body;
+        pmc_output_data(plain.data(), plain.size());
+        last_was_gzip = true;
+        last_body_size = size - end - 4;
+        return 0;
+    }
+    last_was_gzip = false;
+    last_body_size = size - end - 4;
+
+    last_was_protobuf = std::string::npos != packet.substr(0, end).find(
+        "Content-type: application/vnd.google.protobuf; "
+        "proto=io.prometheus.client.MetricFamily; encoding=delimited\r\n");
+    if (last_was_protobuf) {
+        ASSERT_TRUE(0 == packet.compare(0, 5, "POST "), "not a POST");
+        ASSERT_TRUE(std::string::npos != packet.find(
+                        "Content-length: " + std::to_string(size - end - 4)),
+                    "bad Content-length");
+        parse_protobuf((const uint8_t*)bytes + end + 4, size - end - 4);
+        packet_count++;
+        return 0;
+    }
+
     char *buffer = (char*)malloc(sizeof(char) * size + 1);
     std::list<std::string> body;
     memmove(buffer, bytes, size);
@@ -292,12 +1067,46 @@ int pmc_output_data(const void *bytes, size_t size)
     ASSERT_TRUE(parse_metrics(body), "cannot parse metrics");
 
     free(buffer);
+    packet_count++;
 
     return 0;
 }
 
+/* set while a push is in the sink: the client must never overlap them */
+static std::atomic<bool> in_sink(false);
+
+int pmc_output_datav(const struct iovec *iov, int count)
+{
+    std::string packet;
+
+    ASSERT_TRUE(!in_sink.exchange(true), "overlapping sink calls");
+    ASSERT_TRUE(count > 0, "empty iovec");
+    for (int i = 0; i < count; i++) {
+        packet.append((const char*)iov[i].iov_base, iov[i].iov_len);
+    }
+
+    /* the header is expected alone in the first iovec */
+    std::string header((const char*)iov[0].iov_base, iov[0].iov_len);
+    ASSERT_TRUE(header.size() >= 4
+                && header.compare(header.size() - 4, 4, "\r\n\r\n") == 0,
+                "first iovec is not the HTTP header");
+
+    last_iovec_count = count;
+    int res = pmc_output_data(packet.data(), packet.size());
+    in_sink = false;
+    return res;
+}
+
+/* -1: no error expected */
+static int expected_error = -1;
+
+void mock_expect_error(int err)
+{
+    expected_error = err;
+}
+
 void pmc_handle_error(enum pmc_error err)
 {
-    (void)err;
-    assert_eq(0, 1);
+    ASSERT_TRUE((int)err == expected_error, "unexpected error %d", (int)err);
+    expected_error = -1;
 }
@@ -1,6 +1,8 @@
 #ifndef H_MOCK_SINK_
 #define H_MOCK_SINK_
 
+#include <cstdint>
+#include <map>
 #include <string>
 
 void mock_init(void);
@@ -9,8 +11,37 @@ void mock_deinit(void);
 float  mock_gauge_get_value(std::string name);
 size_t mock_gauge_get_count();
 
+double mock_counter_get_value(std::string name);
+size_t mock_counter_get_count();
+
 float  mock_histogram_get_bucket(std::string name, float bucket);
 size_t mock_histogram_count_buckets(std::string name);
+float  mock_histogram_get_inf(std::string name);
+uint64_t mock_histogram_get_samples(std::string name);
+double mock_histogram_get_sum(std::string name);
 size_t mock_histogram_get_count();
 
+/* native histograms, as sent in protobuf. Empty buckets are left out. */
+int mock_native_get_schema(std::string name);
+uint64_t mock_native_get_zero_count(std::string name);
+uint64_t mock_native_get_bucket(std::string name, bool negative, int index);
+std::map<int, uint64_t> mock_native_get_buckets(std::string name,
+                                                bool negative);
+
+double mock_summary_get_quantile(std::string name, double quantile);
+uint64_t mock_summary_get_samples(std::string name);
+double mock_summary_get_sum(std::string name);
+
+std::string mock_get_help(std::string name);
+
+/* the next pmc_handle_error call must report *err* (an enum pmc_error).
+ * Any other error fails the test. */
+void mock_expect_error(int err);
+
+int    mock_get_last_iovec_count();
+size_t mock_get_packet_count();
+bool   mock_last_was_protobuf();
+bool   mock_last_was_gzip();
+size_t mock_get_last_body_size();
+
 #endif /* H_MOCK_SINK_ */
@@ -0,0 +1,19 @@
+#include <stdio.h>
+
+#include "test.hh"
+
+/* runs test-sinks.cc against a shipped sink, linked in place of the mock */
+int main()
+{
+    test_fptr* func = reinterpret_cast<test_fptr*>(&__start_test_fptrs);
+    const char** names = reinterpret_cast<const char**>(&__start_test_names);
+    size_t len = static_cast<size_t>(&__stop_test_fptrs - &__start_test_fptrs);
+
+    for (size_t i = 0; i < len; i++) {
+        fprintf(stderr, "executing %s...", names[i]);
+        func[i]();
+        fprintf(stderr, "passed.\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <thread>
+
+#include "test.hh"
+#include "mock-sink.hh"
+#include "prometheus-client.h"
+
+CREATE_TEST(async, simple_send)
+{
+    size_t before = mock_get_packet_count();
+    pmc_metric_s m = pmc_initialize("test_async");
+    pmc_gauge_h g = pmc_create_gauge(m, "value", 1.f);
+
+    assert_eq(pmc_async_start(16, PMC_ASYNC_DROP_NEWEST), 0);
+    assert_eq(pmc_send_async(m), 0);
+    pmc_gauge_set(g, 2.f);
+    assert_eq(pmc_send_async(m), 0);
+
+    /* the queued packets are snapshots: the set can go away */
+    pmc_destroy(m);
+    pmc_async_stop();
+
+    assert_eq(mock_get_packet_count() - before, 2UL);
+    assert_eq(mock_gauge_get_value("test_async_value"), 2.f);
+}
+
+CREATE_TEST(async, drop_oldest)
+{
+    const size_t PUSHES = 1000;
+    size_t before = mock_get_packet_count();
+    pmc_metric_s m = pmc_initialize("test_async");
+    pmc_gauge_h g = pmc_create_gauge(m, "value", 0.f);
+
+    assert_eq(pmc_async_start(1, PMC_ASYNC_DROP_OLDEST), 0);
+    for (size_t i = 1; i <= PUSHES; i++) {
+        pmc_gauge_set(g, (float)i);
+        assert_eq(pmc_send_async(m), 0);
+    }
+    pmc_destroy(m);
+    pmc_async_stop();
+
+    /* whatever was dropped, the last push always goes out */
+    assert_eq(mock_get_packet_count() - before + pmc_async_dropped(), PUSHES);
+    assert_eq(mock_gauge_get_value("test_async_value"), (float)PUSHES);
+}
+
+CREATE_TEST(async, send_meanwhile)
+{
+    const size_t PUSHES = 200;
+    pmc_metric_s queued = pmc_initialize("test_async");
+    pmc_metric_s direct = pmc_initialize("test_direct");
+    pmc_create_gauge(queued, "value", 1.f);
+    pmc_create_gauge(direct, "value", 2.f);
+
+    /* the sender thread and pmc_send share the sink (the mock fails on
+     * overlapping calls) */
+    assert_eq(pmc_async_start(4, PMC_ASYNC_DROP_OLDEST), 0);
+    std::thread pusher([queued, PUSHES]() {
+        for (size_t i = 0; i < PUSHES; i++) {
+            pmc_send_async(queued);
+        }
+    });
+    for (size_t i = 0; i < PUSHES; i++) {
+        assert_eq(pmc_send(direct), 0);
+    }
+    pusher.join();
+    pmc_async_stop();
+    pmc_destroy(queued);
+    pmc_destroy(direct);
+
+    assert_eq(mock_gauge_get_value("test_async_value"), 1.f);
+    assert_eq(mock_gauge_get_value("test_direct_value"), 2.f);
+}
@@ -0,0 +1,84 @@
+#include <string>
+#include <vector>
+
+#include "test.hh"
+#include "mock-sink.hh"
+#include "prometheus-client.h"
+
+CREATE_TEST(compression, gzip_text)
+{
+    const size_t BUCKETS = 200;
+    std::vector<float> buckets;
+    std::vector<float> values;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        buckets.push_back(0.25f * (float)(i + 1));
+        values.push_back((float)(i % 5));
+    }
+
+    pmc_metric_s m = pmc_initialize("test_gz");
+    pmc_histogram_h h = pmc_create_histogram(m, "latency", BUCKETS,
+                                             buckets.data(), values.data());
+    pmc_create_gauge(m, "small", 1.5f);
+
+    /* below the threshold: sent as it is */
+    pmc_set_compression(m, 1000000);
+    pmc_send(m);
+    ASSERT_TRUE(!mock_last_was_gzip(), "expected a plain body");
+    const size_t plain_size = mock_get_last_body_size();
+
+    pmc_set_compression(m, 1024);
+    pmc_send(m);
+    ASSERT_TRUE(mock_last_was_gzip(), "expected a gzip body");
+    ASSERT_TRUE(mock_get_last_body_size() * 4 < plain_size,
+                "bucket lines should compress well");
+
+    float total = 0.f;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        total += values[i];
+        assert_eq(mock_histogram_get_bucket("test_gz_latency", buckets[i]),
+                  total);
+    }
+    assert_eq(mock_gauge_get_value("test_gz_small"), 1.5f);
+
+    /* the compressor state is reused from one push to the next */
+    pmc_histogram_observe(h, 0.1f);
+    pmc_send(m);
+    ASSERT_TRUE(mock_last_was_gzip(), "expected a gzip body");
+    assert_eq(mock_histogram_get_bucket("test_gz_latency", buckets[0]), 1.f);
+
+    pmc_destroy(m);
+}
+
+CREATE_TEST(compression, gzip_protobuf)
+{
+    pmc_metric_s m = pmc_initialize("test_gz_pb");
+    std::vector<std::string> names;
+    for (int i = 0; i < 100; i++) {
+        names.push_back("gauge_" + std::to_string(i));
+        pmc_create_gauge(m, names.back().c_str(), (float)i);
+    }
+
+    pmc_set_format(m, PMC_FORMAT_PROTOBUF);
+    pmc_set_compression(m, 1);
+    pmc_send(m);
+    pmc_destroy(m);
+
+    ASSERT_TRUE(mock_last_was_gzip(), "expected a gzip body");
+    ASSERT_TRUE(mock_last_was_protobuf(), "expected a protobuf body");
+    for (int i = 0; i < 100; i++) {
+        assert_eq(mock_gauge_get_value("test_gz_pb_" + names[i]), (float)i);
+    }
+}
+
+CREATE_TEST(compression, incompressible)
+{
+    /* too short to shrink: gzip would only add its framing */
+    pmc_metric_s m = pmc_initialize("z");
+    pmc_create_gauge(m, "a", 1.f);
+    pmc_set_compression(m, 1);
+    pmc_send(m);
+    pmc_destroy(m);
+
+    ASSERT_TRUE(!mock_last_was_gzip(), "expected a plain body");
+    assert_eq(mock_gauge_get_value("z_a"), 1.f);
+}
@@ -0,0 +1,125 @@
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "test.hh"
+#include "mock-sink.hh"
+#include "prometheus-client.h"
+
+CREATE_TEST(counter, simple_manual)
+{
+    pmc_metric_s m = pmc_initialize("test_counter");
+
+    pmc_counter_h c = pmc_create_counter(m, "requests");
+    pmc_add_counter(m, "errors");
+    ASSERT_TRUE(nullptr != c, "missing counter handle");
+
+    pmc_counter_inc(c);
+    pmc_counter_add(c, 2.5);
+    pmc_counter_inc(pmc_get_counter(m, "errors"));
+    pmc_send(m);
+    pmc_destroy(m);
+
+    assert_eq(mock_counter_get_count(), 2UL);
+    assert_eq(mock_counter_get_value("test_counter_requests_total"), 3.5);
+    assert_eq(mock_counter_get_value("test_counter_errors_total"), 1.);
+}
+
+CREATE_TEST(counter, concurrent_writers)
+{
+    const size_t THREAD_COUNT = 8;
+    const size_t ITERATIONS = 100000;
+
+    pmc_metric_s m = pmc_initialize("test_counter");
+    pmc_counter_h c = pmc_create_counter(m, "concurrent");
+    pmc_gauge_h g = pmc_create_gauge(m, "concurrent_gauge", 0.f);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        threads.emplace_back([c, g, ITERATIONS]() {
+            for (size_t j = 0; j < ITERATIONS; j++) {
+                pmc_counter_inc(c);
+                pmc_gauge_add(g, 1.f);
+            }
+        });
+    }
+
+    /* sending while writers are running must not see torn values */
+    pmc_send(m);
+
+    for (auto& t : threads) {
+        t.join();
+    }
+    pmc_send(m);
+    pmc_destroy(m);
+
+    assert_eq(mock_counter_get_value("test_counter_concurrent_total"),
+              (double)(THREAD_COUNT * ITERATIONS));
+    assert_eq(mock_gauge_get_value("test_counter_concurrent_gauge"),
+              (float)(THREAD_COUNT * ITERATIONS));
+}
+
+CREATE_TEST(counter, monotonic)
+{
+    pmc_metric_s m = pmc_initialize("test_counter");
+    pmc_counter_h c = pmc_create_counter(m, "bytes_total");
+
+    pmc_counter_add(c, 10.);
+    pmc_counter_add(c, -4.);
+    pmc_counter_add(c, NAN);
+    pmc_counter_add(c, 0.5);
+    pmc_set_help(m, "bytes_total", "bytes sent");
+    pmc_send(m);
+
+    /* the suffix is not doubled */
+    assert_eq(mock_counter_get_value("test_counter_bytes_total"), 10.5);
+    ASSERT_TRUE(mock_get_help("test_counter_bytes_total") == "bytes sent",
+                "help under the full name");
+
+    pmc_set_format(m, PMC_FORMAT_PROTOBUF);
+    pmc_send(m);
+    pmc_destroy(m);
+    assert_eq(mock_counter_get_value("test_counter_bytes_total"), 10.5);
+}
+
+CREATE_TEST(counter, many_counters)
+{
+    const size_t COUNT = 150; /* cells span several blocks */
+    const size_t THREAD_COUNT = 4;
+
+    pmc_metric_s m = pmc_initialize("test_counter");
+    std::vector<pmc_counter_h> counters;
+    for (size_t i = 0; i < COUNT; i++) {
+        counters.push_back(pmc_create_counter(
+            m, ("c" + std::to_string(i)).c_str()));
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        threads.emplace_back([&counters]() {
+            for (size_t j = 0; j < counters.size(); j++) {
+                pmc_counter_add(counters[j], (double)j);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    pmc_send(m);
+
+    /* cached fragments must follow the sums */
+    pmc_counter_inc(counters[COUNT - 1]);
+    pmc_send(m);
+    pmc_destroy(m);
+
+    assert_eq(mock_counter_get_count(), COUNT);
+    for (size_t i = 0; i < COUNT - 1; i++) {
+        assert_eq(mock_counter_get_value("test_counter_c" + std::to_string(i)
+                                         + "_total"),
+                  (double)(i * THREAD_COUNT));
+    }
+    assert_eq(mock_counter_get_value("test_counter_c"
+                                     + std::to_string(COUNT - 1) + "_total"),
+              (double)((COUNT - 1) * THREAD_COUNT + 1));
+}
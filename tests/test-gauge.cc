@@ -1,3 +1,6 @@
+#include <string>
+#include <vector>
+
 #include "test.hh"
 #include "mock-sink.hh"
 #include "prometheus-client.h"
@@ -26,3 +29,114 @@ CREATE_TEST(gauge, simple_manual)
     assert_eq(mock_gauge_get_value("test_gauge_gauge_1"), 0.6f);
     assert_eq(mock_gauge_get_value("test_gauge_gauge_2"), 3.0f);
 }
+
+CREATE_TEST(gauge, handle)
+{
+    pmc_metric_s m = pmc_initialize("test_gauge");
+
+    pmc_gauge_h g1 = pmc_create_gauge(m, "gauge_1", 1.f);
+    pmc_add_gauge(m, "gauge_2", 2.f);
+    pmc_gauge_h g2 = pmc_get_gauge(m, "gauge_2");
+    ASSERT_TRUE(nullptr != g1 && nullptr != g2, "missing gauge handle");
+
+    pmc_gauge_set(g1, 5.f);
+    pmc_gauge_add(g2, 0.5f);
+    pmc_gauge_add(g2, -1.f);
+    pmc_send(m);
+    pmc_destroy(m);
+
+    assert_eq(mock_gauge_get_count(), 2UL);
+    assert_eq(mock_gauge_get_value("test_gauge_gauge_1"), 5.f);
+    assert_eq(mock_gauge_get_value("test_gauge_gauge_2"), 1.5f);
+}
+
+CREATE_TEST(gauge, vectored_output)
+{
+    pmc_send_gauge("test_gauge", "gauge", 1.f);
+
+    /* the mock implements pmc_output_datav: header and body are split */
+    assert_eq(mock_get_last_iovec_count(), 2);
+    assert_eq(mock_gauge_get_value("test_gauge_gauge"), 1.f);
+}
+
+CREATE_TEST(gauge, cached_send)
+{
+    pmc_metric_s m = pmc_initialize("test_gauge");
+
+    pmc_gauge_h g1 = pmc_create_gauge(m, "gauge_1", 1.f);
+    pmc_create_gauge(m, "gauge_2", 2.f);
+    pmc_send(m);
+
+    /* only gauge_1 is rendered again, gauge_2 comes from the cache */
+    pmc_gauge_set(g1, 3.f);
+    pmc_send(m);
+    assert_eq(mock_gauge_get_count(), 2UL);
+    assert_eq(mock_gauge_get_value("test_gauge_gauge_1"), 3.f);
+    assert_eq(mock_gauge_get_value("test_gauge_gauge_2"), 2.f);
+
+    /* nothing changed: everything comes from the cache */
+    pmc_send(m);
+    assert_eq(mock_gauge_get_value("test_gauge_gauge_1"), 3.f);
+    assert_eq(mock_gauge_get_value("test_gauge_gauge_2"), 2.f);
+
+    pmc_gauge_add(g1, 1.f);
+    pmc_send(m);
+    pmc_destroy(m);
+    assert_eq(mock_gauge_get_value("test_gauge_gauge_1"), 4.f);
+}
+
+CREATE_TEST(gauge, user_memory)
+{
+    char memory[512];
+    char name[32];
+
+    /* more gauges than *memory* holds: the rest goes to the heap */
+    pmc_metric_s m = pmc_initialize_with_memory("test_gauge", memory,
+                                                sizeof(memory));
+    for (int i = 0; i < 64; i++) {
+        snprintf(name, sizeof(name), "gauge_%d", i);
+        ASSERT_TRUE(nullptr != pmc_create_gauge(m, name, (float)i),
+                    "gauge creation failed");
+    }
+    pmc_send(m);
+    pmc_destroy(m);
+
+    assert_eq(mock_gauge_get_count(), 64UL);
+    assert_eq(mock_gauge_get_value("test_gauge_gauge_0"), 0.f);
+    assert_eq(mock_gauge_get_value("test_gauge_gauge_63"), 63.f);
+}
+
+CREATE_TEST(gauge, bulk)
+{
+    const size_t COUNT = 100;
+    std::vector<std::string> names;
+    std::vector<const char*> ptrs;
+    std::vector<double> values;
+
+    for (size_t i = 0; i < COUNT; i++) {
+        names.push_back("gauge_" + std::to_string(i));
+        values.push_back((double)i);
+    }
+    for (auto& n : names) {
+        ptrs.push_back(n.c_str());
+    }
+
+    pmc_metric_s m = pmc_initialize("test_gauge");
+    pmc_create_gauge(m, "single", 1.f);
+    pmc_gauge_h first = pmc_create_gauges(m, ptrs.data(), COUNT, nullptr);
+    ASSERT_TRUE(nullptr != first, "bulk creation failed");
+    ASSERT_TRUE(pmc_gauge_at(first, 42) == pmc_get_gauge(m, "gauge_42"),
+                "bulk gauges are not contiguous");
+    pmc_send(m);
+    assert_eq(mock_gauge_get_value("test_gauge_gauge_99"), 0.f);
+
+    pmc_gauge_set_many(first, COUNT, values.data());
+    pmc_gauge_set(pmc_gauge_at(first, 1), 0.5f);
+    pmc_send(m);
+    pmc_destroy(m);
+
+    assert_eq(mock_gauge_get_count(), COUNT + 1);
+    assert_eq(mock_gauge_get_value("test_gauge_single"), 1.f);
+    assert_eq(mock_gauge_get_value("test_gauge_gauge_1"), 0.5f);
+    assert_eq(mock_gauge_get_value("test_gauge_gauge_99"), 99.f);
+}
@@ -1,3 +1,8 @@
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <vector>
+
 #include "test.hh"
 #include "prometheus-client.h"
 #include "mock-sink.hh"
@@ -153,3 +158,297 @@ CREATE_TEST(histogram, multiple_histogram_update)
 
     pmc_destroy(m);
 }
+
+CREATE_TEST(histogram, indexed_update)
+{
+    const size_t HIST_COUNT = 2000;
+    const float buckets[2] = { 1.f, 2.f };
+    const float values[2] = { 0.f, 0.f };
+    const float values_2[2] = { 3.f, 4.f };
+
+    pmc_metric_s m = pmc_initialize("indexed");
+    for (size_t i = 0; i < HIST_COUNT; i++) {
+        std::string name = "h" + std::to_string(i);
+        pmc_add_histogram(m, name.c_str(), 2, buckets, values);
+    }
+
+    /* even histograms through the name, odd ones through a handle */
+    for (size_t i = 0; i < HIST_COUNT; i++) {
+        std::string name = "h" + std::to_string(i);
+        if (i % 2 == 0) {
+            pmc_update_histogram(m, name.c_str(), 2, values_2);
+            continue;
+        }
+
+        pmc_histogram_h h = pmc_get_histogram(m, name.c_str());
+        ASSERT_TRUE(nullptr != h, "histogram '%s' not found", name.c_str());
+        pmc_histogram_update(h, 2, values_2);
+    }
+    pmc_send(m);
+
+    assert_eq(mock_histogram_get_count(), HIST_COUNT);
+    for (size_t i = 0; i < HIST_COUNT; i++) {
+        std::string name = "indexed_h" + std::to_string(i);
+        assert_eq(mock_histogram_get_bucket(name, 1.f), 3.f);
+        assert_eq(mock_histogram_get_bucket(name, 2.f), 7.f);
+    }
+
+    pmc_destroy(m);
+}
+
+CREATE_TEST(histogram, observe)
+{
+    const float buckets[3] = { 1.f, 5.f, 10.f };
+    const float values[3] = { 0.f, 0.f, 0.f };
+    const double samples[] = { 0.5, 1.0, 3.0, 5.0, 5.5, 10.0, 11.0, 100.0 };
+
+    pmc_metric_s m = pmc_initialize("test_hist");
+    pmc_histogram_h h = pmc_create_histogram(m, "observed", 3, buckets, values);
+    ASSERT_TRUE(nullptr != h, "missing histogram handle");
+
+    for (double v : samples) {
+        pmc_histogram_observe(h, v);
+    }
+    pmc_send(m);
+    pmc_destroy(m);
+
+    assert_eq(mock_histogram_get_bucket("test_hist_observed", 1.f), 2.f);
+    assert_eq(mock_histogram_get_bucket("test_hist_observed", 5.f), 4.f);
+    assert_eq(mock_histogram_get_bucket("test_hist_observed", 10.f), 6.f);
+    assert_eq(mock_histogram_get_inf("test_hist_observed"), 8.f);
+}
+
+CREATE_TEST(histogram, sum)
+{
+    const float buckets[2] = { 1.f, 2.f };
+    const float values[2] = { 2.f, 1.f };
+    const double batch[3] = { 3., 0.5, -1. };
+
+    pmc_metric_s m = pmc_initialize("test_hist");
+    pmc_histogram_h h = pmc_create_histogram(m, "lat", 2, buckets, nullptr);
+    pmc_histogram_h s = pmc_create_sharded_histogram(m, "shard", 2, buckets,
+                                                     2);
+    pmc_histogram_h b = pmc_create_histogram(m, "bulk", 2, buckets, values);
+
+    /* observed values are summed as is, +Inf ones included */
+    pmc_histogram_observe(h, 0.25);
+    pmc_histogram_observe(h, 0.25);
+    pmc_histogram_observe(h, 100.);
+    pmc_histogram_observe_n(s, batch, 3);
+    pmc_histogram_observe(s, 7.5);
+    /* bulk counts are estimated from the bounds, observations added */
+    pmc_histogram_observe(b, 10.);
+    pmc_send(m);
+
+    assert_eq(mock_histogram_get_sum("test_hist_lat"), 100.5);
+    assert_eq(mock_histogram_get_sum("test_hist_shard"), 10.);
+    assert_eq(mock_histogram_get_sum("test_hist_bulk"), 14.);
+
+    pmc_set_format(m, PMC_FORMAT_PROTOBUF);
+    pmc_histogram_observe(h, 0.5);
+    pmc_send(m);
+    pmc_destroy(m);
+
+    assert_eq(mock_histogram_get_sum("test_hist_lat"), 101.);
+    assert_eq(mock_histogram_get_sum("test_hist_shard"), 10.);
+}
+
+CREATE_TEST(histogram, sharded_observe)
+{
+    const size_t THREAD_COUNT = 8;
+    const size_t ITERATIONS = 10000;
+    const float buckets[3] = { 1.f, 2.f, 3.f };
+
+    pmc_metric_s m = pmc_initialize("test_hist");
+    /* fewer shards than threads: some rows are shared */
+    pmc_histogram_h h = pmc_create_sharded_histogram(m, "sharded", 3,
+                                                     buckets, 3);
+    ASSERT_TRUE(nullptr != h, "missing histogram handle");
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        threads.emplace_back([h, ITERATIONS]() {
+            for (size_t j = 0; j < ITERATIONS; j++) {
+                pmc_histogram_observe(h, (double)(j % 4) + 0.5);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    pmc_send(m);
+    pmc_destroy(m);
+
+    const float quarter = (float)(THREAD_COUNT * ITERATIONS / 4);
+    assert_eq(mock_histogram_get_bucket("test_hist_sharded", 1.f), quarter);
+    assert_eq(mock_histogram_get_bucket("test_hist_sharded", 2.f),
+              2.f * quarter);
+    assert_eq(mock_histogram_get_bucket("test_hist_sharded", 3.f),
+              3.f * quarter);
+    assert_eq(mock_histogram_get_inf("test_hist_sharded"), 4.f * quarter);
+}
+
+CREATE_TEST(histogram, observe_n)
+{
+    /* 8 buckets take the vector count path, 100 the binary search */
+    const size_t SIZES[] = { 1, 8, 100 };
+    const size_t SAMPLE_COUNT = 1001;
+
+    for (size_t size : SIZES) {
+        std::vector<float> buckets(size);
+        std::vector<double> samples(SAMPLE_COUNT);
+        for (size_t i = 0; i < size; i++) {
+            buckets[i] = (float)i * 2.f;
+        }
+        for (size_t i = 0; i < SAMPLE_COUNT; i++) {
+            samples[i] = (double)((i * 7) % (2 * size + 3)) - 0.5;
+        }
+
+        pmc_metric_s m = pmc_initialize("test_hist");
+        pmc_histogram_h one = pmc_create_histogram(m, "one", size,
+                                                   buckets.data(), nullptr);
+        pmc_histogram_h batch = pmc_create_histogram(m, "batch", size,
+                                                     buckets.data(), nullptr);
+
+        /* expected counts, from a plain linear search */
+        std::vector<float> expected(size + 1, 0.f);
+        for (double v : samples) {
+            size_t i = 0;
+            while (i < size && !(v <= (double)buckets[i])) {
+                i++;
+            }
+            expected[i] += 1.f;
+            pmc_histogram_observe(one, v);
+        }
+        pmc_histogram_observe_n(batch, samples.data(), samples.size());
+        pmc_send(m);
+        pmc_destroy(m);
+
+        float total = 0.f;
+        for (size_t i = 0; i < size; i++) {
+            total += expected[i];
+            assert_eq(mock_histogram_get_bucket("test_hist_one", buckets[i]),
+                      total);
+            assert_eq(mock_histogram_get_bucket("test_hist_batch", buckets[i]),
+                      total);
+        }
+        assert_eq(mock_histogram_get_inf("test_hist_one"),
+                  (float)SAMPLE_COUNT);
+        assert_eq(mock_histogram_get_inf("test_hist_batch"),
+                  (float)SAMPLE_COUNT);
+    }
+}
+
+CREATE_TEST(histogram, large_counts)
+{
+    /* past 2^24, a float count would not move anymore */
+    const uint64_t counts[2] = { ((uint64_t)1 << 40) + 1, 3 };
+    const float buckets[2] = { 1.f, 2.f };
+
+    pmc_metric_s m = pmc_initialize("test_hist");
+    pmc_histogram_h h = pmc_create_histogram(m, "large", 2, buckets, nullptr);
+    pmc_histogram_set_counts(h, 2, counts);
+    pmc_histogram_observe(h, 1.5);
+    pmc_histogram_observe(h, 1e9);
+    pmc_send(m);
+    assert_eq(mock_histogram_get_samples("test_hist_large"),
+              ((uint64_t)1 << 40) + 6);
+
+    pmc_set_format(m, PMC_FORMAT_PROTOBUF);
+    pmc_send(m);
+    pmc_destroy(m);
+    assert_eq(mock_histogram_get_samples("test_hist_large"),
+              ((uint64_t)1 << 40) + 6);
+}
+
+CREATE_TEST(histogram, windowed)
+{
+    const float buckets[2] = { 1.f, 2.f };
+
+    pmc_metric_s m = pmc_initialize("test_hist");
+    pmc_histogram_h h = pmc_create_windowed_histogram(m, "recent", 2, buckets,
+                                                      200, 4);
+    pmc_histogram_observe(h, 0.5);
+    pmc_histogram_observe(h, 1.5);
+    pmc_histogram_observe(h, 5.);
+    pmc_send(m);
+    assert_eq(mock_histogram_get_bucket("test_hist_recent", 1.f), 1.f);
+    assert_eq(mock_histogram_get_inf("test_hist_recent"), 3.f);
+
+    /* the first observations left the window */
+    std::this_thread::sleep_for(std::chrono::milliseconds(260));
+    pmc_histogram_observe(h, 1.5);
+    pmc_send(m);
+    assert_eq(mock_histogram_get_bucket("test_hist_recent", 1.f), 0.f);
+    assert_eq(mock_histogram_get_inf("test_hist_recent"), 1.f);
+    assert_eq(mock_histogram_get_sum("test_hist_recent"), 1.5);
+
+    /* slots expire without observations too */
+    std::this_thread::sleep_for(std::chrono::milliseconds(260));
+    pmc_send(m);
+    pmc_destroy(m);
+    assert_eq(mock_histogram_get_inf("test_hist_recent"), 0.f);
+}
+
+CREATE_TEST(histogram, layouts)
+{
+    std::vector<float> linear(50);
+    std::vector<float> exponential(40);
+    std::vector<float> log_linear(pmc_log_linear_buckets(nullptr, -4, 6, 3));
+
+    pmc_linear_buckets(linear.data(), linear.size(), -1., 0.1);
+    pmc_exponential_buckets(exponential.data(), exponential.size(), 0.01,
+                            1.25);
+    assert_eq(log_linear.size(), (size_t)81);
+    pmc_log_linear_buckets(log_linear.data(), -4, 6, 3);
+    assert_eq(linear[3], -0.7f);
+    assert_eq(exponential[2], 0.015625f);
+    assert_eq(log_linear[1], 0.0703125f);
+    assert_eq(log_linear[80], 64.f);
+
+    for (std::vector<float> const *buckets : { &linear, &exponential,
+                                               &log_linear }) {
+        const size_t size = buckets->size();
+
+        /* on, right above and right below each bound, then spread over
+         * the whole range and beyond */
+        std::vector<double> samples;
+        for (float bound : *buckets) {
+            samples.push_back(bound);
+            samples.push_back(std::nextafter((double)bound, HUGE_VAL));
+            samples.push_back(std::nextafter((double)bound, -HUGE_VAL));
+        }
+        for (size_t i = 0; i < 1000; i++) {
+            samples.push_back((double)(*buckets)[0] - 1.
+                              + (double)((i * 7919) % 1000) / 1000.
+                                * ((double)(*buckets)[size - 1]
+                                   - (double)(*buckets)[0] + 2.));
+        }
+
+        pmc_metric_s m = pmc_initialize("test_hist");
+        pmc_histogram_h h = pmc_create_histogram(m, "layout", size,
+                                                 buckets->data(), nullptr);
+
+        /* expected counts, from a plain linear search */
+        std::vector<float> expected(size + 1, 0.f);
+        for (double v : samples) {
+            size_t i = 0;
+            while (i < size && !(v <= (double)(*buckets)[i])) {
+                i++;
+            }
+            expected[i] += 1.f;
+            pmc_histogram_observe(h, v);
+        }
+        pmc_send(m);
+        pmc_destroy(m);
+
+        float total = 0.f;
+        for (size_t i = 0; i < size; i++) {
+            total += expected[i];
+            assert_eq(mock_histogram_get_bucket("test_hist_layout",
+                                                (*buckets)[i]), total);
+        }
+        assert_eq(mock_histogram_get_inf("test_hist_layout"),
+                  (float)samples.size());
+    }
+}
@@ -0,0 +1,197 @@
+#include <cmath>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "test.hh"
+#include "mock-sink.hh"
+#include "prometheus-client.h"
+
+/* the index of |value|: ceil(log2(|value|) * 2^schema), or nothing when
+ * rounding could put it in the neighbour bucket */
+static bool reference_key(double value, int schema, int *key)
+{
+    double exact = std::log2(std::fabs(value)) * std::ldexp(1., schema);
+    if (std::fabs(exact - std::round(exact)) < 1e-6) {
+        return false;
+    }
+    *key = (int)std::ceil(exact);
+    return true;
+}
+
+CREATE_TEST(native, bucket_index)
+{
+    const int SCHEMAS[6] = { -4, -1, 0, 1, 3, 8 };
+
+    for (int schema : SCHEMAS) {
+        pmc_metric_s m = pmc_initialize("test_native");
+        pmc_native_histogram_h h = pmc_create_native_histogram(m, "values",
+                                                               schema, 0);
+        ASSERT_TRUE(nullptr != h, "missing native histogram handle");
+        ASSERT_TRUE(h == pmc_get_native_histogram(m, "values"),
+                    "lookup failed");
+
+        /* deterministic values over 60 octaves, both signs */
+        std::map<int, uint64_t> expected[2];
+        uint64_t state = 42;
+        for (size_t i = 0; i < 5000; i++) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            double value = std::exp2((double)(state >> 11) * 0x1p-53 * 60.
+                                     - 30.);
+            value = (state & 1) ? -value : value;
+            int key;
+            if (!reference_key(value, schema, &key)) {
+                continue;
+            }
+            expected[value < 0.][key]++;
+            pmc_native_histogram_observe(h, value);
+        }
+
+        pmc_set_format(m, PMC_FORMAT_PROTOBUF);
+        pmc_send(m);
+        pmc_destroy(m);
+
+        ASSERT_TRUE(mock_last_was_protobuf(), "expected a protobuf body");
+        assert_eq(mock_native_get_schema("test_native_values"), schema);
+        ASSERT_TRUE(expected[0] == mock_native_get_buckets(
+                        "test_native_values", false),
+                    "positive buckets differ with schema %d", schema);
+        ASSERT_TRUE(expected[1] == mock_native_get_buckets(
+                        "test_native_values", true),
+                    "negative buckets differ with schema %d", schema);
+    }
+}
+
+CREATE_TEST(native, bucket_edges)
+{
+    pmc_metric_s m = pmc_initialize("test_native");
+    pmc_native_histogram_h a = pmc_create_native_histogram(m, "a", 0, 0);
+    pmc_native_histogram_h b = pmc_create_native_histogram(m, "b", 2, 0);
+
+    /* upper edges are inclusive */
+    pmc_native_histogram_observe(a, 1.);
+    pmc_native_histogram_observe(a, 2.);
+    pmc_native_histogram_observe(a, std::nextafter(2., 3.));
+    pmc_native_histogram_observe(a, -0.5);
+    pmc_native_histogram_observe(a, 0.);
+    pmc_native_histogram_observe(a, 1e-40);
+    pmc_native_histogram_observe(b, std::pow(2., 0.25));
+    pmc_native_histogram_observe(b, std::nextafter(std::pow(2., 0.25), 2.));
+    pmc_native_histogram_observe(b, 0.75);
+
+    pmc_set_format(m, PMC_FORMAT_PROTOBUF);
+    pmc_send(m);
+    pmc_destroy(m);
+
+    assert_eq(mock_native_get_bucket("test_native_a", false, 0), (uint64_t)1);
+    assert_eq(mock_native_get_bucket("test_native_a", false, 1), (uint64_t)1);
+    assert_eq(mock_native_get_bucket("test_native_a", false, 2), (uint64_t)1);
+    assert_eq(mock_native_get_bucket("test_native_a", true, -1), (uint64_t)1);
+    assert_eq(mock_native_get_zero_count("test_native_a"), (uint64_t)2);
+    assert_eq(mock_histogram_get_samples("test_native_a"), (uint64_t)6);
+
+    assert_eq(mock_native_get_bucket("test_native_b", false, 1), (uint64_t)1);
+    assert_eq(mock_native_get_bucket("test_native_b", false, 2), (uint64_t)1);
+    /* 0.75 = 2^-0.415: in (2^-0.5, 2^-0.25] */
+    assert_eq(mock_native_get_bucket("test_native_b", false, -1),
+              (uint64_t)1);
+}
+
+CREATE_TEST(native, max_buckets)
+{
+    pmc_metric_s m = pmc_initialize("test_native");
+    pmc_native_histogram_h h = pmc_create_native_histogram(m, "wide", 3, 4);
+
+    for (size_t i = 1; i <= 1000; i++) {
+        pmc_native_histogram_observe(h, (double)i);
+    }
+    pmc_set_format(m, PMC_FORMAT_PROTOBUF);
+    pmc_send(m);
+    pmc_destroy(m);
+
+    /* 1..1000 spans 10 octaves: 4 buckets of 4 octaves, schema -2 */
+    std::map<int, uint64_t> buckets = mock_native_get_buckets(
+        "test_native_wide", false);
+    assert_eq(mock_native_get_schema("test_native_wide"), -2);
+    ASSERT_TRUE(buckets.size() <= 4, "%zu buckets", buckets.size());
+
+    uint64_t total = 0;
+    for (auto const& bucket : buckets) {
+        total += bucket.second;
+    }
+    assert_eq(total, (uint64_t)1000);
+    /* 1 alone in (2^-4, 1], then (1, 16], (16, 256], (256, 4096] */
+    assert_eq(buckets[0], (uint64_t)1);
+    assert_eq(buckets[1], (uint64_t)15);
+    assert_eq(buckets[2], (uint64_t)240);
+    assert_eq(buckets[3], (uint64_t)744);
+}
+
+CREATE_TEST(native, text_fallback)
+{
+    const char *keys[1] = { "path" };
+    const char *values[1] = { "/" };
+
+    pmc_metric_s m = pmc_initialize("test_native");
+    pmc_native_histogram_h h = pmc_create_native_histogram_labels(
+        m, "latency", keys, values, 1, 0, 0);
+    ASSERT_TRUE(h == pmc_get_native_histogram_labels(m, "latency", keys,
+                                                     values, 1),
+                "lookup failed");
+
+    pmc_native_histogram_observe(h, -3.);
+    pmc_native_histogram_observe(h, 0.);
+    pmc_native_histogram_observe(h, 0.75);
+    pmc_native_histogram_observe(h, 3.);
+    pmc_native_histogram_observe(h, 3.5);
+    pmc_send(m);
+    pmc_destroy(m);
+
+    /* cumulative, by upper edge: [-4, -2), zero, (0.5, 1], (2, 4] */
+    const char *name = "test_native_latency{path=\"/\"}";
+    assert_eq(mock_histogram_count_buckets(name), (size_t)4);
+    assert_eq(mock_histogram_get_bucket(name, -2.f), 1.f);
+    assert_eq(mock_histogram_get_bucket(name, 2.938735877055719e-39f), 2.f);
+    assert_eq(mock_histogram_get_bucket(name, 1.f), 3.f);
+    assert_eq(mock_histogram_get_bucket(name, 4.f), 5.f);
+    assert_eq(mock_histogram_get_samples(name), (uint64_t)5);
+    assert_eq(mock_histogram_get_inf(name), 5.f);
+}
+
+CREATE_TEST(native, concurrent_observers)
+{
+    const size_t THREAD_COUNT = 4;
+    const size_t ITERATIONS = 20000;
+
+    pmc_metric_s m = pmc_initialize("test_native");
+    pmc_native_histogram_h h = pmc_create_native_histogram(m, "shared", 3,
+                                                           0);
+    pmc_set_format(m, PMC_FORMAT_PROTOBUF);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        threads.emplace_back([h, ITERATIONS]() {
+            for (size_t j = 1; j <= ITERATIONS; j++) {
+                pmc_native_histogram_observe(h, (double)j);
+            }
+        });
+    }
+    /* sends while buckets are being created */
+    for (size_t i = 0; i < 10; i++) {
+        pmc_send(m);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    pmc_send(m);
+    pmc_destroy(m);
+
+    uint64_t total = 0;
+    for (auto const& bucket : mock_native_get_buckets("test_native_shared",
+                                                      false)) {
+        total += bucket.second;
+    }
+    assert_eq(total, (uint64_t)(THREAD_COUNT * ITERATIONS));
+    assert_eq(mock_histogram_get_samples("test_native_shared"),
+              (uint64_t)(THREAD_COUNT * ITERATIONS));
+}
@@ -0,0 +1,54 @@
+#include <vector>
+
+#include "test.hh"
+#include "mock-sink.hh"
+#include "prometheus-client.h"
+
+CREATE_TEST(protobuf, all_types)
+{
+    const size_t BUCKETS = 300;
+    std::vector<float> buckets;
+    std::vector<float> values;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        buckets.push_back(0.5f * (float)(i + 1));
+        values.push_back((float)(i % 7));
+    }
+    const float small_buckets[3] = { 1.f, 2.f, 3.f };
+    /* counts are integers: rounded to 1, 1, 1 */
+    const float fractional[3] = { 0.5f, 1.f, 1.25f };
+
+    pmc_metric_s m = pmc_initialize("test_pb");
+    pmc_set_format(m, PMC_FORMAT_PROTOBUF);
+
+    pmc_create_gauge(m, "gauge", 2.5f);
+    pmc_counter_add(pmc_create_counter(m, "counter"), 12.);
+    /* long enough for multi-byte lengths at every nesting level */
+    pmc_histogram_h h = pmc_create_histogram(m, "large", BUCKETS,
+                                             buckets.data(), values.data());
+    pmc_histogram_observe(h, 1e9);
+    pmc_add_histogram(m, "fractional", 3, small_buckets, fractional);
+    pmc_send(m);
+
+    ASSERT_TRUE(mock_last_was_protobuf(), "expected a protobuf body");
+    assert_eq(mock_gauge_get_value("test_pb_gauge"), 2.5f);
+    assert_eq(mock_counter_get_value("test_pb_counter_total"), 12.);
+    assert_eq(mock_histogram_count_buckets("test_pb_large"), BUCKETS);
+
+    float total = 0.f;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        total += values[i];
+        assert_eq(mock_histogram_get_bucket("test_pb_large", buckets[i]),
+                  total);
+    }
+    assert_eq(mock_histogram_get_inf("test_pb_large"), total + 1.f);
+    assert_eq(mock_histogram_get_bucket("test_pb_fractional", 1.f), 1.f);
+    assert_eq(mock_histogram_get_inf("test_pb_fractional"), 3.f);
+
+    /* back to text, on the same set */
+    pmc_set_format(m, PMC_FORMAT_TEXT);
+    pmc_send(m);
+    pmc_destroy(m);
+
+    ASSERT_TRUE(!mock_last_was_protobuf(), "expected a text body");
+    assert_eq(mock_gauge_get_value("test_pb_gauge"), 2.5f);
+}
@@ -0,0 +1,117 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+#include "test.hh"
+#include "mock-sink.hh"
+#include "prometheus-client.h"
+
+static const uint16_t SERVE_PORT = 19187;
+
+static int scrape_connect()
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVE_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    /* the server thread may not be listening yet */
+    for (int i = 0; i < 200; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (0 == connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    ASSERT_TRUE(false, "cannot connect to pmc_serve");
+    return -1;
+}
+
+/* send *request*, read one response. Returns the body. */
+static std::string scrape(int fd, const std::string& request,
+                          std::string *status)
+{
+    std::string response;
+    char buffer[4096];
+
+    ASSERT_TRUE(write(fd, request.data(), request.size())
+                == (ssize_t)request.size(), "short write");
+
+    size_t end = std::string::npos;
+    while (std::string::npos == (end = response.find("\r\n\r\n"))) {
+        ssize_t res = read(fd, buffer, sizeof(buffer));
+        ASSERT_TRUE(res > 0, "connection closed before the header");
+        response.append(buffer, (size_t)res);
+    }
+
+    size_t field = response.find("Content-Length: ");
+    ASSERT_TRUE(field < end, "missing Content-Length");
+    size_t length = strtoul(response.c_str() + field + 16, nullptr, 10);
+
+    while (response.size() < end + 4 + length) {
+        ssize_t res = read(fd, buffer, sizeof(buffer));
+        ASSERT_TRUE(res > 0, "connection closed before the body");
+        response.append(buffer, (size_t)res);
+    }
+
+    *status = response.substr(9, 3);
+    return response.substr(end + 4, length);
+}
+
+CREATE_TEST(serve, scrape)
+{
+    pmc_metric_s m = pmc_initialize("test_serve");
+    pmc_gauge_h g = pmc_create_gauge(m, "value", 1.f);
+    pmc_counter_h c = pmc_create_counter(m, "requests");
+    assert_eq(pmc_register(m), 0);
+
+    std::thread server([]() { assert_eq(pmc_serve(SERVE_PORT), 0); });
+
+    std::string status;
+    int fd = scrape_connect();
+    const std::string request = "GET /metrics HTTP/1.1\r\nHost: x\r\n\r\n";
+
+    std::string body = scrape(fd, request, &status);
+    ASSERT_TRUE(status == "200", "bad status");
+    ASSERT_TRUE(body.find("test_serve_value 1\n") != std::string::npos,
+                "missing gauge");
+
+    /* same connection: values are rendered on each scrape */
+    pmc_gauge_set(g, 2.f);
+    pmc_counter_inc(c);
+    body = scrape(fd, request, &status);
+    ASSERT_TRUE(body.find("test_serve_value 2\n") != std::string::npos,
+                "gauge not updated");
+    ASSERT_TRUE(body.find("test_serve_requests_total 1\n")
+                != std::string::npos, "counter not updated");
+
+    /* protobuf is negotiated with the Accept header */
+    body = scrape(fd, "GET /metrics HTTP/1.1\r\n"
+                      "Accept: application/vnd.google.protobuf;"
+                      "proto=io.prometheus.client.MetricFamily;"
+                      "encoding=delimited;q=0.7,text/plain;q=0.3\r\n\r\n",
+                  &status);
+    ASSERT_TRUE(status == "200" && !body.empty() && body[0] != '#',
+                "expected a protobuf body");
+    ASSERT_TRUE(body.find("test_serve_value") != std::string::npos,
+                "missing gauge in protobuf body");
+
+    body = scrape(fd, "GET /other HTTP/1.1\r\n\r\n", &status);
+    ASSERT_TRUE(status == "404", "expected 404");
+    close(fd);
+
+    /* unregistered sets are not exposed anymore */
+    pmc_unregister(m);
+    fd = scrape_connect();
+    body = scrape(fd, request, &status);
+    ASSERT_TRUE(status == "200" && body.empty(), "set still exposed");
+    close(fd);
+
+    pmc_serve_stop();
+    server.join();
+    pmc_destroy(m);
+}
@@ -0,0 +1,23 @@
+#include "test.hh"
+#include "prometheus-client.h"
+
+/* a naming mistake must not take the process down: the sink logs it, the
+ * item is refused, and the set stays usable */
+CREATE_TEST(sink, name_collision)
+{
+    pmc_metric_s m = pmc_initialize("test_sink");
+    ASSERT_TRUE(nullptr != pmc_create_gauge(m, "requests", 1.), "first gauge");
+
+    ASSERT_TRUE(nullptr == pmc_create_counter(m, "requests"),
+                "counter over a gauge family");
+    ASSERT_TRUE(-1 == pmc_add_counter(m, "requests"),
+                "counter added over a gauge family");
+    ASSERT_TRUE(nullptr == pmc_create_gauge(m, "requests", 2.),
+                "the same gauge twice");
+
+    /* not disabled */
+    ASSERT_TRUE(nullptr != pmc_create_gauge(m, "latency", 2.),
+                "gauge after the errors");
+
+    pmc_destroy(m);
+}
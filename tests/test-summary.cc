@@ -0,0 +1,144 @@
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include "test.hh"
+#include "mock-sink.hh"
+#include "prometheus-client.h"
+
+/* the estimate of *q* must be a value whose rank is within error * n. As
+ * with the Go client's sketch, the bound is not strict: allow half again. */
+static void check_quantile(const char *name, double q, double error, double n)
+{
+    double value = mock_summary_get_quantile(name, q);
+    ASSERT_TRUE(std::fabs(value - q * n) <= 1.5 * error * n + 1.,
+                "quantile %f estimated at %f", q, value);
+}
+
+CREATE_TEST(summary, quantiles)
+{
+    const double QUANTILES[3] = { 0.5, 0.9, 0.99 };
+    const double ERROR = 0.01;
+    const uint64_t COUNT = 100000;
+
+    pmc_metric_s m = pmc_initialize("test_summary");
+    pmc_summary_h s = pmc_create_summary(m, "latency", 3, QUANTILES, ERROR);
+    ASSERT_TRUE(nullptr != s, "missing summary handle");
+    ASSERT_TRUE(s == pmc_get_summary(m, "latency"), "lookup failed");
+
+    /* 1..COUNT, in a scrambled order: 7919 is prime with COUNT */
+    double sum = 0.;
+    for (uint64_t i = 0; i < COUNT; i++) {
+        double value = (double)((i * 7919) % COUNT + 1);
+        sum += value;
+        pmc_summary_observe(s, value);
+    }
+    pmc_summary_observe(s, NAN);
+    pmc_send(m);
+
+    assert_eq(mock_summary_get_samples("test_summary_latency"), COUNT);
+    assert_eq(mock_summary_get_sum("test_summary_latency"), sum);
+    for (double q : QUANTILES) {
+        check_quantile("test_summary_latency", q, ERROR, (double)COUNT);
+    }
+
+    pmc_set_format(m, PMC_FORMAT_PROTOBUF);
+    pmc_send(m);
+    pmc_destroy(m);
+
+    ASSERT_TRUE(mock_last_was_protobuf(), "expected a protobuf body");
+    assert_eq(mock_summary_get_samples("test_summary_latency"), COUNT);
+    for (double q : QUANTILES) {
+        check_quantile("test_summary_latency", q, ERROR, (double)COUNT);
+    }
+}
+
+CREATE_TEST(summary, labels_and_empty)
+{
+    const double QUANTILES[2] = { 0.5, 0.99 };
+    const char *keys[1] = { "path" };
+    const char *root[1] = { "/" };
+    const char *api[1] = { "/api" };
+
+    pmc_metric_s m = pmc_initialize("test_summary");
+    pmc_summary_h a = pmc_create_summary_labels(m, "latency", keys, root, 1,
+                                                2, QUANTILES, 0.001);
+    pmc_create_summary_labels(m, "latency", keys, api, 1, 2, QUANTILES, 0.001);
+    pmc_set_help(m, "latency", "request latency");
+    pmc_summary_observe(a, 3.);
+    pmc_send(m);
+    pmc_destroy(m);
+
+    assert_eq(mock_get_help("test_summary_latency"),
+              std::string("request latency"));
+    assert_eq(mock_summary_get_quantile("test_summary_latency{path=\"/\"}",
+                                        0.99), 3.);
+    assert_eq(mock_summary_get_samples("test_summary_latency{path=\"/api\"}"),
+              (uint64_t)0);
+    ASSERT_TRUE(std::isnan(mock_summary_get_quantile(
+                    "test_summary_latency{path=\"/api\"}", 0.5)),
+                "empty summaries report NaN");
+}
+
+CREATE_TEST(summary, concurrent_observers)
+{
+    const double QUANTILES[1] = { 0.5 };
+    const size_t THREAD_COUNT = 4;
+    const size_t ITERATIONS = 20000;
+
+    pmc_metric_s m = pmc_initialize("test_summary");
+    pmc_summary_h s = pmc_create_summary(m, "shared", 1, QUANTILES, 0.01);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        threads.emplace_back([s, ITERATIONS]() {
+            for (size_t j = 0; j < ITERATIONS; j++) {
+                pmc_summary_observe(s, (double)(j % 100));
+            }
+        });
+    }
+    /* sends while the sketch is being merged into */
+    for (size_t i = 0; i < 10; i++) {
+        pmc_send(m);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    pmc_send(m);
+    pmc_destroy(m);
+
+    assert_eq(mock_summary_get_samples("test_summary_shared"),
+              (uint64_t)(THREAD_COUNT * ITERATIONS));
+    check_quantile("test_summary_shared", 0.5, 0.01, 100.);
+}
+
+CREATE_TEST(summary, windowed)
+{
+    const double QUANTILES[1] = { 0.5 };
+
+    pmc_metric_s m = pmc_initialize("test_summary");
+    pmc_summary_h s = pmc_create_windowed_summary(m, "recent", 1, QUANTILES,
+                                                  0.01, 200, 2);
+    for (size_t i = 0; i < 100; i++) {
+        pmc_summary_observe(s, 1000.);
+    }
+    pmc_send(m);
+    assert_eq(mock_summary_get_quantile("test_summary_recent", 0.5), 1000.);
+
+    /* older observations left the quantiles, not _count and _sum */
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    for (size_t i = 0; i < 10; i++) {
+        pmc_summary_observe(s, 1.);
+    }
+    pmc_send(m);
+    assert_eq(mock_summary_get_quantile("test_summary_recent", 0.5), 1.);
+    assert_eq(mock_summary_get_samples("test_summary_recent"), (uint64_t)110);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    pmc_send(m);
+    pmc_destroy(m);
+    ASSERT_TRUE(std::isnan(mock_summary_get_quantile("test_summary_recent",
+                                                     0.5)),
+                "expected an empty window");
+}